@@ -0,0 +1,600 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "cacheindex.h"
+
+/*
+ * the cache index is a memory-mapped open-addressing hash table
+ * stored in a single file, mapping a tahoe path to the metadata of
+ * the cached node.  it lets us know what is cached and whether it is
+ * fresh without stat() and getxattr() on every cache file, and it
+ * survives restarts.
+ *
+ * the xattrs of the cache files remain the authoritative data.  every
+ * slot has a checksum, and a slot torn by a crash is simply ignored,
+ * which makes the caller fall back to the xattrs.  the table is
+ * enlarged by building a new file and renaming it over the old one,
+ * so a crash during the resize leaves the old table intact.
+ */
+#define CACHEINDEX_MAGIC 0x54464958	/* "TFIX" */
+#define CACHEINDEX_VERSION 2
+#define CACHEINDEX_HEADER_SIZE 4096
+#define CACHEINDEX_INITIAL_SLOTS (1 << 16)
+#define CACHEINDEX_MAX_LOAD(nslots) ((nslots) / 10 * 7)
+
+#define CACHEINDEX_SLOT_EMPTY 0
+#define CACHEINDEX_SLOT_USED 1
+#define CACHEINDEX_SLOT_DELETED 2
+
+typedef struct cacheindex_header {
+  u_int32_t magic;
+  u_int32_t version;
+  u_int64_t nslots;
+  u_int64_t nused;
+  u_int64_t ndeleted;
+  u_int32_t clean;	/* unmapped cleanly or not. */
+} cacheindex_header_t;
+
+typedef struct cacheindex_slot {
+  u_int64_t key;	/* two independent hashes of the path. */
+  u_int64_t key2;
+  u_int64_t size;
+  double link_creation_time;
+  double link_modification_time;
+  u_int64_t cap_hash;
+  u_int64_t fingerprint;
+  u_int8_t state;
+  u_int8_t type;
+  u_int8_t mutable;
+  u_int8_t reserved;
+  u_int32_t checksum;
+} cacheindex_slot_t;
+
+static char *cacheindex_path = NULL;
+static int cacheindex_fd = -1;
+static void *cacheindex_map = NULL;
+static size_t cacheindex_map_size = 0;
+static pthread_mutex_t cacheindex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHEINDEX_HEADER() ((cacheindex_header_t *)cacheindex_map)
+#define CACHEINDEX_SLOTS()						\
+  ((cacheindex_slot_t *)((char *)cacheindex_map + CACHEINDEX_HEADER_SIZE))
+
+static int cacheindex_open(const char *, u_int64_t, int *, void **, size_t *);
+static int cacheindex_recover(void);
+static int cacheindex_grow(void);
+static cacheindex_slot_t *cacheindex_find(u_int64_t, u_int64_t, int);
+static u_int64_t cacheindex_hash_update(u_int64_t, const void *, size_t);
+static u_int64_t cacheindex_hash2(const char *);
+static u_int32_t cacheindex_checksum(const cacheindex_slot_t *);
+static int cacheindex_slot_is_valid(const cacheindex_slot_t *);
+
+int
+cacheindex_initialize(const char *index_path)
+{
+  assert(index_path != NULL);
+
+  pthread_mutex_lock(&cacheindex_lock);
+  cacheindex_path = strdup(index_path);
+  if (cacheindex_path == NULL) {
+    warn("failed to duplicate a string (%s).", index_path);
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+
+  if (cacheindex_open(cacheindex_path, CACHEINDEX_INITIAL_SLOTS,
+		      &cacheindex_fd, &cacheindex_map,
+		      &cacheindex_map_size) == -1) {
+    warnx("failed to open the cache index %s.", cacheindex_path);
+    free(cacheindex_path);
+    cacheindex_path = NULL;
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+
+  if (!CACHEINDEX_HEADER()->clean) {
+    /* we crashed last time.  drop torn slots and recount. */
+    cacheindex_recover();
+  }
+  CACHEINDEX_HEADER()->clean = 0;
+  pthread_mutex_unlock(&cacheindex_lock);
+
+  return (0);
+}
+
+int
+cacheindex_terminate(void)
+{
+  pthread_mutex_lock(&cacheindex_lock);
+  if (cacheindex_map) {
+    CACHEINDEX_HEADER()->clean = 1;
+    if (msync(cacheindex_map, cacheindex_map_size, MS_SYNC) == -1) {
+      warn("failed to sync the cache index %s.", cacheindex_path);
+    }
+    munmap(cacheindex_map, cacheindex_map_size);
+    cacheindex_map = NULL;
+    cacheindex_map_size = 0;
+  }
+  if (cacheindex_fd != -1) {
+    close(cacheindex_fd);
+    cacheindex_fd = -1;
+  }
+  free(cacheindex_path);
+  cacheindex_path = NULL;
+  pthread_mutex_unlock(&cacheindex_lock);
+
+  return (0);
+}
+
+/*
+ * look up the record of the node specified as the path parameter.
+ * returns -1 if no valid record is found.
+ */
+int
+cacheindex_lookup(const char *path, cacheindex_record_t *recordp)
+{
+  assert(path != NULL);
+  assert(recordp != NULL);
+
+  u_int64_t key = cacheindex_hash(path);
+  u_int64_t key2 = cacheindex_hash2(path);
+
+  pthread_mutex_lock(&cacheindex_lock);
+  if (cacheindex_map == NULL) {
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+  cacheindex_slot_t *slotp = cacheindex_find(key, key2, 0);
+  if (slotp == NULL) {
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+  recordp->type = slotp->type;
+  recordp->mutable = slotp->mutable;
+  recordp->size = slotp->size;
+  recordp->link_creation_time = slotp->link_creation_time;
+  recordp->link_modification_time = slotp->link_modification_time;
+  recordp->cap_hash = slotp->cap_hash;
+  recordp->fingerprint = slotp->fingerprint;
+  pthread_mutex_unlock(&cacheindex_lock);
+
+  return (0);
+}
+
+/*
+ * store the record of the node specified as the path parameter.
+ */
+int
+cacheindex_store(const char *path, const cacheindex_record_t *recordp)
+{
+  assert(path != NULL);
+  assert(recordp != NULL);
+
+  u_int64_t key = cacheindex_hash(path);
+  u_int64_t key2 = cacheindex_hash2(path);
+
+  pthread_mutex_lock(&cacheindex_lock);
+  if (cacheindex_map == NULL) {
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+
+  cacheindex_header_t *headerp = CACHEINDEX_HEADER();
+  if (headerp->nused + headerp->ndeleted + 1
+      > CACHEINDEX_MAX_LOAD(headerp->nslots)) {
+    if (cacheindex_grow() == -1) {
+      warnx("failed to enlarge the cache index %s.", cacheindex_path);
+      pthread_mutex_unlock(&cacheindex_lock);
+      return (-1);
+    }
+    headerp = CACHEINDEX_HEADER();
+  }
+
+  cacheindex_slot_t *slotp = cacheindex_find(key, key2, 1);
+  if (slotp == NULL) {
+    pthread_mutex_unlock(&cacheindex_lock);
+    return (-1);
+  }
+  if (slotp->state != CACHEINDEX_SLOT_USED) {
+    if (slotp->state == CACHEINDEX_SLOT_DELETED) {
+      headerp->ndeleted--;
+    }
+    headerp->nused++;
+  }
+
+  cacheindex_slot_t slot;
+  memset(&slot, 0, sizeof(cacheindex_slot_t));
+  slot.key = key;
+  slot.key2 = key2;
+  slot.size = recordp->size;
+  slot.link_creation_time = recordp->link_creation_time;
+  slot.link_modification_time = recordp->link_modification_time;
+  slot.cap_hash = recordp->cap_hash;
+  slot.fingerprint = recordp->fingerprint;
+  slot.state = CACHEINDEX_SLOT_USED;
+  slot.type = recordp->type;
+  slot.mutable = recordp->mutable;
+  slot.checksum = cacheindex_checksum(&slot);
+  if (memcmp(slotp, &slot, sizeof(cacheindex_slot_t)) != 0) {
+    /* don't dirty the page if nothing changed. */
+    memcpy(slotp, &slot, sizeof(cacheindex_slot_t));
+  }
+  pthread_mutex_unlock(&cacheindex_lock);
+
+  return (0);
+}
+
+/*
+ * remove the record of the node specified as the path parameter.
+ */
+void
+cacheindex_remove(const char *path)
+{
+  assert(path != NULL);
+
+  u_int64_t key = cacheindex_hash(path);
+  u_int64_t key2 = cacheindex_hash2(path);
+
+  pthread_mutex_lock(&cacheindex_lock);
+  if (cacheindex_map == NULL) {
+    pthread_mutex_unlock(&cacheindex_lock);
+    return;
+  }
+  cacheindex_slot_t *slotp = cacheindex_find(key, key2, 0);
+  if (slotp) {
+    /* a single byte store.  it cannot be torn. */
+    slotp->state = CACHEINDEX_SLOT_DELETED;
+    CACHEINDEX_HEADER()->nused--;
+    CACHEINDEX_HEADER()->ndeleted++;
+  }
+  pthread_mutex_unlock(&cacheindex_lock);
+}
+
+void
+cacheindex_record_from_tstat(const tahoefs_stat_t *tstatp,
+			     cacheindex_record_t *recordp)
+{
+  assert(tstatp != NULL);
+  assert(recordp != NULL);
+
+  memset(recordp, 0, sizeof(cacheindex_record_t));
+  recordp->type = tstatp->type;
+  recordp->mutable = tstatp->mutable;
+  recordp->size = tstatp->size;
+  recordp->link_creation_time = tstatp->link_creation_time;
+  recordp->link_modification_time = tstatp->link_modification_time;
+  recordp->cap_hash = cacheindex_hash(TAHOEFS_CAP(tstatp->ro_uri));
+
+  /*
+   * the fingerprint covers everything we persist about the node, so
+   * that unchanged metadata can be detected without comparing the
+   * records.
+   */
+  u_int64_t hash = recordp->cap_hash;
+  const char *rw_uri = TAHOEFS_CAP(tstatp->rw_uri);
+  const char *verify_uri = TAHOEFS_CAP(tstatp->verify_uri);
+  hash = cacheindex_hash_update(hash, rw_uri, strlen(rw_uri));
+  hash = cacheindex_hash_update(hash, verify_uri, strlen(verify_uri));
+  hash = cacheindex_hash_update(hash, recordp, sizeof(cacheindex_record_t));
+  recordp->fingerprint = hash;
+}
+
+/*
+ * the 64-bit FNV-1a hash of a string.
+ */
+u_int64_t
+cacheindex_hash(const char *s)
+{
+  assert(s != NULL);
+
+  return (cacheindex_hash_update(14695981039346656037ULL, s, strlen(s)));
+}
+
+/*
+ * continue the 64-bit FNV-1a hash over the buffer.
+ */
+static u_int64_t
+cacheindex_hash_update(u_int64_t hash, const void *buf, size_t len)
+{
+  assert(buf != NULL);
+
+  const unsigned char *p = buf;
+  while (len--) {
+    hash ^= *p++;
+    hash *= 1099511628211ULL;
+  }
+  return (hash);
+}
+
+/*
+ * open (or create) the index file and map it.
+ */
+static int
+cacheindex_open(const char *index_path, u_int64_t nslots, int *fdp,
+		void **mapp, size_t *map_sizep)
+{
+  assert(index_path != NULL);
+  assert(fdp != NULL);
+  assert(mapp != NULL);
+  assert(map_sizep != NULL);
+
+  int fd = open(index_path, O_RDWR|O_CREAT, S_IRUSR|S_IWUSR);
+  if (fd == -1) {
+    warn("failed to open %s.", index_path);
+    return (-1);
+  }
+
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    warn("failed to stat %s.", index_path);
+    close(fd);
+    return (-1);
+  }
+
+  cacheindex_header_t header;
+  int initialize = 1;
+  if (stbuf.st_size >= CACHEINDEX_HEADER_SIZE) {
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header)
+	&& header.magic == CACHEINDEX_MAGIC
+	&& header.version == CACHEINDEX_VERSION
+	&& header.nslots > 0 && (header.nslots & (header.nslots - 1)) == 0
+	&& (off_t)(CACHEINDEX_HEADER_SIZE
+		   + header.nslots * sizeof(cacheindex_slot_t))
+	   == stbuf.st_size) {
+      initialize = 0;
+      nslots = header.nslots;
+    } else {
+      warnx("discarding the broken or old cache index %s.", index_path);
+    }
+  }
+
+  size_t map_size = CACHEINDEX_HEADER_SIZE
+    + nslots * sizeof(cacheindex_slot_t);
+  if (initialize) {
+    /* ftruncate() fills the file with zeros, that is, empty slots. */
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, map_size) == -1) {
+      warn("failed to resize %s.", index_path);
+      close(fd);
+      return (-1);
+    }
+  }
+
+  void *map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED) {
+    warn("failed to map %s.", index_path);
+    close(fd);
+    return (-1);
+  }
+
+  if (initialize) {
+    cacheindex_header_t *headerp = (cacheindex_header_t *)map;
+    headerp->magic = CACHEINDEX_MAGIC;
+    headerp->version = CACHEINDEX_VERSION;
+    headerp->nslots = nslots;
+    headerp->nused = 0;
+    headerp->ndeleted = 0;
+    headerp->clean = 1;
+  }
+
+  *fdp = fd;
+  *mapp = map;
+  *map_sizep = map_size;
+
+  return (0);
+}
+
+/*
+ * scan all the slots after a crash.  slots with a bad checksum are
+ * turned into deleted slots, and the counters are recomputed.
+ */
+static int
+cacheindex_recover(void)
+{
+  cacheindex_header_t *headerp = CACHEINDEX_HEADER();
+  cacheindex_slot_t *slotsp = CACHEINDEX_SLOTS();
+  u_int64_t nused = 0, ndeleted = 0;
+  u_int64_t i;
+  for (i = 0; i < headerp->nslots; i++) {
+    if (slotsp[i].state == CACHEINDEX_SLOT_EMPTY) {
+      continue;
+    }
+    if (slotsp[i].state == CACHEINDEX_SLOT_USED
+	&& cacheindex_slot_is_valid(&slotsp[i])) {
+      nused++;
+      continue;
+    }
+    slotsp[i].state = CACHEINDEX_SLOT_DELETED;
+    ndeleted++;
+  }
+  headerp->nused = nused;
+  headerp->ndeleted = ndeleted;
+
+  return (0);
+}
+
+/*
+ * build a new table with twice slots in a shadow file, and replace
+ * the current one atomically with rename().
+ */
+static int
+cacheindex_grow(void)
+{
+  char new_path[MAXPATHLEN];
+  snprintf(new_path, sizeof(new_path), "%s.new", cacheindex_path);
+  unlink(new_path);
+
+  cacheindex_header_t *headerp = CACHEINDEX_HEADER();
+  u_int64_t nslots = headerp->nslots * 2;
+  if (headerp->nused + 1 <= CACHEINDEX_MAX_LOAD(headerp->nslots)) {
+    /* it's crowded by deleted slots.  just rebuild in the same size. */
+    nslots = headerp->nslots;
+  }
+
+  int new_fd;
+  void *new_map;
+  size_t new_map_size;
+  if (cacheindex_open(new_path, nslots, &new_fd, &new_map,
+		      &new_map_size) == -1) {
+    return (-1);
+  }
+
+  /* move all the valid slots. */
+  cacheindex_slot_t *old_slotsp = CACHEINDEX_SLOTS();
+  cacheindex_slot_t *new_slotsp
+    = (cacheindex_slot_t *)((char *)new_map + CACHEINDEX_HEADER_SIZE);
+  u_int64_t nused = 0;
+  u_int64_t i;
+  for (i = 0; i < headerp->nslots; i++) {
+    if (old_slotsp[i].state != CACHEINDEX_SLOT_USED
+	|| !cacheindex_slot_is_valid(&old_slotsp[i])) {
+      continue;
+    }
+    u_int64_t j = old_slotsp[i].key & (nslots - 1);
+    while (new_slotsp[j].state != CACHEINDEX_SLOT_EMPTY) {
+      j = (j + 1) & (nslots - 1);
+    }
+    memcpy(&new_slotsp[j], &old_slotsp[i], sizeof(cacheindex_slot_t));
+    nused++;
+  }
+  cacheindex_header_t *new_headerp = (cacheindex_header_t *)new_map;
+  new_headerp->nused = nused;
+  new_headerp->ndeleted = 0;
+  new_headerp->clean = 0;
+
+  if (msync(new_map, new_map_size, MS_SYNC) == -1
+      || rename(new_path, cacheindex_path) == -1) {
+    warn("failed to replace the cache index %s.", cacheindex_path);
+    munmap(new_map, new_map_size);
+    close(new_fd);
+    unlink(new_path);
+    return (-1);
+  }
+
+  munmap(cacheindex_map, cacheindex_map_size);
+  close(cacheindex_fd);
+  cacheindex_fd = new_fd;
+  cacheindex_map = new_map;
+  cacheindex_map_size = new_map_size;
+
+  return (0);
+}
+
+/*
+ * find the slot for the keys.  if the for_store parameter is true and
+ * no slot has the keys, the first reusable slot is returned.
+ */
+static cacheindex_slot_t *
+cacheindex_find(u_int64_t key, u_int64_t key2, int for_store)
+{
+  cacheindex_header_t *headerp = CACHEINDEX_HEADER();
+  cacheindex_slot_t *slotsp = CACHEINDEX_SLOTS();
+  u_int64_t mask = headerp->nslots - 1;
+  cacheindex_slot_t *reusablep = NULL;
+
+  u_int64_t i = key & mask;
+  u_int64_t nprobes;
+  for (nprobes = 0; nprobes < headerp->nslots; nprobes++) {
+    cacheindex_slot_t *slotp = &slotsp[i];
+    if (slotp->state == CACHEINDEX_SLOT_EMPTY) {
+      if (!for_store) {
+	return (NULL);
+      }
+      return (reusablep ? reusablep : slotp);
+    }
+    if (slotp->state == CACHEINDEX_SLOT_USED
+	&& slotp->key == key && slotp->key2 == key2) {
+      if (cacheindex_slot_is_valid(slotp)) {
+	return (slotp);
+      }
+      /* torn.  it's as good as a deleted slot. */
+    }
+    if (slotp->state != CACHEINDEX_SLOT_USED && reusablep == NULL) {
+      reusablep = slotp;
+    }
+    i = (i + 1) & mask;
+  }
+
+  return (for_store ? reusablep : NULL);
+}
+
+/*
+ * another 64-bit hash of a string (djb2 variant), used to verify that
+ * the slot is really for the path.
+ */
+static u_int64_t
+cacheindex_hash2(const char *s)
+{
+  assert(s != NULL);
+
+  u_int64_t hash = 5381;
+  while (*s) {
+    hash = (hash * 33) ^ (unsigned char)*s++;
+  }
+  return (hash);
+}
+
+static u_int32_t
+cacheindex_checksum(const cacheindex_slot_t *slotp)
+{
+  assert(slotp != NULL);
+
+  /* FNV-1a over the slot except the checksum field. */
+  const unsigned char *p = (const unsigned char *)slotp;
+  size_t len = offsetof(cacheindex_slot_t, checksum);
+  u_int32_t hash = 2166136261U;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+static int
+cacheindex_slot_is_valid(const cacheindex_slot_t *slotp)
+{
+  assert(slotp != NULL);
+
+  return (slotp->checksum == cacheindex_checksum(slotp));
+}
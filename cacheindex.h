@@ -0,0 +1,47 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _CACHEINDEX_H_
+#define _CACHEINDEX_H_
+
+typedef struct cacheindex_record {
+  int type;
+  int mutable;
+  u_int64_t size;
+  double link_creation_time;
+  double link_modification_time;
+  u_int64_t cap_hash;	/* cacheindex_hash() of ro_uri. */
+  u_int64_t fingerprint;	/* a hash of all the fields above and caps. */
+} cacheindex_record_t;
+
+int cacheindex_initialize(const char *);
+int cacheindex_terminate(void);
+int cacheindex_lookup(const char *, cacheindex_record_t *);
+int cacheindex_store(const char *, const cacheindex_record_t *);
+void cacheindex_remove(const char *);
+void cacheindex_record_from_tstat(const tahoefs_stat_t *,
+				  cacheindex_record_t *);
+u_int64_t cacheindex_hash(const char *);
+
+#endif
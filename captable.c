@@ -0,0 +1,252 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "captable.h"
+
+/*
+ * caps are long strings and many nodes share the same ones (a file
+ * linked from several directories, the same node seen by the listing
+ * of the parent and by its own JSON).  they are interned here once
+ * and tahoefs_stat_t{} only keeps counted references to them, so that
+ * a cached node costs a few dozen bytes plus its unique caps.
+ */
+#define CAPTABLE_INITIAL_BUCKETS 1024
+
+typedef struct captable_entry {
+  struct captable_entry *next;
+  u_int32_t hash;
+  u_int32_t refcnt;
+  char cap[1];
+} captable_entry_t;
+
+#define CAPTABLE_CAP_TO_ENTRY(cap)					\
+  ((captable_entry_t *)((char *)(cap) - offsetof(captable_entry_t, cap)))
+
+static captable_entry_t **captable_buckets = NULL;
+static size_t captable_nbuckets = 0;
+static size_t captable_nentries = 0;
+static pthread_mutex_t captable_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static u_int32_t captable_hash(const char *, size_t);
+static void captable_grow(void);
+
+/*
+ * returns a reference to the interned copy of the cap.  an empty cap
+ * is represented as NULL.  the reference must be released by
+ * captable_release().
+ */
+const char *
+captable_intern(const char *cap)
+{
+  if (cap == NULL) {
+    return (NULL);
+  }
+
+  return (captable_intern_n(cap, strlen(cap)));
+}
+
+/*
+ * same as captable_intern(), but the cap is given as the first
+ * cap_len bytes of the cap parameter, which need not be NUL
+ * terminated.  this lets a parser intern a cap right out of its
+ * input.
+ */
+const char *
+captable_intern_n(const char *cap, size_t cap_len)
+{
+  if (cap == NULL || cap_len == 0) {
+    return (NULL);
+  }
+
+  u_int32_t hash = captable_hash(cap, cap_len);
+
+  pthread_mutex_lock(&captable_lock);
+  if (captable_buckets == NULL || captable_nentries >= captable_nbuckets) {
+    captable_grow();
+    if (captable_buckets == NULL) {
+      pthread_mutex_unlock(&captable_lock);
+      return (NULL);
+    }
+  }
+
+  captable_entry_t **bucketp = &captable_buckets[hash % captable_nbuckets];
+  captable_entry_t *entryp;
+  for (entryp = *bucketp; entryp; entryp = entryp->next) {
+    if (entryp->hash == hash && strncmp(entryp->cap, cap, cap_len) == 0
+	&& entryp->cap[cap_len] == '\0') {
+      entryp->refcnt++;
+      pthread_mutex_unlock(&captable_lock);
+      return (entryp->cap);
+    }
+  }
+
+  entryp = malloc(offsetof(captable_entry_t, cap) + cap_len + 1);
+  if (entryp == NULL) {
+    warn("failed to allocate memory for a cap.");
+    pthread_mutex_unlock(&captable_lock);
+    return (NULL);
+  }
+  entryp->hash = hash;
+  entryp->refcnt = 1;
+  memcpy(entryp->cap, cap, cap_len);
+  entryp->cap[cap_len] = '\0';
+  entryp->next = *bucketp;
+  *bucketp = entryp;
+  captable_nentries++;
+  pthread_mutex_unlock(&captable_lock);
+
+  return (entryp->cap);
+}
+
+/*
+ * returns a new reference to an interned cap.
+ */
+const char *
+captable_ref(const char *cap)
+{
+  if (cap == NULL) {
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&captable_lock);
+  CAPTABLE_CAP_TO_ENTRY(cap)->refcnt++;
+  pthread_mutex_unlock(&captable_lock);
+
+  return (cap);
+}
+
+void
+captable_release(const char *cap)
+{
+  if (cap == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&captable_lock);
+  captable_entry_t *entryp = CAPTABLE_CAP_TO_ENTRY(cap);
+  assert(entryp->refcnt > 0);
+  if (--entryp->refcnt > 0) {
+    pthread_mutex_unlock(&captable_lock);
+    return;
+  }
+
+  captable_entry_t **prevpp = &captable_buckets[entryp->hash
+						% captable_nbuckets];
+  while (*prevpp != entryp) {
+    prevpp = &(*prevpp)->next;
+  }
+  *prevpp = entryp->next;
+  captable_nentries--;
+  pthread_mutex_unlock(&captable_lock);
+
+  free(entryp);
+}
+
+/*
+ * copy the tahoefs_stat_t{} structure with new references to its
+ * caps.  the dstp parameter must not hold any references.
+ */
+void
+captable_tstat_copy(tahoefs_stat_t *dstp, const tahoefs_stat_t *srcp)
+{
+  assert(dstp != NULL);
+  assert(srcp != NULL);
+
+  memcpy(dstp, srcp, sizeof(tahoefs_stat_t));
+  dstp->rw_uri = captable_ref(srcp->rw_uri);
+  dstp->ro_uri = captable_ref(srcp->ro_uri);
+  dstp->verify_uri = captable_ref(srcp->verify_uri);
+}
+
+/*
+ * release the references held by the tahoefs_stat_t{} structure.
+ */
+void
+captable_tstat_release(tahoefs_stat_t *tstatp)
+{
+  assert(tstatp != NULL);
+
+  captable_release(tstatp->rw_uri);
+  captable_release(tstatp->ro_uri);
+  captable_release(tstatp->verify_uri);
+  tstatp->rw_uri = NULL;
+  tstatp->ro_uri = NULL;
+  tstatp->verify_uri = NULL;
+}
+
+static u_int32_t
+captable_hash(const char *s, size_t len)
+{
+  assert(s != NULL);
+
+  /* FNV-1a */
+  u_int32_t hash = 2166136261U;
+  while (len-- > 0) {
+    hash ^= (unsigned char)*s++;
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+/*
+ * double the hash table.  the caller must hold captable_lock.
+ */
+static void
+captable_grow(void)
+{
+  size_t nbuckets = captable_nbuckets ? captable_nbuckets * 2
+    : CAPTABLE_INITIAL_BUCKETS;
+  captable_entry_t **buckets = calloc(nbuckets, sizeof(captable_entry_t *));
+  if (buckets == NULL) {
+    warn("failed to allocate memory for the cap table.");
+    return;
+  }
+
+  size_t i;
+  for (i = 0; i < captable_nbuckets; i++) {
+    captable_entry_t *entryp = captable_buckets[i];
+    while (entryp) {
+      captable_entry_t *nextp = entryp->next;
+      entryp->next = buckets[entryp->hash % nbuckets];
+      buckets[entryp->hash % nbuckets] = entryp;
+      entryp = nextp;
+    }
+  }
+  free(captable_buckets);
+  captable_buckets = buckets;
+  captable_nbuckets = nbuckets;
+}
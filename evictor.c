@@ -0,0 +1,723 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "evictor.h"
+
+#define EVICTOR_INITIAL_BUCKETS 4096
+
+/*
+ * the evictor keeps the cached files of the file cache in a hash
+ * table and in a list ordered by the last access, with the total
+ * bytes and files.  when the total exceeds the high watermark of the
+ * budget (config.cache_max_size and config.cache_max_files), the
+ * evictor thread removes the least recently used files until it goes
+ * below the low watermark.  a held file (open, or waiting for upload)
+ * and a pinned file are never evicted.
+ */
+typedef struct evictor_entry {
+  struct evictor_entry *hash_next;
+  struct evictor_entry *lru_prev;	/* more recently used. */
+  struct evictor_entry *lru_next;	/* less recently used. */
+  char *key;
+  u_int64_t size;
+  time_t atime;
+  int holds;
+  int pinned;
+  int cached;	/* in the accounting and the list. */
+} evictor_entry_t;
+
+static evictor_entry_t **evictor_buckets = NULL;
+static size_t evictor_nbuckets = 0;
+static size_t evictor_nentries = 0;
+static evictor_entry_t *evictor_lru_head = NULL;
+static evictor_entry_t *evictor_lru_tail = NULL;
+static u_int64_t evictor_bytes = 0;
+static u_int64_t evictor_files = 0;
+static pthread_mutex_t evictor_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t evictor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t evictor_thread;
+static int evictor_running = 0;
+static int evictor_wanted = 0;
+static evictor_func_t evictor_func = NULL;
+static int evictor_ready = 0;	/* the existing files are all added. */
+static evictor_usage_func_t evictor_usage_func = NULL;
+
+/*
+ * with a usage function, the cache is shared with other processes
+ * which don't signal us.  check it this often.
+ */
+#define EVICTOR_SHARED_CHECK_INTERVAL 10	/* in seconds. */
+
+static void *evictor_main(void *);
+static void evictor_wait(void);
+static int evictor_is_over(int);
+static evictor_entry_t *evictor_pick_victim(void);
+static evictor_entry_t *evictor_find(const char *, int);
+static void evictor_grow(void);
+static void evictor_lru_insert(evictor_entry_t *);
+static void evictor_lru_unlink(evictor_entry_t *);
+static void evictor_lru_sort(void);
+static void evictor_uncount(evictor_entry_t *);
+static void evictor_free_if_unused(evictor_entry_t *);
+static unsigned int evictor_hash(const char *);
+
+/*
+ * start the evictor thread.  the evict function is called with the
+ * key of each file to be evicted.  it must forget the file by
+ * evictor_drop() while no one can hold it, and return EBUSY without
+ * removing the file if it is held.  a file held by another process
+ * can be added back by evictor_add() to try the others first.
+ * nothing is evicted until evictor_scanned() tells that the files
+ * already in the cache have been added.  if no budget is configured,
+ * only the accounting is done.  if the usage function is given, the
+ * budget is checked against the usage it returns instead of the files
+ * known to this process.
+ */
+int
+evictor_start(evictor_func_t func, evictor_usage_func_t usage_func)
+{
+  assert(func != NULL);
+
+  if (config.cache_max_size <= 0 && config.cache_max_files <= 0) {
+    /* the cache is unlimited. */
+    return (0);
+  }
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_func = func;
+  evictor_usage_func = usage_func;
+  evictor_running = 1;
+  if (pthread_create(&evictor_thread, NULL, evictor_main, NULL) != 0) {
+    warnx("failed to create the evictor thread.");
+    evictor_running = 0;
+    pthread_mutex_unlock(&evictor_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+
+  return (0);
+}
+
+int
+evictor_stop(void)
+{
+  pthread_mutex_lock(&evictor_lock);
+  if (evictor_running) {
+    evictor_running = 0;
+    pthread_cond_signal(&evictor_cond);
+    pthread_mutex_unlock(&evictor_lock);
+    pthread_join(evictor_thread, NULL);
+    pthread_mutex_lock(&evictor_lock);
+  }
+
+  size_t i;
+  for (i = 0; i < evictor_nbuckets; i++) {
+    while (evictor_buckets[i]) {
+      evictor_entry_t *entryp = evictor_buckets[i];
+      evictor_buckets[i] = entryp->hash_next;
+      free(entryp->key);
+      free(entryp);
+    }
+  }
+  free(evictor_buckets);
+  evictor_buckets = NULL;
+  evictor_nbuckets = evictor_nentries = 0;
+  evictor_lru_head = evictor_lru_tail = NULL;
+  evictor_bytes = evictor_files = 0;
+  pthread_mutex_unlock(&evictor_lock);
+
+  return (0);
+}
+
+/*
+ * account a file of the size cached for the key.  the atime
+ * parameter is the last access time, or 0 for now.  a file already
+ * accounted is updated.
+ */
+void
+evictor_add(const char *key, u_int64_t size, time_t atime)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 1);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&evictor_lock);
+    return;
+  }
+  if (entryp->cached) {
+    evictor_uncount(entryp);
+  }
+  entryp->size = size;
+  entryp->atime = atime ? atime : time(NULL);
+  entryp->cached = 1;
+  evictor_bytes += size;
+  evictor_files++;
+  evictor_lru_insert(entryp);
+
+  if (evictor_running && !evictor_wanted && evictor_is_over(1)) {
+    evictor_wanted = 1;
+    pthread_cond_signal(&evictor_cond);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * mark the file of the key as used right now.
+ */
+void
+evictor_touch(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 0);
+  if (entryp && entryp->cached) {
+    entryp->atime = time(NULL);
+    evictor_lru_unlink(entryp);
+    evictor_lru_insert(entryp);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * forget the file of the key.  it has been removed from the cache.
+ */
+void
+evictor_remove(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 0);
+  if (entryp) {
+    if (entryp->cached) {
+      evictor_uncount(entryp);
+    }
+    entryp->pinned = 0;
+    evictor_free_if_unused(entryp);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * forget the file of the key unless it is held or pinned.  returns
+ * true if the caller may remove it.
+ */
+int
+evictor_drop(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 0);
+  int dropped = 1;
+  if (entryp) {
+    if (entryp->holds > 0 || entryp->pinned) {
+      dropped = 0;
+    } else if (entryp->cached) {
+      evictor_uncount(entryp);
+      evictor_free_if_unused(entryp);
+    }
+  }
+  pthread_mutex_unlock(&evictor_lock);
+
+  return (dropped);
+}
+
+/*
+ * protect the file of the key from eviction until evictor_unpin_all()
+ * is called.  the file need not be cached yet.
+ */
+void
+evictor_pin(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 1);
+  if (entryp) {
+    entryp->pinned = 1;
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * unpin all the files.  called when the pinned set is recomputed.
+ */
+void
+evictor_unpin_all(void)
+{
+  pthread_mutex_lock(&evictor_lock);
+  size_t i;
+  for (i = 0; i < evictor_nbuckets; i++) {
+    evictor_entry_t *entryp = evictor_buckets[i];
+    while (entryp) {
+      evictor_entry_t *nextp = entryp->hash_next;
+      if (entryp->pinned) {
+	entryp->pinned = 0;
+	evictor_free_if_unused(entryp);
+      }
+      entryp = nextp;
+    }
+  }
+  if (evictor_running && !evictor_wanted && evictor_is_over(1)) {
+    evictor_wanted = 1;
+    pthread_cond_signal(&evictor_cond);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * protect the file of the key from eviction until evictor_unhold() is
+ * called the same number of times.  the file need not be cached yet.
+ */
+void
+evictor_hold(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 1);
+  if (entryp) {
+    entryp->holds++;
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+void
+evictor_unhold(const char *key)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 0);
+  if (entryp && entryp->holds > 0) {
+    entryp->holds--;
+    evictor_free_if_unused(entryp);
+  }
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+/*
+ * get the size of the file of the key and returns true if it is
+ * accounted as cached.
+ */
+int
+evictor_lookup(const char *key, u_int64_t *sizep, time_t *atimep)
+{
+  assert(key != NULL);
+
+  pthread_mutex_lock(&evictor_lock);
+  evictor_entry_t *entryp = evictor_find(key, 0);
+  int cached = (entryp && entryp->cached);
+  if (cached) {
+    if (sizep) {
+      *sizep = entryp->size;
+    }
+    if (atimep) {
+      *atimep = entryp->atime;
+    }
+  }
+  pthread_mutex_unlock(&evictor_lock);
+
+  return (cached);
+}
+
+/*
+ * tell the evictor that all the files already in the cache have been
+ * added, and it can start choosing victims.
+ */
+void
+evictor_scanned(void)
+{
+  pthread_mutex_lock(&evictor_lock);
+  evictor_ready = 1;
+  pthread_cond_signal(&evictor_cond);
+  pthread_mutex_unlock(&evictor_lock);
+}
+
+static void *
+evictor_main(void *arg)
+{
+  pthread_mutex_lock(&evictor_lock);
+  while (evictor_running && !evictor_ready) {
+    pthread_cond_wait(&evictor_cond, &evictor_lock);
+  }
+  /* the scan adds the files in the directory order. */
+  evictor_lru_sort();
+  while (evictor_running) {
+    if (!evictor_is_over(1)) {
+      evictor_wanted = 0;
+      evictor_wait();
+      continue;
+    }
+
+    /* evict cold files down to the low watermark. */
+    size_t nevicted = 0, nbusy = 0;
+    while (evictor_running && evictor_is_over(0)) {
+      evictor_entry_t *entryp = evictor_pick_victim();
+      if (entryp == NULL) {
+	/* everything left is held or pinned. */
+	break;
+      }
+      char *key = strdup(entryp->key);
+      if (key == NULL) {
+	warn("failed to duplicate a string (%s).", entryp->key);
+	break;
+      }
+      /*
+       * the entry is kept until the evict function drops it under the
+       * lock of the file, so that a hold taken meanwhile is honored.
+       */
+      pthread_mutex_unlock(&evictor_lock);
+
+      DEBUGV("evictor: evicting %s.\n", key);
+      int errcode = evictor_func(key);
+      if (errcode == 0) {
+	nevicted++;
+      } else if (errcode != EBUSY) {
+	warnx("failed to evict %s.", key);
+      }
+      free(key);
+
+      pthread_mutex_lock(&evictor_lock);
+      if (errcode == EBUSY && ++nbusy > evictor_files) {
+	/* all the files have been tried.  they are used elsewhere. */
+	break;
+      }
+    }
+    DEBUGV("evictor: %lu files evicted, %llu bytes in %llu files left.\n",
+	   (unsigned long)nevicted, (unsigned long long)evictor_bytes,
+	   (unsigned long long)evictor_files);
+    if (evictor_is_over(0)) {
+      /* nothing can be evicted now.  wait for a change. */
+      evictor_wanted = 0;
+      evictor_wait();
+    }
+  }
+  pthread_mutex_unlock(&evictor_lock);
+
+  return (NULL);
+}
+
+/*
+ * wait for a change.  the caller must hold evictor_lock.
+ */
+static void
+evictor_wait(void)
+{
+  if (evictor_usage_func == NULL) {
+    pthread_cond_wait(&evictor_cond, &evictor_lock);
+    return;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += EVICTOR_SHARED_CHECK_INTERVAL;
+  pthread_cond_timedwait(&evictor_cond, &evictor_lock, &deadline);
+}
+
+/*
+ * returns true if the cache is above the high watermark (if the high
+ * parameter is true) or the low watermark of the budget.  the caller
+ * must hold evictor_lock.
+ */
+static int
+evictor_is_over(int high)
+{
+  u_int64_t bytes = evictor_bytes, files = evictor_files;
+  if (evictor_usage_func) {
+    evictor_usage_func(&bytes, &files);
+  }
+
+  int percent = high ? config.cache_high_water : config.cache_low_water;
+  if (config.cache_max_size > 0
+      && bytes > (u_int64_t)config.cache_max_size * 1024 * 1024
+	 * percent / 100) {
+    return (1);
+  }
+  if (config.cache_max_files > 0
+      && files > (u_int64_t)config.cache_max_files * percent / 100) {
+    return (1);
+  }
+  return (0);
+}
+
+/*
+ * returns the least recently used file neither held nor pinned.  the
+ * caller must hold evictor_lock.
+ */
+static evictor_entry_t *
+evictor_pick_victim(void)
+{
+  evictor_entry_t *entryp;
+  for (entryp = evictor_lru_tail; entryp; entryp = entryp->lru_prev) {
+    if (entryp->holds == 0 && !entryp->pinned) {
+      return (entryp);
+    }
+  }
+  return (NULL);
+}
+
+/*
+ * find the entry of the key.  if the create parameter is true, a new
+ * entry is created if not found.  the caller must hold evictor_lock.
+ */
+static evictor_entry_t *
+evictor_find(const char *key, int create)
+{
+  assert(key != NULL);
+
+  if (create && (evictor_buckets == NULL
+		 || evictor_nentries >= evictor_nbuckets)) {
+    evictor_grow();
+  }
+  if (evictor_buckets == NULL) {
+    return (NULL);
+  }
+
+  evictor_entry_t **bucketp
+    = &evictor_buckets[evictor_hash(key) % evictor_nbuckets];
+  evictor_entry_t *entryp;
+  for (entryp = *bucketp; entryp; entryp = entryp->hash_next) {
+    if (strcmp(entryp->key, key) == 0) {
+      return (entryp);
+    }
+  }
+  if (!create) {
+    return (NULL);
+  }
+
+  entryp = calloc(1, sizeof(evictor_entry_t));
+  if (entryp == NULL) {
+    warn("failed to allocate memory for an evictor entry.");
+    return (NULL);
+  }
+  entryp->key = strdup(key);
+  if (entryp->key == NULL) {
+    warn("failed to duplicate a string (%s).", key);
+    free(entryp);
+    return (NULL);
+  }
+  entryp->hash_next = *bucketp;
+  *bucketp = entryp;
+  evictor_nentries++;
+
+  return (entryp);
+}
+
+/*
+ * double the hash table.  the caller must hold evictor_lock.
+ */
+static void
+evictor_grow(void)
+{
+  size_t new_nbuckets = evictor_nbuckets ? evictor_nbuckets * 2
+    : EVICTOR_INITIAL_BUCKETS;
+  evictor_entry_t **new_buckets = calloc(new_nbuckets,
+					 sizeof(evictor_entry_t *));
+  if (new_buckets == NULL) {
+    /* keep the current table.  it only gets slower. */
+    warn("failed to enlarge the evictor table.");
+    return;
+  }
+
+  size_t i;
+  for (i = 0; i < evictor_nbuckets; i++) {
+    while (evictor_buckets[i]) {
+      evictor_entry_t *entryp = evictor_buckets[i];
+      evictor_buckets[i] = entryp->hash_next;
+      evictor_entry_t **bucketp
+	= &new_buckets[evictor_hash(entryp->key) % new_nbuckets];
+      entryp->hash_next = *bucketp;
+      *bucketp = entryp;
+    }
+  }
+  free(evictor_buckets);
+  evictor_buckets = new_buckets;
+  evictor_nbuckets = new_nbuckets;
+}
+
+/*
+ * put the entry at the most recently used end of the list.
+ */
+static void
+evictor_lru_insert(evictor_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  entryp->lru_prev = NULL;
+  entryp->lru_next = evictor_lru_head;
+  if (evictor_lru_head) {
+    evictor_lru_head->lru_prev = entryp;
+  } else {
+    evictor_lru_tail = entryp;
+  }
+  evictor_lru_head = entryp;
+}
+
+static void
+evictor_lru_unlink(evictor_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  if (entryp->lru_prev) {
+    entryp->lru_prev->lru_next = entryp->lru_next;
+  } else {
+    evictor_lru_head = entryp->lru_next;
+  }
+  if (entryp->lru_next) {
+    entryp->lru_next->lru_prev = entryp->lru_prev;
+  } else {
+    evictor_lru_tail = entryp->lru_prev;
+  }
+  entryp->lru_prev = entryp->lru_next = NULL;
+}
+
+/*
+ * sort the list by the last access time, the most recent first.  a
+ * bottom-up merge sort, so it takes O(n log n) without extra memory.
+ * the caller must hold evictor_lock.
+ */
+static void
+evictor_lru_sort(void)
+{
+  evictor_entry_t *listp = evictor_lru_head;
+  size_t width;
+  for (width = 1; listp; width *= 2) {
+    evictor_entry_t *headp = NULL, **tailpp = &headp;
+    size_t nmerges = 0;
+    while (listp) {
+      /* merge two runs of the width. */
+      evictor_entry_t *ap = listp, *bp = listp;
+      size_t alen = 0, blen = width;
+      while (bp && alen < width) {
+	bp = bp->lru_next;
+	alen++;
+      }
+      while (alen > 0 || (blen > 0 && bp)) {
+	evictor_entry_t *takep;
+	if (alen == 0) {
+	  takep = bp;
+	  bp = bp->lru_next;
+	  blen--;
+	} else if (blen == 0 || bp == NULL || ap->atime >= bp->atime) {
+	  takep = ap;
+	  ap = ap->lru_next;
+	  alen--;
+	} else {
+	  takep = bp;
+	  bp = bp->lru_next;
+	  blen--;
+	}
+	*tailpp = takep;
+	tailpp = &takep->lru_next;
+      }
+      listp = bp;
+      nmerges++;
+    }
+    *tailpp = NULL;
+    listp = headp;
+    if (nmerges <= 1) {
+      break;
+    }
+  }
+
+  /* restore the back links. */
+  evictor_entry_t *prevp = NULL, *entryp;
+  for (entryp = listp; entryp; entryp = entryp->lru_next) {
+    entryp->lru_prev = prevp;
+    prevp = entryp;
+  }
+  evictor_lru_head = listp;
+  evictor_lru_tail = prevp;
+}
+
+/*
+ * remove the entry from the accounting and the list.
+ */
+static void
+evictor_uncount(evictor_entry_t *entryp)
+{
+  assert(entryp != NULL);
+  assert(entryp->cached);
+
+  evictor_bytes -= entryp->size;
+  evictor_files--;
+  evictor_lru_unlink(entryp);
+  entryp->cached = 0;
+}
+
+/*
+ * free the entry if it is neither cached nor held.
+ */
+static void
+evictor_free_if_unused(evictor_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  if (entryp->cached || entryp->holds > 0 || entryp->pinned) {
+    return;
+  }
+
+  evictor_entry_t **bucketp
+    = &evictor_buckets[evictor_hash(entryp->key) % evictor_nbuckets];
+  while (*bucketp != entryp) {
+    bucketp = &(*bucketp)->hash_next;
+  }
+  *bucketp = entryp->hash_next;
+  evictor_nentries--;
+  free(entryp->key);
+  free(entryp);
+}
+
+static unsigned int
+evictor_hash(const char *key)
+{
+  assert(key != NULL);
+
+  /* FNV-1a */
+  unsigned int hash = 2166136261U;
+  while (*key) {
+    hash ^= (unsigned char)*key++;
+    hash *= 16777619U;
+  }
+  return (hash);
+}
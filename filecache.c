@@ -23,7 +23,7 @@
  */
 
 #ifdef __linux__
-#define _XOPEN_SOURCE 500
+#define _XOPEN_SOURCE 700
 #endif
 
 #include <stdlib.h>
@@ -37,49 +37,739 @@
 #include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/xattr.h>
+#include <sys/file.h>
+#include <sys/mman.h>
 #include <errno.h>
 #include <assert.h>
 #include <err.h>
+#include <time.h>
+#include <pthread.h>
+#include <fnmatch.h>
+#include <signal.h>
 
 #include "tahoefs.h"
 #include "http_stub.h"
 #include "json_stub.h"
+#include "metacache.h"
+#include "poller.h"
+#include "cacheindex.h"
+#include "captable.h"
+#include "prefetch.h"
+#include "evictor.h"
+#include "reaper.h"
+#include "policy.h"
+#include "peer.h"
+#include "scanner.h"
+#include "uploader.h"
+#include "filecache.h"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
 
 #define FILECACHE_SUPPORTED_OPEN_FLAGS (O_RDONLY|O_WRONLY|O_RDWR|O_CREAT|O_TRUNC)
-#define FILECACHE_PATH_TO_CACHED_PATH(path, cached_path) do {	    \
-    (cached_path)[0] = '\0';					    \
-    if (config.filecache_dir[0] != '/') {			    \
-      strcat((cached_path), getenv("HOME"));			    \
-      strcat((cached_path), "/");				    \
-    }								    \
-    strcat((cached_path), config.filecache_dir);		    \
-    strcat((cached_path), (path));				    \
-  } while (0);
+#define FILECACHE_PATH_TO_CACHED_PATH(path, cached_path)		    \
+  snprintf((cached_path), MAXPATHLEN, "%s%s%s", filecache_cache_dir,	    \
+	   FILECACHE_ROOT_DIR, (path))
+/*
+ * the cache directory and the object directory are opened once, and
+ * the cache nodes are accessed by the *at() calls relative to them,
+ * so that the kernel doesn't walk the path to the cache directory
+ * every time.  the absolute paths are still needed for the xattr
+ * calls, and a cache node is named by its absolute path in this file.
+ */
+#define FILECACHE_AT(cached_path)					    \
+  filecache_at_fd(cached_path), filecache_at_path(cached_path)
+
+/*
+ * the cache directory holds the mirror of the tahoe namespace under
+ * FILECACHE_ROOT_DIR and the cache index file FILECACHE_INDEX_FILE.
+ * the mirror has only the directories.  the contents of files are
+ * stored by the hash of their caps under FILECACHE_OBJECT_DIR in two
+ * levels of fan-out directories (objects/ab/cd/abcd...), so that the
+ * same contents linked at many paths are cached once and relinking
+ * or renaming a file doesn't invalidate its cache.  the binding from
+ * a path to a cap is kept in the cache index.  the files being
+ * written are private copies under FILECACHE_DIRTY_DIR until they are
+ * flushed, since an object must always match its cap.  with
+ * write-back, a flushed copy is moved into FILECACHE_UPLOAD_DIR and
+ * is read from there until the uploader has uploaded it.
+ */
+#define FILECACHE_ROOT_DIR "/root"
+#define FILECACHE_INDEX_FILE "/index"
+#define FILECACHE_OBJECT_DIR "/objects"
+#define FILECACHE_DIRTY_DIR "/dirty"
+#define FILECACHE_TRASH_DIR "/trash"	/* emptied by the reaper. */
+#define FILECACHE_UPLOAD_DIR "/upload"	/* spooled by the uploader. */
+#define FILECACHE_OBJECT_KEY_SIZE 17	/* 16 hex digits and a NUL. */
+
+/*
+ * the object directory may be shared by the tahoefs processes on the
+ * host (--shared-cache), so that the contents of a cap are downloaded
+ * and stored once for all of them.  an object is filled and removed
+ * holding the flock() of FILECACHE_LOCK_FILE in its fan-out
+ * directory, and the filler checks whether someone else has filled
+ * it first.  the usage of the shared directory is kept in
+ * FILECACHE_USAGE_FILE, mapped by all the processes and updated
+ * atomically, so that their evictors share one budget.
+ */
+#define FILECACHE_LOCK_FILE ".lock"
+#define FILECACHE_USAGE_FILE "/.usage"
+typedef struct filecache_usage {
+  u_int64_t bytes;
+  u_int64_t files;
+  u_int64_t published_bytes;	/* only ever increased, for the scan. */
+  u_int64_t published_files;
+} filecache_usage_t;
 
 #define FILECACHE_INFO_ATTR "user.net.iijlab.tahoefs.info"
+#define FILECACHE_RECORD_ATTR "user.net.iijlab.tahoefs.record"
 #define FILECACHE_HAS_CONTENTS "user.net.iijlab.tahoefs.has_contents"
 
-static int filecache_getattr_from_parent(const char *, tahoefs_stat_t *);
-static int filecache_cached_getattr(const char *, tahoefs_stat_t *);
-static ssize_t filecache_get_info_xattr(const char *, void **);
-static int filecache_set_info_xattr(const char *, void *, size_t);
+/*
+ * the metadata of a cached node is stored in the FILECACHE_RECORD_ATTR
+ * xattr as a fixed-layout binary record in the host byte order, so
+ * that it can be read by one getxattr() call into a stack buffer and
+ * decoded without any allocation.  the header is followed by the
+ * rw_uri, ro_uri and verify_uri strings without terminating NULs.
+ * caps longer than FILECACHE_RECORD_CAP_MAX are not recorded, and the
+ * cache of such a node is never considered valid.
+ */
+#define FILECACHE_RECORD_MAGIC 0x54464d44	/* "TFMD" */
+#define FILECACHE_RECORD_VERSION 1
+typedef struct filecache_record_header {
+  u_int32_t magic;
+  u_int8_t version;
+  u_int8_t type;
+  u_int8_t mutable;
+  u_int8_t reserved;
+  u_int64_t size;
+  double link_creation_time;
+  double link_modification_time;
+  u_int16_t rw_uri_len;
+  u_int16_t ro_uri_len;
+  u_int16_t verify_uri_len;
+  u_int16_t reserved2;
+} filecache_record_header_t;
+#define FILECACHE_RECORD_CAP_MAX 1024
+#define FILECACHE_RECORD_MAX (sizeof(filecache_record_header_t)	\
+			      + 3 * FILECACHE_RECORD_CAP_MAX)
+
+/*
+ * the record xattrs of cache directories are not needed as long as
+ * the cache index has the records.  they are written lazily in a
+ * batch, so that directories whose metadata changes often don't cause
+ * a stream of setxattr() calls.
+ */
+#define FILECACHE_PENDING_RECORDS_MAX 64
+typedef struct filecache_pending_record {
+  char *cached_path;
+  tahoefs_stat_t tstat;
+} filecache_pending_record_t;
+
+static filecache_pending_record_t
+filecache_pending_records[FILECACHE_PENDING_RECORDS_MAX];
+static int filecache_npending_records = 0;
+static pthread_mutex_t filecache_pending_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char filecache_cache_dir[MAXPATHLEN];
+static size_t filecache_cache_dir_len = 0;
+static int filecache_cache_fd = -1;
+static char filecache_object_dir[MAXPATHLEN];
+static size_t filecache_object_dir_len = 0;
+static int filecache_object_fd = -1;
+static filecache_usage_t *filecache_usagep = NULL;
+
+/* the results of the startup scan. */
+static filecache_usage_t filecache_scanned;
+static u_int64_t filecache_scan_discarded = 0;
+static u_int64_t filecache_scan_indexed = 0;
+static time_t filecache_scan_started = 0;
+static u_int64_t filecache_scan_published_bytes = 0;
+static u_int64_t filecache_scan_published_files = 0;
+
+/*
+ * the cache directories known to exist, to create the parents of a
+ * cache node without a syscall in most cases.  a slot holds the
+ * cacheindex_hash() of the path relative to the cache directory, and
+ * a colliding path simply replaces it.  the memo is cleared when a
+ * directory is uncached.
+ */
+#define FILECACHE_DIR_MEMO_SIZE 4096
+static u_int64_t filecache_dir_memo[FILECACHE_DIR_MEMO_SIZE];
+static pthread_mutex_t filecache_dir_memo_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the files written since the last flush.  their contents are in
+ * FILECACHE_DIRTY_DIR, not in the objects.
+ */
+typedef struct filecache_dirty {
+  struct filecache_dirty *next;
+  char *path;
+} filecache_dirty_t;
+
+static filecache_dirty_t *filecache_dirty_files = NULL;
+static pthread_mutex_t filecache_dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the objects held by the open files.  in a shared cache, the holds
+ * of the evictor are not seen by the other processes, so a held
+ * object is also kept locked by flock(LOCK_SH) through one descriptor
+ * per object, and filecache_evict() skips an object it cannot lock
+ * exclusively.  an object not cached at open, or replaced since, is
+ * locked when it is read.
+ */
+typedef struct filecache_hold {
+  struct filecache_hold *next;
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  int refs;
+  int fd;	/* locked descriptor of the object, or -1. */
+  dev_t dev;
+  ino_t ino;
+} filecache_hold_t;
+
+static filecache_hold_t *filecache_holds = NULL;
+static pthread_mutex_t filecache_hold_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * recently read directories.  a readdir on a child of one of them
+ * means a tree walk, and the listings of the subdirectories are
+ * fetched ahead by the prefetch workers.
+ */
+#define FILECACHE_RECENT_DIRS 16
+typedef struct filecache_recent_dir {
+  char *path;
+  int ahead;	/* its subdirectories have been fetched ahead. */
+} filecache_recent_dir_t;
+
+static filecache_recent_dir_t filecache_recent_dirs[FILECACHE_RECENT_DIRS];
+static int filecache_recent_next = 0;
+static pthread_mutex_t filecache_recent_lock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct filecache_listing_baton {
+  const char *path;
+  time_t fetched;
+  int flags;
+  int ahead;	/* levels of subdirectories to fetch ahead. */
+  void *buf;
+  void *fillerp;
+  json_stub_iterate_children_callback_t callback;
+  char *names;	/* the names of the children listed so far. */
+  size_t names_len;
+  size_t names_size;
+} filecache_listing_baton_t;
+
+static int filecache_getattr_node(const char *, tahoefs_stat_t *);
+static int filecache_getattr_root(const char *, tahoefs_stat_t *, int);
+static char *filecache_parent_path(const char *);
+static int filecache_get_child_info(const char *, tahoefs_stat_t *, char **,
+				    int *);
+static int filecache_fetch_listing(const char *, void *, void *,
+				   json_stub_iterate_children_callback_t, int);
+static int filecache_fetch_listing_chunk(const char *, size_t, void *);
+static int filecache_fetch_listing_callback(tahoefs_readdir_baton_t *);
+static int filecache_cached_listing(const char *, void *, void *,
+				    json_stub_iterate_children_callback_t,
+				    int, time_t);
+static int filecache_is_tree_walk(const char *);
+static int filecache_poll_callback(tahoefs_readdir_baton_t *);
+static int filecache_cached_getattr(const char *, const char *,
+				    cacheindex_record_t *);
+static int filecache_read_record(const char *, tahoefs_stat_t *);
+static int filecache_load_record(const char *, tahoefs_stat_t *);
+static int filecache_is_outdated(const tahoefs_stat_t *,
+				 const cacheindex_record_t *);
+static int filecache_at_fd(const char *);
+static const char *filecache_at_path(const char *);
+static int filecache_open_dir(const char *, char *, size_t *, int *);
+static int filecache_map_usage(void);
+static void filecache_account(int64_t, int64_t);
+static int filecache_lock_object(const char *);
+static void filecache_unlock_object(int);
+static int filecache_is_filled(const char *, const tahoefs_stat_t *);
+static int filecache_is_foreign(const char *, const char *);
+static int filecache_publish(const char *, const char *);
+static void filecache_object_key(u_int64_t, char *);
+static void filecache_object_path(const char *, char *);
+static void filecache_dirty_path(const char *, char *);
+static int filecache_body_path(const char *, char *, char *);
+static int filecache_uncache_object(const tahoefs_stat_t *);
+static int filecache_remove_object(const char *, int);
+static void filecache_hold(const char *);
+static void filecache_unhold(const char *);
+static void filecache_hold_object(const char *, int);
+static filecache_hold_t *filecache_find_hold(const char *);
+static int filecache_is_dirty(const char *);
+static int filecache_set_dirty(const char *, int);
+static int filecache_make_dirty(const char *);
+static int filecache_copy_file(const char *, const char *);
+static int filecache_publish_dirty(const char *, const char *);
+static int filecache_upload(const char *, const char *);
+static const char *filecache_cached_path_to_path(const char *);
+static int filecache_is_immutable_file(const tahoefs_stat_t *);
+static int filecache_is_immutable_directory(const tahoefs_stat_t *);
+static ssize_t filecache_record_encode(const tahoefs_stat_t *, char *, size_t);
+static int filecache_record_decode(const char *, size_t, tahoefs_stat_t *);
+static const char *filecache_record_intern(const char *, size_t);
+static int filecache_set_record_xattr(const char *, const tahoefs_stat_t *);
+static int filecache_set_info_xattr(const char *, const char *, size_t);
+static int filecache_defer_record_xattr(const char *, const tahoefs_stat_t *);
+static void filecache_flush_record_xattrs(void);
 static int filecache_get_cache_stat(const char *, struct stat *);
-static int filecache_cache_file(const char *, const char *);
-static int filecache_cache_directory(const char *, const char *, char *, int);
+static int filecache_cache_file(const char *, char *);
+static int filecache_cache_directory(const char *, const tahoefs_stat_t *,
+				     const char *);
+static int filecache_prefetch_listing(const char *, int);
+static int filecache_prefetch_contents(const char *, int);
+static int filecache_warmup(const char *);
+static int filecache_warmup_callback(const char *, void *);
+static int filecache_scan_visit(const char *, const struct stat *);
+static void filecache_scan_object(const char *, const struct stat *);
+static void filecache_scan_directory(const char *);
+static void filecache_scan_report(size_t, size_t, int);
 static int filecache_mkdir_parent(const char *);
+static int filecache_mkdirs(char *);
 static int filecache_uncache_node(const char *);
+static void filecache_forget(const char *);
+
+int
+filecache_initialize(void)
+{
+  if (filecache_open_dir(config.filecache_dir, filecache_cache_dir,
+			 &filecache_cache_dir_len, &filecache_cache_fd) == -1) {
+    return (-1);
+  }
+  const char *cache_dir = filecache_cache_dir;
+
+  if (config.shared_cache_dir) {
+    if (filecache_open_dir(config.shared_cache_dir, filecache_object_dir,
+			   &filecache_object_dir_len,
+			   &filecache_object_fd) == -1
+	|| filecache_map_usage() == -1) {
+      warnx("failed to open the shared cache %s.", config.shared_cache_dir);
+      return (-1);
+    }
+    /* may fail if another user has created it.  that's fine. */
+    fchmod(filecache_object_fd, S_IRWXU|S_IRWXG);
+  } else {
+    char object_dir[MAXPATHLEN];
+    snprintf(object_dir, sizeof(object_dir), "%s%s", cache_dir,
+	     FILECACHE_OBJECT_DIR);
+    if (filecache_open_dir(object_dir, filecache_object_dir,
+			   &filecache_object_dir_len,
+			   &filecache_object_fd) == -1) {
+      return (-1);
+    }
+  }
+
+  char index_path[MAXPATHLEN];
+  strcpy(index_path, cache_dir);
+  strcat(index_path, FILECACHE_INDEX_FILE);
+  if (cacheindex_initialize(index_path) == -1) {
+    warnx("failed to initialize the cache index.");
+    return (-1);
+  }
+
+  char trash_dir[MAXPATHLEN];
+  strcpy(trash_dir, cache_dir);
+  strcat(trash_dir, FILECACHE_TRASH_DIR);
+  if (reaper_start(trash_dir, filecache_forget) == -1) {
+    warnx("failed to start the reaper.");
+  }
+
+  char upload_dir[MAXPATHLEN];
+  strcpy(upload_dir, cache_dir);
+  strcat(upload_dir, FILECACHE_UPLOAD_DIR);
+  if (uploader_start(upload_dir, filecache_upload) == -1) {
+    warnx("failed to start the uploader.");
+  }
+
+  return (0);
+}
+
+int
+filecache_terminate(void)
+{
+  if (scanner_stop() == -1) {
+    warnx("failed to stop the cache scan.");
+  }
+
+  pthread_mutex_lock(&filecache_pending_lock);
+  filecache_flush_record_xattrs();
+  pthread_mutex_unlock(&filecache_pending_lock);
+
+  if (reaper_stop() == -1) {
+    warnx("failed to stop the reaper.");
+  }
+  if (filecache_usagep) {
+    munmap(filecache_usagep, sizeof(filecache_usage_t));
+    filecache_usagep = NULL;
+  }
+  if (filecache_object_fd != -1) {
+    close(filecache_object_fd);
+    filecache_object_fd = -1;
+  }
+  if (filecache_cache_fd != -1) {
+    close(filecache_cache_fd);
+    filecache_cache_fd = -1;
+  }
+
+  return (cacheindex_terminate());
+}
+
+/*
+ * open the object of the immutable file of the cap to serve it to a
+ * peer.  returns the descriptor, or -1 if it is not cached.
+ */
+int
+filecache_open_object(const char *cap)
+{
+  assert(cap != NULL);
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char object_path[MAXPATHLEN];
+  filecache_object_key(cacheindex_hash(cap), key);
+  filecache_object_path(key, object_path);
+  if (filecache_is_foreign(object_path, cap)) {
+    return (-1);
+  }
+
+  int fd = openat(FILECACHE_AT(object_path), O_RDONLY);
+  if (fd != -1) {
+    evictor_touch(key);
+  }
+
+  return (fd);
+}
+
+/*
+ * returns the usage of the shared object directory.  used by the
+ * evictor in the shared cache mode.
+ */
+void
+filecache_usage(u_int64_t *bytesp, u_int64_t *filesp)
+{
+  assert(bytesp != NULL);
+  assert(filesp != NULL);
+
+  *bytesp = *filesp = 0;
+  if (filecache_usagep) {
+    *bytesp = filecache_usagep->bytes;
+    *filesp = filecache_usagep->files;
+  }
+}
+
+/*
+ * resolve the directory specified as the dir parameter (relative to
+ * $HOME unless absolute), create it and open it.  the path buffer
+ * must have MAXPATHLEN bytes.
+ */
+static int
+filecache_open_dir(const char *dir, char *path, size_t *path_lenp, int *fdp)
+{
+  assert(dir != NULL);
+  assert(path != NULL);
+  assert(path_lenp != NULL);
+  assert(fdp != NULL);
+
+  const char *home = "";
+  if (dir[0] != '/') {
+    home = getenv("HOME");
+    if (home == NULL) {
+      warnx("HOME is not set.");
+      return (-1);
+    }
+  }
+  if (snprintf(path, MAXPATHLEN, "%s%s%s", home, home[0] ? "/" : "", dir)
+      >= MAXPATHLEN) {
+    warnx("too long directory name %s.", dir);
+    return (-1);
+  }
+  *path_lenp = strlen(path);
+  if (mkdir(path, S_IRWXU) == -1 && errno != EEXIST) {
+    warn("failed to create the cache directory %s.", path);
+    return (-1);
+  }
+  *fdp = open(path, O_RDONLY|O_DIRECTORY);
+  if (*fdp == -1) {
+    warn("failed to open the cache directory %s.", path);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * map the usage file of the shared object directory.
+ */
+static int
+filecache_map_usage(void)
+{
+  int fd = openat(filecache_object_fd, FILECACHE_USAGE_FILE + 1,
+		  O_RDWR|O_CREAT, S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+  if (fd == -1) {
+    warn("failed to open the usage file in %s.", filecache_object_dir);
+    return (-1);
+  }
+  /* the first process extends it.  the others see zeros or the usage. */
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1
+      || (stbuf.st_size < (off_t)sizeof(filecache_usage_t)
+	  && ftruncate(fd, sizeof(filecache_usage_t)) == -1)) {
+    warn("failed to initialize the usage file in %s.", filecache_object_dir);
+    close(fd);
+    return (-1);
+  }
+  void *addr = mmap(NULL, sizeof(filecache_usage_t), PROT_READ|PROT_WRITE,
+		    MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    warn("failed to map the usage file in %s.", filecache_object_dir);
+    return (-1);
+  }
+  filecache_usagep = (filecache_usage_t *)addr;
+
+  return (0);
+}
+
+/*
+ * add the deltas to the usage of the shared object directory.
+ */
+static void
+filecache_account(int64_t bytes, int64_t files)
+{
+  if (filecache_usagep == NULL) {
+    return;
+  }
+  /* the publish is counted before it is seen in the usage. */
+  if (bytes > 0) {
+    __sync_fetch_and_add(&filecache_usagep->published_bytes,
+			 (u_int64_t)bytes);
+  }
+  if (files > 0) {
+    __sync_fetch_and_add(&filecache_usagep->published_files,
+			 (u_int64_t)files);
+  }
+  __sync_fetch_and_add(&filecache_usagep->bytes, (u_int64_t)bytes);
+  __sync_fetch_and_add(&filecache_usagep->files, (u_int64_t)files);
+}
+
+/*
+ * the descriptor of the directory the cache node specified as the
+ * cached_path parameter is relative to, and the relative path.
+ */
+static int
+filecache_at_fd(const char *cached_path)
+{
+  if (strncmp(cached_path, filecache_object_dir,
+	      filecache_object_dir_len) == 0
+      && cached_path[filecache_object_dir_len] == '/') {
+    return (filecache_object_fd);
+  }
+  return (filecache_cache_fd);
+}
+
+static const char *
+filecache_at_path(const char *cached_path)
+{
+  if (strncmp(cached_path, filecache_object_dir,
+	      filecache_object_dir_len) == 0
+      && cached_path[filecache_object_dir_len] == '/') {
+    return (cached_path + filecache_object_dir_len + 1);
+  }
+  return (cached_path + filecache_cache_dir_len + 1);
+}
+
+/*
+ * lock the fan-out directory of the object specified as the
+ * object_path parameter against the other threads and processes
+ * filling or removing objects in it.  returns the descriptor to be
+ * passed to filecache_unlock_object().  if locking fails, -1 is
+ * returned and the caller goes on without the lock.
+ */
+static int
+filecache_lock_object(const char *object_path)
+{
+  assert(object_path != NULL);
+
+  char lock_path[MAXPATHLEN];
+  strcpy(lock_path, object_path);
+  char *slash = strrchr(lock_path, '/');
+  assert(slash != NULL);
+  strcpy(slash + 1, FILECACHE_LOCK_FILE);
+
+  int fd = openat(FILECACHE_AT(lock_path), O_RDONLY|O_CREAT,
+		  S_IRUSR|S_IWUSR|S_IRGRP|S_IWGRP);
+  if (fd == -1) {
+    if (errno != ENOENT) {
+      warn("failed to open the lock file %s.", lock_path);
+    }
+    return (-1);
+  }
+  while (flock(fd, LOCK_EX) == -1) {
+    if (errno != EINTR) {
+      warn("failed to lock %s.", lock_path);
+      close(fd);
+      return (-1);
+    }
+  }
+
+  return (fd);
+}
+
+static void
+filecache_unlock_object(int lock_fd)
+{
+  if (lock_fd != -1) {
+    close(lock_fd);
+  }
+}
+
+/*
+ * returns true if the object specified as the object_path parameter
+ * already holds the contents described by the tstatp parameter.  the
+ * caller must hold the lock of the object.
+ */
+static int
+filecache_is_filled(const char *object_path, const tahoefs_stat_t *tstatp)
+{
+  assert(object_path != NULL);
+  assert(tstatp != NULL);
+
+  if (faccessat(FILECACHE_AT(object_path), F_OK, 0) == -1) {
+    return (0);
+  }
+
+  /* the name is only a hash of the cap.  the record tells the cap. */
+  tahoefs_stat_t cached_tstat;
+  memset(&cached_tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_read_record(object_path, &cached_tstat) == -1) {
+    return (0);
+  }
+  if (strcmp(TAHOEFS_CAP(cached_tstat.ro_uri),
+	     TAHOEFS_CAP(tstatp->ro_uri)) != 0) {
+    captable_tstat_release(&cached_tstat);
+    return (0);
+  }
+  if (filecache_is_immutable_file(tstatp)) {
+    /* the contents are determined by the cap. */
+    captable_tstat_release(&cached_tstat);
+    return (1);
+  }
+
+  cacheindex_record_t cached_record;
+  cacheindex_record_from_tstat(&cached_tstat, &cached_record);
+  captable_tstat_release(&cached_tstat);
+
+  return (!filecache_is_outdated(tstatp, &cached_record));
+}
+
+/*
+ * returns true if the object specified as the object_path parameter
+ * holds the contents of a cap other than the cap parameter, whose
+ * hash collides.  an object whose record cannot be read is not
+ * considered foreign.
+ */
+static int
+filecache_is_foreign(const char *object_path, const char *cap)
+{
+  assert(object_path != NULL);
+  assert(cap != NULL);
+
+  tahoefs_stat_t cached_tstat;
+  memset(&cached_tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_load_record(object_path, &cached_tstat) == -1) {
+    return (0);
+  }
+  int foreign = (strcmp(TAHOEFS_CAP(cached_tstat.ro_uri), cap) != 0);
+  captable_tstat_release(&cached_tstat);
+
+  return (foreign);
+}
+
+/*
+ * move the filled temporary file into the object specified as the
+ * object_path parameter, and account it.  the object is made readable
+ * by the group, so that the other users sharing the object directory
+ * can read it and its record.  the caller must hold the lock of the
+ * object.
+ */
+static int
+filecache_publish(const char *temp_path, const char *object_path)
+{
+  assert(temp_path != NULL);
+  assert(object_path != NULL);
+
+  if (fchmodat(FILECACHE_AT(temp_path), S_IRUSR|S_IWUSR|S_IRGRP, 0) == -1) {
+    warn("failed to change the mode of %s.", temp_path);
+  }
+
+  struct stat old_stbuf, stbuf;
+  int replaced = (fstatat(FILECACHE_AT(object_path), &old_stbuf, 0) == 0);
+  if (fstatat(FILECACHE_AT(temp_path), &stbuf, 0) == -1
+      || renameat(FILECACHE_AT(temp_path), FILECACHE_AT(object_path)) == -1) {
+    warn("failed to rename %s to %s.", temp_path, object_path);
+    return (-1);
+  }
+  if (replaced) {
+    filecache_account(stbuf.st_size - old_stbuf.st_size, 0);
+  } else {
+    filecache_account(stbuf.st_size, 1);
+  }
+
+  return (0);
+}
 
+/*
+ * get the metadata of the node specified as the path parameter.  on
+ * success, THE CALLER MUST RELEASE tstatp by captable_tstat_release().
+ */
 int
 filecache_getattr(const char *path, tahoefs_stat_t *tstatp)
 {
   assert(path != NULL);
   assert(tstatp != NULL);
 
+  int errcode;
+  /* treat "/" as a special case. */
+  if (strcmp(path, "/") == 0) {
+    errcode = filecache_getattr_root(path, tstatp, 0);
+  } else {
+    errcode = filecache_getattr_node(path, tstatp);
+  }
+  if (errcode) {
+    /* don't leave any references to the caller. */
+    captable_tstat_release(tstatp);
+    return (errcode);
+  }
+
+  /* the contents waiting for upload are newer than the metadata. */
+  char spool_path[MAXPATHLEN];
+  struct stat stbuf;
+  if (tstatp->type == TAHOEFS_STAT_TYPE_FILENODE
+      && uploader_lookup(path, spool_path) == 0
+      && fstatat(FILECACHE_AT(spool_path), &stbuf, 0) == 0) {
+    tstatp->size = stbuf.st_size;
+  }
+
+  return (0);
+}
+
+static int
+filecache_getattr_node(const char *path, tahoefs_stat_t *tstatp)
+{
+  assert(path != NULL);
+  assert(tstatp != NULL);
+
   char *remote_infop = NULL;
-  size_t remote_info_size;
+  int flags = 0;
   char cached_path[MAXPATHLEN];
   FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
-  if (http_stub_get_info(path, &remote_infop, &remote_info_size) == -1) {
+  if (filecache_get_child_info(path, tstatp, &remote_infop, &flags) == -1) {
+    if (errno != ENOENT) {
+      /* the gateway is unavailable.  the local cache is kept as is. */
+      return (EIO);
+    }
     /*
      * tahoe storage doesn't have the specified file or directory.
      * the local cache entry and children (if it is a directory) must
@@ -90,44 +780,36 @@ filecache_getattr(const char *path, tahoefs_stat_t *tstatp)
     }
     return (ENOENT);
   }
-
-  /* convert the infop (in JSON) to tahoefs_stat_t{} structure. */
-  if (json_stub_jsonstring_to_tstat(remote_infop, tstatp) == -1) {
-    warnx("failed to convert JSON data to tahoefs stat structure");
-    free(remote_infop);
-    return (EIO);
-  }
-
-  /* treat "/" as a special case. */
-  if (strcmp(path, "/") == 0) {
-    if (filecache_cache_directory(NULL, cached_path, remote_infop,
-				  remote_info_size) == -1) {
-      warnx("failed to store attr info to the root (/).");
-      free(remote_infop);
-      return (EIO);
-    }
+  if ((flags & METACACHE_FLAG_PERMANENT) && (flags & METACACHE_FLAG_VALIDATED)) {
+    /*
+     * the node is in an immutable directory and the local cache has
+     * been checked once.  nothing can change any more.
+     */
     free(remote_infop);
     return (0);
   }
 
+  cacheindex_record_t cached_record;
   if (tstatp->type == TAHOEFS_STAT_TYPE_DIRNODE) {
     /* the specified path at remote storage is a directory. */
-    /*
-     * the dirnode information doesn't include timestamp information.
-     * we need to access the parent directory information (which
-     * includes its children information that has timestamp
-     * information) to get full information.
-     */
-    if (filecache_getattr_from_parent(path, tstatp) == -1) {
-      return (EIO);
+    cacheindex_record_t record;
+    cacheindex_record_from_tstat(tstatp, &record);
+    if (cacheindex_lookup(path, &cached_record) == 0
+	&& cached_record.type == TAHOEFS_STAT_TYPE_DIRNODE
+	&& cached_record.fingerprint == record.fingerprint) {
+      /* the cache directory is up to date.  nothing to rewrite. */
+      free(remote_infop);
+      if (flags & METACACHE_FLAG_PERMANENT) {
+	metacache_set_validated(path);
+      }
+      return (0);
     }
 
     struct stat cached_stat;
     memset(&cached_stat, 0, sizeof(struct stat));
     if (filecache_get_cache_stat(cached_path, &cached_stat) == -1) {
       if (errno == ENOENT) {
-	filecache_cache_directory(NULL, cached_path, remote_infop,
-				  remote_info_size);
+	filecache_cache_directory(cached_path, tstatp, remote_infop);
 	free(remote_infop);
 	return (0);
       }
@@ -147,186 +829,1826 @@ filecache_getattr(const char *path, tahoefs_stat_t *tstatp)
     }
 
     /* cache the latest information. */
-    if (filecache_cache_directory(NULL, cached_path, remote_infop,
-				  remote_info_size)
-	== -1) {
+    if (filecache_cache_directory(cached_path, tstatp, remote_infop) == -1) {
       warn("failed to create a cache directory %s.", cached_path);
       free(remote_infop);
       return (EIO);
     }
-  } else {
+  } else if (cacheindex_lookup(path, &cached_record) == 0) {
     /* the specified path at remote storage is a file.*/
-    struct stat cached_stat;
-    memset(&cached_stat, 0, sizeof(struct stat));
-    if (filecache_get_cache_stat(cached_path, &cached_stat) == -1) {
-      if (errno == ENOENT) {
-	/* just return the latest remote info. */
-	free(remote_infop);
-	return (0);
-      }
-      warn("failed to stat %s.", cached_path);
-      free(remote_infop);
-      return (EIO);
-    }
- 
-    /* something is cached. */
-    if (cached_stat.st_mode & S_IFDIR) {
+    if (cached_record.type == TAHOEFS_STAT_TYPE_DIRNODE) {
       /* remote is a file but the local cache is a directory. */
       if (filecache_uncache_node(cached_path) == -1) {
 	warn("failed to remove cache %s.", cached_path);
 	free(remote_infop);
 	return (EIO);
       }
-    }
-
-    /* check if it is latest or not. */
-    int outdated = 0;
-    tahoefs_stat_t cached_tstat;
-    memset(&cached_tstat, 0, sizeof(tahoefs_stat_t));
-    if (filecache_cached_getattr(cached_path, &cached_tstat) == -1) {
-      outdated = 1;
-    } else {
-      if ((tstatp->link_creation_time > cached_tstat.link_creation_time)
-	  || (tstatp->link_modification_time
-	      > cached_tstat.link_modification_time)) {
-	outdated = 1;
+    } else if (filecache_is_outdated(tstatp, &cached_record)) {
+      /*
+       * an immutable file bound to another cap simply refers to
+       * another object.  only the object of a mutable file, which
+       * keeps its cap across updates, must be dropped.
+       */
+      cacheindex_remove(path);
+      if (!filecache_is_immutable_file(tstatp)) {
+	filecache_uncache_object(tstatp);
       }
     }
-    if (outdated) {
-      filecache_uncache_node(cached_path);
+  } else if (!filecache_is_immutable_file(tstatp)
+	     && tstatp->ro_uri != NULL) {
+    /*
+     * the index doesn't know the file.  the object of a mutable file
+     * may still be there from the previous run, and its record tells
+     * whether it is the latest or not.
+     */
+    char key[FILECACHE_OBJECT_KEY_SIZE];
+    char object_path[MAXPATHLEN];
+    filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstatp->ro_uri)), key);
+    filecache_object_path(key, object_path);
+    if (faccessat(FILECACHE_AT(object_path), F_OK, 0) == 0
+	&& (filecache_cached_getattr(path, object_path, &cached_record) == -1
+	    || filecache_is_outdated(tstatp, &cached_record))) {
+      cacheindex_remove(path);
+      filecache_uncache_object(tstatp);
+    }
+  }
+
+  free(remote_infop);
+  if (flags & METACACHE_FLAG_PERMANENT) {
+    metacache_set_validated(path);
+  }
+
+  return (0);
+}
+
+static int
+filecache_getattr_root(const char *path, tahoefs_stat_t *tstatp, int force)
+{
+  assert(path != NULL);
+  assert(tstatp != NULL);
+
+  if (!force
+      && metacache_lookup(path, tstatp, NULL, NULL) == METACACHE_HIT) {
+    return (0);
+  }
+
+  char *remote_infop = NULL;
+  size_t remote_info_size;
+  char cached_path[MAXPATHLEN];
+  FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
+  time_t fetched = time(NULL);
+  if (http_stub_get_info(path, &remote_infop, &remote_info_size) == -1) {
+    warnx("failed to get dirnode information of the root (/).");
+    if (errno == ENOENT) {
+      return (ENOENT);
     }
+    if (config.stale_if_error > 0
+	&& metacache_lookup_stale(path, tstatp, NULL, NULL,
+				  config.stale_if_error) == METACACHE_HIT) {
+      DEBUG("serving the stale metadata of the root (/).\n");
+      return (0);
+    }
+    return (EIO);
+  }
+
+  /* convert the infop (in JSON) to tahoefs_stat_t{} structure. */
+  if (json_stub_jsonstring_to_tstat(remote_infop, tstatp) == -1) {
+    warnx("failed to convert JSON data to tahoefs stat structure");
+    free(remote_infop);
+    return (EIO);
+  }
+
+  if (filecache_cache_directory(cached_path, tstatp, remote_infop) == -1) {
+    warnx("failed to store attr info to the root (/).");
+    free(remote_infop);
+    return (EIO);
   }
 
+  /*
+   * the root dirnode carries no link metadata, so its own JSON is
+   * the best information we have.
+   */
+  int flags = 0;
+  if (config.snapshot) {
+    flags |= METACACHE_FLAG_PERMANENT;
+  }
+  metacache_store(path, tstatp, remote_infop, fetched, flags);
   free(remote_infop);
 
   return (0);
 }
 
+/*
+ * get the metadata of the node specified as the path parameter.  the
+ * metadata is taken from the metadata cache if possible, otherwise
+ * the whole listing of the parent directory is fetched and stored to
+ * the metadata cache so that the siblings can share it.  THE CALLER
+ * MUST FREE THE MEMORY allocated to the infopp parameter.
+ *
+ * expired metadata is served within --stale-while-revalidate while
+ * the parent is listed again in background, and within
+ * --stale-if-error if the gateway is unavailable.  on failure, errno
+ * is ENOENT only if the node doesn't exist.
+ */
 static int
-filecache_getattr_from_parent(const char *path, tahoefs_stat_t *tstatp)
+filecache_get_child_info(const char *path, tahoefs_stat_t *tstatp,
+			 char **infopp, int *flagsp)
 {
   assert(path != NULL);
   assert(tstatp != NULL);
+  assert(infopp != NULL);
+  assert(*infopp == NULL);
+
+  int flags = 0;
+  int status = metacache_lookup(path, tstatp, infopp, &flags);
+  if (status == METACACHE_MISS) {
+    char *parent_path = filecache_parent_path(path);
+    if (parent_path == NULL) {
+      errno = EIO;
+      return (-1);
+    }
+
+    if (config.stale_while_revalidate > 0
+	&& metacache_lookup_stale(path, tstatp, infopp, &flags,
+				  config.stale_while_revalidate)
+	   == METACACHE_HIT) {
+      if (!metacache_start_revalidate(parent_path)
+	  || prefetch_enqueue(PREFETCH_LISTING, parent_path, 0) == 0) {
+	status = METACACHE_HIT;
+      } else {
+	/* can't be done in background.  do it now. */
+	captable_tstat_release(tstatp);
+	memset(tstatp, 0, sizeof(tahoefs_stat_t));
+	free(*infopp);
+	*infopp = NULL;
+      }
+    }
+
+    if (status == METACACHE_MISS) {
+      if (filecache_fetch_listing(parent_path, NULL, NULL, NULL, 0) == -1) {
+	int errcode = errno;
+	if (errcode != ENOENT && config.stale_if_error > 0
+	    && metacache_lookup_stale(path, tstatp, infopp, &flags,
+				      config.stale_if_error)
+	       == METACACHE_HIT) {
+	  DEBUGV("serving the stale metadata of %s.\n", path);
+	  status = METACACHE_HIT;
+	} else {
+	  if (errcode == ENOENT) {
+	    /* there is no paranet directory. */
+	    warnx("parent directory of %s does not exist.", path);
+	  }
+	  free(parent_path);
+	  errno = errcode;
+	  return (-1);
+	}
+      } else {
+	status = metacache_lookup(path, tstatp, infopp, &flags);
+      }
+    }
+    free(parent_path);
+  }
+  if (status != METACACHE_HIT) {
+    errno = ENOENT;
+    return (-1);
+  }
+  if (flagsp) {
+    *flagsp = flags;
+  }
+
+  /* the parent is in use.  keep watching remote changes of it. */
+  if (!(flags & METACACHE_FLAG_PERMANENT)) {
+    poller_watch_parent(path);
+  }
+
+  return (0);
+}
+
+/*
+ * revalidate the metadata of the node specified as the path parameter
+ * in the metadata cache.  this is called by the refresher thread of
+ * the metacache module before hot entries expire.
+ */
+int
+filecache_refresh(const char *path)
+{
+  assert(path != NULL);
+
+  if (strcmp(path, "/") == 0) {
+    tahoefs_stat_t tstat;
+    memset(&tstat, 0, sizeof(tahoefs_stat_t));
+    int errcode = filecache_getattr_root(path, &tstat, 1);
+    captable_tstat_release(&tstat);
+    return (errcode ? -1 : 0);
+  }
+
+  /* children are refreshed by listing their parent. */
+  char *parent_path = filecache_parent_path(path);
+  if (parent_path == NULL) {
+    return (-1);
+  }
+  int ret = filecache_fetch_listing(parent_path, NULL, NULL, NULL, 0);
+  free(parent_path);
+
+  return (ret == -1 ? -1 : 0);
+}
+
+/*
+ * returns the path of the parent directory of the path parameter.
+ * THE CALLER MUST FREE THE MEMORY returned.
+ */
+static char *
+filecache_parent_path(const char *path)
+{
+  assert(path != NULL);
 
-  /* get the parent path. */
   char *parent_path = strdup(path);
   if (parent_path == NULL) {
     warn("failed to duplicate a string (%s).", path);
+    return (NULL);
   }
   char *slash = strrchr(parent_path, '/');
+  if (slash == NULL) {
+    warnx("invalid path %s.", path);
+    free(parent_path);
+    return (NULL);
+  }
   *slash = '\0';
-  const char *child_name = path + strlen(parent_path) +  1;
   if (*parent_path == '\0') {
     /* this means the root directory. */
     *parent_path = '/';
     *(parent_path + 1) = '\0';
   }
 
-  /* get the parent's remote info. */
-  char *remote_infop = NULL; /* must free this before returning. */
-  size_t remote_info_size;
-  char cached_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(parent_path, cached_path);
-  if (http_stub_get_info(parent_path, &remote_infop, &remote_info_size)
-      == -1) {
-    /* there is no paranet directory. */
-    warnx("parent directory of %s does not exist.", path);
-    if (filecache_uncache_node(cached_path) == -1) {
-      warnx("failed to remove a cache for %s.", cached_path);
+  return (parent_path);
+}
+
+int
+filecache_readdir(const char *path, void *buf, void *fillerp,
+		  json_stub_iterate_children_callback_t callback)
+{
+  assert(path != NULL);
+  assert(callback != NULL);
+
+  int ahead = filecache_is_tree_walk(path) ? config.readdir_ahead : 0;
+
+  /* the listing may have been fetched ahead. */
+  int ret = filecache_cached_listing(path, buf, fillerp, callback, ahead, 0);
+  if (ret == -1 && config.stale_while_revalidate > 0
+      && filecache_cached_listing(path, NULL, NULL, NULL, 0,
+				  config.stale_while_revalidate) != -1
+      && (!metacache_start_revalidate(path)
+	  || prefetch_enqueue(PREFETCH_LISTING, path, 0) == 0)) {
+    /* serve the stale one.  it is listed again in background. */
+    ret = filecache_cached_listing(path, buf, fillerp, callback, ahead,
+				   config.stale_while_revalidate);
+  }
+  if (ret == -1) {
+    ret = filecache_fetch_listing(path, buf, fillerp, callback, ahead);
+    if (ret == -1 && errno == EAGAIN && config.stale_if_error > 0) {
+      DEBUGV("serving the stale listing of %s.\n", path);
+      ret = filecache_cached_listing(path, buf, fillerp, callback, ahead,
+				     config.stale_if_error);
+      errno = EAGAIN;
+    }
+  }
+  if (ret == -1) {
+    warnx("failed to list the children of %s.", path);
+    return (errno == ENOENT ? ENOENT : EIO);
+  }
+  if (ret == 0) {
+    /* a mutable directory.  keep watching remote changes of it. */
+    poller_watch(path);
+  }
+
+  return (0);
+}
+
+/*
+ * re-read the listing of the directory specified as the path
+ * parameter for the poller module.  the metadata cache is updated as
+ * well, so the following operations see the changes.
+ */
+int
+filecache_poll(const char *path, poller_listing_t *listingp)
+{
+  assert(path != NULL);
+  assert(listingp != NULL);
+
+  int ret = filecache_fetch_listing(path, listingp, NULL,
+				    filecache_poll_callback, 0);
+  if (ret == 1) {
+    return (POLLER_FETCH_IMMUTABLE);
+  }
+  return (ret);
+}
+
+static int
+filecache_poll_callback(tahoefs_readdir_baton_t *batonp)
+{
+  assert(batonp != NULL);
+
+  return (poller_listing_add((poller_listing_t *)batonp->nodename_listp,
+			     batonp->nodename, batonp->infop));
+}
+
+/*
+ * fetch the dirnode information of the directory specified as the
+ * path parameter, and store the metadata of all its children to the
+ * metadata cache.  if the callback parameter is specified, it is
+ * called for each child with the buf and fillerp parameters.  the
+ * listings of the subdirectories are fetched ahead in background down
+ * to the levels specified as the ahead parameter.
+ *
+ * the response is parsed while it is being received, and each child
+ * is processed as soon as its entry arrives, so the whole JSON of a
+ * large directory is never held in memory.
+ *
+ * returns 1 if the directory is immutable, 0 if it is mutable, and -1
+ * on failure.  on failure, errno is ENOENT if the directory doesn't
+ * exist, EAGAIN if the gateway is unavailable and nothing has been
+ * passed to the callback yet, and EIO otherwise.
+ */
+static int
+filecache_fetch_listing(const char *path, void *buf, void *fillerp,
+			json_stub_iterate_children_callback_t callback,
+			int ahead)
+{
+  assert(path != NULL);
+
+  /*
+   * the children of an immutable directory can never be relinked, so
+   * they and the listing itself are cached permanently.  the
+   * information of the directory itself comes after its children in
+   * the JSON, so the one taken from its parent listing is used if
+   * possible.
+   */
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  int immutable = config.snapshot;
+  int immutable_known = immutable;
+  if (!immutable_known
+      && metacache_lookup(path, &tstat, NULL, NULL) == METACACHE_HIT) {
+    immutable = filecache_is_immutable_directory(&tstat);
+    immutable_known = 1;
+    captable_tstat_release(&tstat);
+  }
+
+  filecache_listing_baton_t listing;
+  memset(&listing, 0, sizeof(filecache_listing_baton_t));
+  listing.path = path;
+  listing.fetched = time(NULL);
+  listing.flags = immutable ? METACACHE_FLAG_PERMANENT : 0;
+  listing.ahead = ahead;
+  listing.buf = buf;
+  listing.fillerp = fillerp;
+  listing.callback = callback;
+
+  json_stub_stream_t *streamp;
+  streamp = json_stub_stream_new(&listing, filecache_fetch_listing_callback);
+  if (streamp == NULL) {
+    errno = EAGAIN;
+    return (-1);
+  }
+  int errcode = 0;
+  int ret = http_stub_stream_info(path, filecache_fetch_listing_chunk,
+				  streamp);
+  if (ret == 0) {
+    memset(&tstat, 0, sizeof(tahoefs_stat_t));
+    ret = json_stub_stream_finish(streamp, &tstat);
+    errcode = EIO;
+  } else {
+    errcode = errno;
+  }
+  json_stub_stream_free(streamp);
+  if (ret == -1) {
+    warnx("failed to get dirnode information of %s.", path);
+    if (errcode == ENOENT) {
+      char cached_path[MAXPATHLEN];
+      FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
+      if (filecache_uncache_node(cached_path) == -1) {
+	warnx("failed to remove a cache for %s.", cached_path);
+      }
+    } else if (listing.callback == NULL || listing.names_len == 0) {
+      /* the caller may still use the cached listing. */
+      errcode = EAGAIN;
+    } else {
+      errcode = EIO;
     }
+    free(listing.names);
+    errno = errcode;
     return (-1);
   }
+  if (!immutable_known) {
+    /* the children were cached with the expiry this time. */
+    immutable = filecache_is_immutable_directory(&tstat);
+  }
+  captable_tstat_release(&tstat);
 
-  /* get the info of the specified child. */
-  char *child_infop = NULL; /* must free this before returning. */
-  json_stub_extract_child(child_name, &child_infop, remote_infop);
-  free(remote_infop);
+  metacache_store_listing(path, listing.names, listing.names_len);
+  free(listing.names);
 
-  /* create a cached directory and store info attr */
-  /* if it is a file, ignore it */
-  /* also fill tstatp */
-  json_stub_jsonstring_to_tstat(child_infop, tstatp);
+  metacache_set_listed(path, listing.fetched, immutable);
 
+  return (immutable ? 1 : 0);
+}
 
-  free(child_infop);
+static int
+filecache_fetch_listing_chunk(const char *datap, size_t size, void *batonp)
+{
+  assert(datap != NULL);
+  assert(batonp != NULL);
 
-  return (0);
+  return (json_stub_stream_feed((json_stub_stream_t *)batonp, datap, size));
 }
 
 static int
-filecache_cached_getattr(const char *cached_path,
-			 tahoefs_stat_t *cached_tstatp)
+filecache_fetch_listing_callback(tahoefs_readdir_baton_t *batonp)
 {
-  assert(cached_path != NULL);
-  assert(cached_tstatp != NULL);
+  assert(batonp != NULL);
+  assert(batonp->tstatp != NULL);
+
+  filecache_listing_baton_t *listingp
+    = (filecache_listing_baton_t *)batonp->nodename_listp;
+
+  char child_path[MAXPATHLEN];
+  snprintf(child_path, sizeof(child_path), "%s/%s",
+	   strcmp(listingp->path, "/") == 0 ? "" : listingp->path,
+	   batonp->nodename);
+
+  /* the JSON is kept only for the debug xattr. */
+  metacache_store(child_path, batonp->tstatp,
+		  config.debug ? batonp->infop : NULL,
+		  listingp->fetched, listingp->flags);
+  if (listingp->ahead > 0
+      && batonp->tstatp->type == TAHOEFS_STAT_TYPE_DIRNODE) {
+    /* best effort.  dropped if the queue is full. */
+    prefetch_enqueue(PREFETCH_LISTING, child_path, listingp->ahead - 1);
+  }
+
+  /* remember the name for filecache_cached_listing(). */
+  size_t name_size = strlen(batonp->nodename) + 1;
+  if (listingp->names_len + name_size > listingp->names_size) {
+    size_t new_size = listingp->names_size ? listingp->names_size * 2 : 1024;
+    while (new_size < listingp->names_len + name_size) {
+      new_size *= 2;
+    }
+    char *new_names = realloc(listingp->names, new_size);
+    if (new_names == NULL) {
+      warn("failed to allocate memory for the names in %s.", listingp->path);
+      return (-1);
+    }
+    listingp->names = new_names;
+    listingp->names_size = new_size;
+  }
+  memcpy(&listingp->names[listingp->names_len], batonp->nodename, name_size);
+  listingp->names_len += name_size;
+
+  if (listingp->callback == NULL) {
+    return (0);
+  }
+  tahoefs_readdir_baton_t baton;
+  baton.nodename = batonp->nodename;
+  baton.infop = batonp->infop;
+  baton.tstatp = batonp->tstatp;
+  baton.nodename_listp = listingp->buf;
+  baton.fillerp = listingp->fillerp;
+  return (listingp->callback(&baton));
+}
+
+/*
+ * list the children of the directory specified as the path parameter
+ * from the names and the metadata kept in the metadata cache, in the
+ * same way as filecache_fetch_listing().  the infop of the baton
+ * passed to the callback is NULL.  returns -1 if no fresh listing is
+ * kept.  a listing expired up to max_stale seconds ago is used as well.
+ */
+static int
+filecache_cached_listing(const char *path, void *buf, void *fillerp,
+			 json_stub_iterate_children_callback_t callback,
+			 int ahead, time_t max_stale)
+{
+  assert(path != NULL);
 
-  char *cached_infos = NULL;
-  if (filecache_get_info_xattr(cached_path, (void **)&cached_infos) == -1) {
-    warnx("failed to get info xattr value from %s.", cached_path);
+  char *names = NULL;
+  size_t names_len;
+  if (metacache_lookup_listing(path, &names, &names_len, max_stale) == -1) {
     return (-1);
   }
 
-  if (json_stub_jsonstring_to_tstat(cached_infos, cached_tstatp) == -1) {
-    warnx("failed to convert JSON info string to tahoefs_stat_t{}.");
-    free(cached_infos);
+  /*
+   * look up all the children first.  if any of them has been dropped
+   * from the metadata cache, the listing cannot be served without
+   * omitting it.
+   */
+  size_t nchildren = 0;
+  const char *namep;
+  for (namep = names; namep < names + names_len; namep += strlen(namep) + 1) {
+    nchildren++;
+  }
+  tahoefs_stat_t *tstats = calloc(nchildren ? nchildren : 1,
+				  sizeof(tahoefs_stat_t));
+  if (tstats == NULL) {
+    warn("failed to allocate memory for the listing of %s.", path);
+    free(names);
+    return (-1);
+  }
+  size_t i = 0;
+  for (namep = names; namep < names + names_len; namep += strlen(namep) + 1) {
+    char child_path[MAXPATHLEN];
+    snprintf(child_path, sizeof(child_path), "%s/%s",
+	     strcmp(path, "/") == 0 ? "" : path, namep);
+    if (metacache_lookup_stale(child_path, &tstats[i], NULL, NULL, max_stale)
+	!= METACACHE_HIT) {
+      break;
+    }
+    i++;
+  }
+  if (i < nchildren) {
+    while (i > 0) {
+      captable_tstat_release(&tstats[--i]);
+    }
+    free(tstats);
+    free(names);
     return (-1);
   }
-    
-  free(cached_infos);
 
-  return (0);
+  for (namep = names, i = 0; i < nchildren;
+       namep += strlen(namep) + 1, i++) {
+    if (ahead > 0 && tstats[i].type == TAHOEFS_STAT_TYPE_DIRNODE) {
+      char child_path[MAXPATHLEN];
+      snprintf(child_path, sizeof(child_path), "%s/%s",
+	       strcmp(path, "/") == 0 ? "" : path, namep);
+      prefetch_enqueue(PREFETCH_LISTING, child_path, ahead - 1);
+    }
+    if (callback) {
+      tahoefs_readdir_baton_t baton;
+      baton.nodename = namep;
+      baton.infop = NULL;
+      baton.tstatp = &tstats[i];
+      baton.nodename_listp = buf;
+      baton.fillerp = fillerp;
+      if (callback(&baton) == -1) {
+	warnx("failed to add %s to directory list.", namep);
+      }
+    }
+    captable_tstat_release(&tstats[i]);
+  }
+  free(tstats);
+  free(names);
+
+  /* tell the caller if it is mutable as filecache_fetch_listing() does. */
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  int immutable = config.snapshot;
+  if (!immutable
+      && metacache_lookup_stale(path, &tstat, NULL, NULL, max_stale)
+	 == METACACHE_HIT) {
+    immutable = filecache_is_immutable_directory(&tstat);
+    captable_tstat_release(&tstat);
+  }
+
+  return (immutable ? 1 : 0);
 }
 
-static ssize_t
-filecache_get_info_xattr(const char *cached_path, void **infopp)
+/*
+ * remember the directory specified as the path parameter as recently
+ * read, and returns true if its parent was read recently, that is,
+ * someone is walking down the tree.  the first time it happens in a
+ * parent, the siblings are fetched ahead as well since the walker
+ * will visit them next.
+ */
+static int
+filecache_is_tree_walk(const char *path)
+{
+  assert(path != NULL);
+
+  if (config.readdir_ahead <= 0) {
+    return (0);
+  }
+
+  char *parent_path = NULL;
+  if (strcmp(path, "/") != 0) {
+    parent_path = filecache_parent_path(path);
+  }
+  int walking = 0, siblings = 0, remembered = 0;
+  int i;
+  pthread_mutex_lock(&filecache_recent_lock);
+  for (i = 0; i < FILECACHE_RECENT_DIRS; i++) {
+    filecache_recent_dir_t *recentp = &filecache_recent_dirs[i];
+    if (recentp->path == NULL) {
+      continue;
+    }
+    if (parent_path && strcmp(recentp->path, parent_path) == 0) {
+      walking = 1;
+      if (!recentp->ahead) {
+	recentp->ahead = 1;
+	siblings = 1;
+      }
+    }
+    if (strcmp(recentp->path, path) == 0) {
+      remembered = 1;
+    }
+  }
+  if (!remembered) {
+    filecache_recent_dir_t *recentp
+      = &filecache_recent_dirs[filecache_recent_next];
+    free(recentp->path);
+    recentp->path = strdup(path);
+    recentp->ahead = 0;
+    filecache_recent_next = (filecache_recent_next + 1)
+      % FILECACHE_RECENT_DIRS;
+  }
+  pthread_mutex_unlock(&filecache_recent_lock);
+
+  if (siblings) {
+    filecache_cached_listing(parent_path, NULL, NULL, NULL,
+			     config.readdir_ahead, 0);
+  }
+  free(parent_path);
+
+  return (walking);
+}
+
+/*
+ * read the metadata record of a cache node from its xattr, and put it
+ * into the cache index so that the next lookup doesn't need to touch
+ * the cache node.
+ */
+static int
+filecache_cached_getattr(const char *path, const char *cached_path,
+			 cacheindex_record_t *cached_recordp)
 {
+  assert(path != NULL);
   assert(cached_path != NULL);
-  assert(infopp != NULL);
-  assert(*infopp == NULL);
+  assert(cached_recordp != NULL);
 
-  ssize_t info_size;
-  info_size = getxattr(cached_path, FILECACHE_INFO_ATTR, NULL, 0
-#if defined(__APPLE__)
-		       , 0, 0
-#endif
-		       );
-  if (info_size == -1) {
-    warnx("failed to retreive the size of tahoefs_info attr of %s.",
-	 cached_path);
+  tahoefs_stat_t cached_tstat;
+  memset(&cached_tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_read_record(cached_path, &cached_tstat) == -1) {
     return (-1);
   }
+  cacheindex_record_from_tstat(&cached_tstat, cached_recordp);
+  captable_tstat_release(&cached_tstat);
+  cacheindex_store(path, cached_recordp);
 
-  char *infop = malloc(info_size);
-  info_size = getxattr(cached_path, FILECACHE_INFO_ATTR, infop, info_size
-#if defined(__APPLE__)
-		       , 0, 0
-#endif
-		       );
-  if (info_size == -1) {
-    warn("failed to retreive the value of tahoefs_info attr of %s.",
-	 cached_path);
-    free(infop);
+  return (0);
+}
+
+/*
+ * decode the metadata record of the cache node specified as the
+ * cached_path parameter.  the caller must release tstatp by
+ * captable_tstat_release() on success.
+ */
+static int
+filecache_read_record(const char *cached_path, tahoefs_stat_t *tstatp)
+{
+  assert(cached_path != NULL);
+  assert(tstatp != NULL);
+
+  if (filecache_load_record(cached_path, tstatp) == -1) {
+    if (errno == EINVAL) {
+      warnx("invalid metadata record in %s.", cached_path);
+    } else {
+      warn("failed to get the metadata record of %s.", cached_path);
+    }
     return (-1);
   }
 
-  *infopp = infop;
-  return (info_size);
+  return (0);
 }
 
+/*
+ * filecache_read_record() without the warnings.  errno is EINVAL if
+ * the record is broken.
+ */
 static int
-filecache_set_info_xattr(const char *cached_path, void *infop, size_t info_size)
+filecache_load_record(const char *cached_path, tahoefs_stat_t *tstatp)
 {
   assert(cached_path != NULL);
-  assert(infop != NULL);
+  assert(tstatp != NULL);
 
-  if (setxattr(cached_path, FILECACHE_INFO_ATTR, infop, info_size,
+  char record[FILECACHE_RECORD_MAX];
+  ssize_t record_size;
+  record_size = getxattr(cached_path, FILECACHE_RECORD_ATTR, record,
+			 sizeof(record)
 #if defined(__APPLE__)
-	       0,
+			 , 0, 0
 #endif
-	       0) == -1) {
-    warn("failed to set tahoefs_info attr to %s.", cached_path);
+			 );
+  if (record_size == -1) {
+    return (-1);
+  }
+  if (filecache_record_decode(record, record_size, tstatp) == -1) {
+    errno = EINVAL;
     return (-1);
   }
+
+  return (0);
+}
+
+/*
+ * returns true if the cache described by the cached_recordp parameter
+ * is older than the remote node.
+ */
+static int
+filecache_is_outdated(const tahoefs_stat_t *tstatp,
+		      const cacheindex_record_t *cached_recordp)
+{
+  assert(tstatp != NULL);
+  assert(cached_recordp != NULL);
+
+  if (filecache_is_immutable_file(tstatp)
+      || filecache_is_immutable_directory(tstatp)) {
+    /*
+     * the contents of an immutable node never change.  the cache is
+     * valid as long as the path is still bound to the same cap,
+     * regardless of the link timestamps.
+     */
+    return (cacheindex_hash(TAHOEFS_CAP(tstatp->ro_uri))
+	    != cached_recordp->cap_hash);
+  }
+  return ((tstatp->link_creation_time
+	   > cached_recordp->link_creation_time)
+	  || (tstatp->link_modification_time
+	      > cached_recordp->link_modification_time));
+}
+
+/*
+ * the name of the object of the cap whose hash is specified as the
+ * cap_hash parameter.  the key parameter must have
+ * FILECACHE_OBJECT_KEY_SIZE bytes.
+ */
+static void
+filecache_object_key(u_int64_t cap_hash, char *key)
+{
+  assert(key != NULL);
+
+  snprintf(key, FILECACHE_OBJECT_KEY_SIZE, "%016llx",
+	   (unsigned long long)cap_hash);
+}
+
+static void
+filecache_object_path(const char *key, char *object_path)
+{
+  assert(key != NULL);
+  assert(object_path != NULL);
+
+  snprintf(object_path, MAXPATHLEN, "%s/%.2s/%.2s/%s", filecache_object_dir,
+	   key, key + 2, key);
+}
+
+static void
+filecache_dirty_path(const char *path, char *dirty_path)
+{
+  assert(path != NULL);
+  assert(dirty_path != NULL);
+
+  snprintf(dirty_path, MAXPATHLEN, "%s%s/%016llx", filecache_cache_dir,
+	   FILECACHE_DIRTY_DIR, (unsigned long long)cacheindex_hash(path));
+}
+
+/*
+ * get the local file holding the contents of the file specified as
+ * the path parameter: the private copy if the file is being written,
+ * the spooled copy if it is waiting for upload, or the object of its
+ * cap.  the key parameter is set to the object name, or an empty
+ * string for a private or spooled copy.  the local file may not exist
+ * yet, and a spooled copy disappears when it is uploaded.  on failure,
+ * errno is ENOENT if the file has no contents at remote storage.
+ */
+static int
+filecache_body_path(const char *path, char *body_path, char *key)
+{
+  assert(path != NULL);
+  assert(body_path != NULL);
+  assert(key != NULL);
+
+  if (filecache_is_dirty(path)) {
+    filecache_dirty_path(path, body_path);
+    key[0] = '\0';
+    return (0);
+  }
+  if (uploader_lookup(path, body_path) == 0) {
+    key[0] = '\0';
+    return (0);
+  }
+
+  char *infop = NULL;
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_get_child_info(path, &tstat, &infop, NULL) == -1) {
+    return (-1);
+  }
+  free(infop);
+  if (tstat.type != TAHOEFS_STAT_TYPE_FILENODE || tstat.ro_uri == NULL) {
+    int errcode = tstat.type == TAHOEFS_STAT_TYPE_FILENODE ? ENOENT : EISDIR;
+    captable_tstat_release(&tstat);
+    errno = errcode;
+    return (-1);
+  }
+  filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstat.ro_uri)), key);
+  captable_tstat_release(&tstat);
+  filecache_object_path(key, body_path);
+
+  return (0);
+}
+
+/*
+ * remove the object of the file described by the tstatp parameter.
+ */
+static int
+filecache_uncache_object(const tahoefs_stat_t *tstatp)
+{
+  assert(tstatp != NULL);
+
+  if (tstatp->ro_uri == NULL) {
+    return (0);
+  }
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstatp->ro_uri)), key);
+  evictor_remove(key);
+  return (filecache_remove_object(key, 0) == 0 ? 0 : -1);
+}
+
+/*
+ * hold the object specified as the key parameter for an open file
+ * until filecache_unhold() is called.
+ */
+static void
+filecache_hold(const char *key)
+{
+  assert(key != NULL);
+
+  evictor_hold(key);
+  if (config.shared_cache_dir == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&filecache_hold_lock);
+  filecache_hold_t *holdp = filecache_find_hold(key);
+  if (holdp == NULL) {
+    holdp = calloc(1, sizeof(filecache_hold_t));
+    if (holdp == NULL) {
+      warn("failed to allocate memory for a hold of %s.", key);
+      pthread_mutex_unlock(&filecache_hold_lock);
+      return;
+    }
+    strcpy(holdp->key, key);
+    holdp->fd = -1;
+    holdp->next = filecache_holds;
+    filecache_holds = holdp;
+  }
+  holdp->refs++;
+  pthread_mutex_unlock(&filecache_hold_lock);
+
+  char object_path[MAXPATHLEN];
+  filecache_object_path(key, object_path);
+  int fd = openat(FILECACHE_AT(object_path), O_RDONLY);
+  if (fd != -1) {
+    filecache_hold_object(key, fd);
+    close(fd);
+  }
+}
+
+static void
+filecache_unhold(const char *key)
+{
+  assert(key != NULL);
+
+  evictor_unhold(key);
+  if (config.shared_cache_dir == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&filecache_hold_lock);
+  filecache_hold_t **holdpp = &filecache_holds;
+  while (*holdpp && strcmp((*holdpp)->key, key) != 0) {
+    holdpp = &(*holdpp)->next;
+  }
+  filecache_hold_t *holdp = *holdpp;
+  if (holdp && --holdp->refs == 0) {
+    *holdpp = holdp->next;
+    if (holdp->fd != -1) {
+      close(holdp->fd);
+    }
+    free(holdp);
+  }
+  pthread_mutex_unlock(&filecache_hold_lock);
+}
+
+/*
+ * lock the object specified as the key parameter, opened as the fd
+ * parameter, if it is held and the lock is not on this object yet.
+ * the lock is not waited for.  the evictor of another process holding
+ * it exclusively is removing the object, and it is locked at the next
+ * read of the new one.
+ */
+static void
+filecache_hold_object(const char *key, int fd)
+{
+  assert(key != NULL);
+
+  if (config.shared_cache_dir == NULL) {
+    return;
+  }
+
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) == -1) {
+    return;
+  }
+  pthread_mutex_lock(&filecache_hold_lock);
+  filecache_hold_t *holdp = filecache_find_hold(key);
+  if (holdp == NULL
+      || (holdp->fd != -1 && holdp->dev == stbuf.st_dev
+	  && holdp->ino == stbuf.st_ino)) {
+    pthread_mutex_unlock(&filecache_hold_lock);
+    return;
+  }
+  /* the duplicate shares the open file, and so the lock. */
+  int lock_fd = dup(fd);
+  if (lock_fd == -1 || flock(lock_fd, LOCK_SH|LOCK_NB) == -1) {
+    if (lock_fd != -1) {
+      close(lock_fd);
+    }
+    pthread_mutex_unlock(&filecache_hold_lock);
+    return;
+  }
+  if (holdp->fd != -1) {
+    close(holdp->fd);
+  }
+  holdp->fd = lock_fd;
+  holdp->dev = stbuf.st_dev;
+  holdp->ino = stbuf.st_ino;
+  pthread_mutex_unlock(&filecache_hold_lock);
+}
+
+/*
+ * find the hold of the key.  the caller must hold filecache_hold_lock.
+ */
+static filecache_hold_t *
+filecache_find_hold(const char *key)
+{
+  assert(key != NULL);
+
+  filecache_hold_t *holdp;
+  for (holdp = filecache_holds; holdp; holdp = holdp->next) {
+    if (strcmp(holdp->key, key) == 0) {
+      break;
+    }
+  }
+  return (holdp);
+}
+
+static int
+filecache_is_dirty(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&filecache_dirty_lock);
+  filecache_dirty_t *dirtyp;
+  for (dirtyp = filecache_dirty_files; dirtyp; dirtyp = dirtyp->next) {
+    if (strcmp(dirtyp->path, path) == 0) {
+      break;
+    }
+  }
+  pthread_mutex_unlock(&filecache_dirty_lock);
+
+  return (dirtyp != NULL);
+}
+
+static int
+filecache_set_dirty(const char *path, int dirty)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&filecache_dirty_lock);
+  filecache_dirty_t **dirtypp = &filecache_dirty_files;
+  while (*dirtypp && strcmp((*dirtypp)->path, path) != 0) {
+    dirtypp = &(*dirtypp)->next;
+  }
+  if (dirty && *dirtypp == NULL) {
+    filecache_dirty_t *dirtyp = malloc(sizeof(filecache_dirty_t));
+    if (dirtyp == NULL || (dirtyp->path = strdup(path)) == NULL) {
+      warn("failed to allocate memory for a dirty file %s.", path);
+      free(dirtyp);
+      pthread_mutex_unlock(&filecache_dirty_lock);
+      return (-1);
+    }
+    dirtyp->next = filecache_dirty_files;
+    filecache_dirty_files = dirtyp;
+  } else if (!dirty && *dirtypp) {
+    filecache_dirty_t *dirtyp = *dirtypp;
+    *dirtypp = dirtyp->next;
+    free(dirtyp->path);
+    free(dirtyp);
+  }
+  pthread_mutex_unlock(&filecache_dirty_lock);
+
+  return (0);
+}
+
+/*
+ * make the private copy of the file specified as the path parameter
+ * to write it.  a file which doesn't exist at remote storage starts
+ * empty.
+ */
+static int
+filecache_make_dirty(const char *path)
+{
+  assert(path != NULL);
+
+  char dirty_path[MAXPATHLEN];
+  filecache_dirty_path(path, dirty_path);
+  if (filecache_mkdir_parent(dirty_path) == -1) {
+    warnx("failed to create a parent directory of %s.", dirty_path);
+    return (-1);
+  }
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char object_path[MAXPATHLEN];
+  int found = filecache_body_path(path, object_path, key);
+  if (found == 0 && key[0] == '\0') {
+    /* the contents waiting for upload are the latest. */
+    if (filecache_copy_file(object_path, dirty_path) == 0) {
+      return (filecache_set_dirty(path, 1));
+    }
+    /* uploaded meanwhile. */
+    found = filecache_body_path(path, object_path, key);
+  }
+  if (found == -1) {
+    if (errno != ENOENT) {
+      /* the current contents are unknown.  don't overwrite them. */
+      warnx("failed to get the current contents of %s.", path);
+      return (-1);
+    }
+    int fd = openat(FILECACHE_AT(dirty_path), (O_CREAT|O_TRUNC|O_WRONLY),
+		    (S_IRUSR|S_IWUSR));
+    if (fd == -1) {
+      warn("failed to create a file %s", dirty_path);
+      return (-1);
+    }
+    close(fd);
+  } else {
+    if (key[0]) {
+      evictor_hold(key);
+    }
+    int ret = filecache_copy_file(object_path, dirty_path);
+    if (ret == -1 && errno == ENOENT && key[0]) {
+      if (filecache_cache_file(path, object_path) == 0) {
+	ret = filecache_copy_file(object_path, dirty_path);
+      }
+    }
+    if (key[0]) {
+      evictor_unhold(key);
+    }
+    if (ret == -1) {
+      warnx("failed to copy %s to %s.", object_path, dirty_path);
+      return (-1);
+    }
+  }
+
+  return (filecache_set_dirty(path, 1));
+}
+
+static int
+filecache_copy_file(const char *from_path, const char *to_path)
+{
+  assert(from_path != NULL);
+  assert(to_path != NULL);
+
+  int from_fd = openat(FILECACHE_AT(from_path), O_RDONLY);
+  if (from_fd == -1) {
+    return (-1);
+  }
+  int to_fd = openat(FILECACHE_AT(to_path), (O_CREAT|O_TRUNC|O_WRONLY),
+		     (S_IRUSR|S_IWUSR));
+  if (to_fd == -1) {
+    warn("failed to create a file %s", to_path);
+    close(from_fd);
+    return (-1);
+  }
+
+  char buf[65536];
+  ssize_t nread;
+  while ((nread = read(from_fd, buf, sizeof(buf))) > 0) {
+    if (write(to_fd, buf, nread) != nread) {
+      nread = -1;
+      break;
+    }
+  }
+  close(from_fd);
+  if (close(to_fd) == -1 || nread == -1) {
+    warn("failed to copy %s to %s.", from_path, to_path);
+    unlinkat(FILECACHE_AT(to_path), 0);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * move the flushed private copy of the file specified as the path
+ * parameter into the object of its new cap.
+ */
+static int
+filecache_publish_dirty(const char *path, const char *dirty_path)
+{
+  assert(path != NULL);
+  assert(dirty_path != NULL);
+
+  char *infop = NULL;
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_get_child_info(path, &tstat, &infop, NULL) == -1) {
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+    return (-1);
+  }
+  if (tstat.type != TAHOEFS_STAT_TYPE_FILENODE || tstat.ro_uri == NULL) {
+    free(infop);
+    captable_tstat_release(&tstat);
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+    return (-1);
+  }
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char object_path[MAXPATHLEN];
+  filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstat.ro_uri)), key);
+  filecache_object_path(key, object_path);
+  if (filecache_mkdir_parent(object_path) == -1) {
+    warnx("failed to create a parent directory of %s.", object_path);
+    free(infop);
+    captable_tstat_release(&tstat);
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+    return (-1);
+  }
+
+  /* the shared object directory may be on another file system. */
+  char temp_path[MAXPATHLEN];
+  snprintf(temp_path, sizeof(temp_path), "%s.%lx.%lx", object_path,
+	   (unsigned long)getpid(), (unsigned long)pthread_self());
+  int lock_fd = filecache_lock_object(object_path);
+  if (filecache_is_immutable_file(&tstat)
+      && filecache_is_filled(object_path, &tstat)) {
+    /* the same contents are already there. */
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+  } else {
+    int ret = renameat(FILECACHE_AT(dirty_path), FILECACHE_AT(temp_path));
+    if (ret == -1 && errno == EXDEV) {
+      ret = filecache_copy_file(dirty_path, temp_path);
+      unlinkat(FILECACHE_AT(dirty_path), 0);
+    }
+    if (ret == 0 && infop) {
+      filecache_set_info_xattr(temp_path, infop, strlen(infop));
+    }
+    if (ret == -1
+	|| filecache_set_record_xattr(temp_path, &tstat) == -1
+	|| filecache_publish(temp_path, object_path) == -1) {
+      warnx("failed to store the contents of %s to %s.", path, object_path);
+      filecache_unlock_object(lock_fd);
+      free(infop);
+      captable_tstat_release(&tstat);
+      unlinkat(FILECACHE_AT(dirty_path), 0);
+      unlinkat(FILECACHE_AT(temp_path), 0);
+      return (-1);
+    }
+  }
+  filecache_unlock_object(lock_fd);
+  free(infop);
+  if (filecache_is_immutable_file(&tstat)) {
+    peer_advertise(tstat.ro_uri);
+  }
+
+  cacheindex_record_t record;
+  cacheindex_record_from_tstat(&tstat, &record);
+  cacheindex_store(path, &record);
+  captable_tstat_release(&tstat);
+
+  struct stat stbuf;
+  if (fstatat(FILECACHE_AT(object_path), &stbuf, 0) == 0) {
+    evictor_add(key, stbuf.st_size, 0);
+  }
+  if (policy_lookup(path) == POLICY_PIN) {
+    evictor_pin(key);
+  }
+
+  return (0);
+}
+
+/*
+ * upload the file spooled by the uploader, and cache it as the object
+ * of the new cap.
+ */
+static int
+filecache_upload(const char *path, const char *spool_path)
+{
+  assert(path != NULL);
+  assert(spool_path != NULL);
+
+  if (http_stub_flush(path, spool_path) == -1) {
+    return (-1);
+  }
+  metacache_invalidate(path);
+
+  if (filecache_publish_dirty(path, spool_path) == -1) {
+    warnx("failed to cache the uploaded contents of %s.", path);
+  }
+
+  return (0);
+}
+
+/*
+ * convert a cache node path back to the tahoe path.  the result points
+ * to inside of the cached_path parameter.
+ */
+static const char *
+filecache_cached_path_to_path(const char *cached_path)
+{
+  assert(cached_path != NULL);
+
+  size_t root_dir_len = strlen(FILECACHE_ROOT_DIR);
+  if (strncmp(cached_path, filecache_cache_dir, filecache_cache_dir_len) != 0
+      || strncmp(cached_path + filecache_cache_dir_len, FILECACHE_ROOT_DIR,
+		 root_dir_len) != 0) {
+    return (NULL);
+  }
+  return (cached_path + filecache_cache_dir_len + root_dir_len);
+}
+
+/*
+ * returns true if the node is an immutable file (a CHK or a literal
+ * file), whose contents are determined only by its cap.
+ */
+static int
+filecache_is_immutable_file(const tahoefs_stat_t *tstatp)
+{
+  assert(tstatp != NULL);
+
+  if (tstatp->type != TAHOEFS_STAT_TYPE_FILENODE || tstatp->mutable) {
+    return (0);
+  }
+  const char *cap = TAHOEFS_CAP(tstatp->ro_uri);
+  return (strncmp(cap, "URI:CHK:", 8) == 0
+	  || strncmp(cap, "URI:LIT:", 8) == 0);
+}
+
+/*
+ * returns true if the node is an immutable directory.
+ */
+static int
+filecache_is_immutable_directory(const tahoefs_stat_t *tstatp)
+{
+  assert(tstatp != NULL);
+
+  if (tstatp->type != TAHOEFS_STAT_TYPE_DIRNODE || tstatp->mutable) {
+    return (0);
+  }
+  return (TAHOEFS_IS_IMMUTABLE_DIRCAP(TAHOEFS_CAP(tstatp->ro_uri)));
+}
+
+/*
+ * encode tstatp to the binary record format into the buffer.  returns
+ * the length of the record, or -1 if the record cannot be encoded.
+ */
+static ssize_t
+filecache_record_encode(const tahoefs_stat_t *tstatp, char *buf,
+			size_t buf_size)
+{
+  assert(tstatp != NULL);
+  assert(buf != NULL);
+
+  filecache_record_header_t header;
+  memset(&header, 0, sizeof(filecache_record_header_t));
+  header.magic = FILECACHE_RECORD_MAGIC;
+  header.version = FILECACHE_RECORD_VERSION;
+  header.type = tstatp->type;
+  header.mutable = tstatp->mutable;
+  header.size = tstatp->size;
+  header.link_creation_time = tstatp->link_creation_time;
+  header.link_modification_time = tstatp->link_modification_time;
+  const char *rw_uri = TAHOEFS_CAP(tstatp->rw_uri);
+  const char *ro_uri = TAHOEFS_CAP(tstatp->ro_uri);
+  const char *verify_uri = TAHOEFS_CAP(tstatp->verify_uri);
+  size_t lens[3];
+  lens[0] = strlen(rw_uri);
+  lens[1] = strlen(ro_uri);
+  lens[2] = strlen(verify_uri);
+  if (lens[0] > FILECACHE_RECORD_CAP_MAX
+      || lens[1] > FILECACHE_RECORD_CAP_MAX
+      || lens[2] > FILECACHE_RECORD_CAP_MAX) {
+    /* too long to record. */
+    return (-1);
+  }
+  header.rw_uri_len = lens[0];
+  header.ro_uri_len = lens[1];
+  header.verify_uri_len = lens[2];
+
+  size_t record_size = sizeof(filecache_record_header_t) + header.rw_uri_len
+    + header.ro_uri_len + header.verify_uri_len;
+  if (record_size > buf_size) {
+    return (-1);
+  }
+
+  char *p = buf;
+  memcpy(p, &header, sizeof(filecache_record_header_t));
+  p += sizeof(filecache_record_header_t);
+  memcpy(p, rw_uri, header.rw_uri_len);
+  p += header.rw_uri_len;
+  memcpy(p, ro_uri, header.ro_uri_len);
+  p += header.ro_uri_len;
+  memcpy(p, verify_uri, header.verify_uri_len);
+
+  return (record_size);
+}
+
+/*
+ * decode the binary record to tstatp.  returns -1 if the record is
+ * broken or written in an unknown version.
+ */
+static int
+filecache_record_decode(const char *buf, size_t record_size,
+			tahoefs_stat_t *tstatp)
+{
+  assert(buf != NULL);
+  assert(tstatp != NULL);
+
+  filecache_record_header_t header;
+  if (record_size < sizeof(filecache_record_header_t)) {
+    return (-1);
+  }
+  memcpy(&header, buf, sizeof(filecache_record_header_t));
+  if (header.magic != FILECACHE_RECORD_MAGIC
+      || header.version != FILECACHE_RECORD_VERSION) {
+    return (-1);
+  }
+  if (header.rw_uri_len > FILECACHE_RECORD_CAP_MAX
+      || header.ro_uri_len > FILECACHE_RECORD_CAP_MAX
+      || header.verify_uri_len > FILECACHE_RECORD_CAP_MAX
+      || (sizeof(filecache_record_header_t) + header.rw_uri_len
+	  + header.ro_uri_len + header.verify_uri_len) != record_size) {
+    return (-1);
+  }
+
+  tstatp->type = header.type;
+  tstatp->mutable = header.mutable;
+  tstatp->size = header.size;
+  tstatp->link_creation_time = header.link_creation_time;
+  tstatp->link_modification_time = header.link_modification_time;
+
+  const char *p = buf + sizeof(filecache_record_header_t);
+  tstatp->rw_uri = filecache_record_intern(p, header.rw_uri_len);
+  p += header.rw_uri_len;
+  tstatp->ro_uri = filecache_record_intern(p, header.ro_uri_len);
+  p += header.ro_uri_len;
+  tstatp->verify_uri = filecache_record_intern(p, header.verify_uri_len);
+
+  return (0);
+}
+
+/*
+ * intern a cap stored in a record without the terminating NUL.
+ */
+static const char *
+filecache_record_intern(const char *cap, size_t cap_len)
+{
+  assert(cap != NULL);
+  assert(cap_len <= FILECACHE_RECORD_CAP_MAX);
+
+  char buf[FILECACHE_RECORD_CAP_MAX + 1];
+  memcpy(buf, cap, cap_len);
+  buf[cap_len] = '\0';
+  return (captable_intern(buf));
+}
+
+static int
+filecache_set_record_xattr(const char *cached_path,
+			   const tahoefs_stat_t *tstatp)
+{
+  assert(cached_path != NULL);
+  assert(tstatp != NULL);
+
+  char record[FILECACHE_RECORD_MAX];
+  ssize_t record_size = filecache_record_encode(tstatp, record,
+						sizeof(record));
+  if (record_size == -1) {
+    warnx("failed to encode the metadata record of %s.", cached_path);
+    return (-1);
+  }
+
+  if (setxattr(cached_path, FILECACHE_RECORD_ATTR, record, record_size,
+#if defined(__APPLE__)
+	       0,
+#endif
+	       0) == -1) {
+    warn("failed to set the metadata record to %s.", cached_path);
+    return (-1);
+  }
+  return (0);
+}
+
+/*
+ * the full JSON information is not needed to validate the cache.  it
+ * is stored only in the debug mode to help inspecting the cache.
+ */
+static int
+filecache_set_info_xattr(const char *cached_path, const char *infop,
+			 size_t info_size)
+{
+  assert(cached_path != NULL);
+  assert(infop != NULL);
+
+  if (!config.debug) {
+    return (0);
+  }
+
+  if (setxattr(cached_path, FILECACHE_INFO_ATTR, infop, info_size,
+#if defined(__APPLE__)
+	       0,
+#endif
+	       0) == -1) {
+    warn("failed to set tahoefs_info attr to %s.", cached_path);
+    return (-1);
+  }
+  return (0);
+}
+
+/*
+ * queue the record xattr of a cache directory.  the queue is flushed
+ * when it becomes full, or at termination.
+ */
+static int
+filecache_defer_record_xattr(const char *cached_path,
+			     const tahoefs_stat_t *tstatp)
+{
+  assert(cached_path != NULL);
+  assert(tstatp != NULL);
+
+  pthread_mutex_lock(&filecache_pending_lock);
+  int i;
+  for (i = 0; i < filecache_npending_records; i++) {
+    if (strcmp(filecache_pending_records[i].cached_path, cached_path) == 0) {
+      captable_tstat_release(&filecache_pending_records[i].tstat);
+      captable_tstat_copy(&filecache_pending_records[i].tstat, tstatp);
+      pthread_mutex_unlock(&filecache_pending_lock);
+      return (0);
+    }
+  }
+
+  if (filecache_npending_records == FILECACHE_PENDING_RECORDS_MAX) {
+    filecache_flush_record_xattrs();
+  }
+  filecache_pending_record_t *pendingp
+    = &filecache_pending_records[filecache_npending_records];
+  pendingp->cached_path = strdup(cached_path);
+  if (pendingp->cached_path == NULL) {
+    warn("failed to duplicate a string (%s).", cached_path);
+    pthread_mutex_unlock(&filecache_pending_lock);
+    return (filecache_set_record_xattr(cached_path, tstatp));
+  }
+  captable_tstat_copy(&pendingp->tstat, tstatp);
+  filecache_npending_records++;
+  pthread_mutex_unlock(&filecache_pending_lock);
+
+  return (0);
+}
+
+/*
+ * write all the queued record xattrs.  the caller must hold
+ * filecache_pending_lock.
+ */
+static void
+filecache_flush_record_xattrs(void)
+{
+  int i;
+  for (i = 0; i < filecache_npending_records; i++) {
+    filecache_pending_record_t *pendingp = &filecache_pending_records[i];
+    /* the directory may have been uncached meanwhile. */
+    if (faccessat(FILECACHE_AT(pendingp->cached_path), F_OK, 0) == 0) {
+      filecache_set_record_xattr(pendingp->cached_path, &pendingp->tstat);
+    }
+    captable_tstat_release(&pendingp->tstat);
+    free(pendingp->cached_path);
+    pendingp->cached_path = NULL;
+  }
+  filecache_npending_records = 0;
+}
+
+/*
+ * the handler of the jobs queued to the prefetch module.
+ */
+int
+filecache_prefetch(int type, const char *path, int arg)
+{
+  assert(path != NULL);
+
+  switch (type) {
+  case PREFETCH_LISTING:
+    return (filecache_prefetch_listing(path, arg));
+  case PREFETCH_CONTENTS:
+    return (filecache_prefetch_contents(path, arg));
+  case PREFETCH_WARMUP:
+    return (filecache_warmup(path));
+  default:
+    warnx("unknown prefetch job type %d.", type);
+    return (-1);
+  }
+}
+
+/*
+ * request the warm-up of the subtree specified as the path parameter.
+ * it runs in background if the prefetch module is enabled.
+ */
+int
+filecache_request_warmup(const char *path)
+{
+  assert(path != NULL);
+
+  if (prefetch_enqueue(PREFETCH_WARMUP, path, 0) == -1) {
+    if (filecache_warmup(path) == -1) {
+      return (EIO);
+    }
+  }
+  return (0);
+}
+
+/*
+ * describe the local cache of the node specified as the path
+ * parameter from the local state only.  the metadata is taken from
+ * the metadata cache if fresh, or from the record of the cache node.
+ * on success, THE CALLER MUST RELEASE residencyp->tstat by
+ * captable_tstat_release().
+ */
+int
+filecache_get_residency(const char *path, filecache_residency_t *residencyp)
+{
+  assert(path != NULL);
+  assert(residencyp != NULL);
+
+  memset(residencyp, 0, sizeof(filecache_residency_t));
+  tahoefs_stat_t *tstatp = &residencyp->tstat;
+  cacheindex_record_t record;
+  int indexed = (cacheindex_lookup(path, &record) == 0);
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char node_path[MAXPATHLEN];
+  if (metacache_lookup(path, tstatp, NULL, NULL) == METACACHE_HIT) {
+    residencyp->freshness = FILECACHE_FRESHNESS_FRESH;
+    if (indexed && filecache_is_outdated(tstatp, &record)) {
+      residencyp->freshness = FILECACHE_FRESHNESS_STALE;
+    }
+  } else if (indexed) {
+    /* the caps are in the record of the cache node. */
+    if (record.type == TAHOEFS_STAT_TYPE_DIRNODE) {
+      FILECACHE_PATH_TO_CACHED_PATH(path, node_path);
+    } else {
+      filecache_object_key(record.cap_hash, key);
+      filecache_object_path(key, node_path);
+    }
+    if (filecache_read_record(node_path, tstatp) == -1) {
+      memset(tstatp, 0, sizeof(tahoefs_stat_t));
+      tstatp->type = record.type;
+      tstatp->mutable = record.mutable;
+      tstatp->size = record.size;
+    }
+    residencyp->freshness = FILECACHE_FRESHNESS_UNVERIFIED;
+  } else {
+    return (ENOENT);
+  }
+
+  if (tstatp->type != TAHOEFS_STAT_TYPE_FILENODE) {
+    return (0);
+  }
+  if (filecache_is_dirty(path)) {
+    filecache_dirty_path(path, node_path);
+  } else if (tstatp->ro_uri) {
+    filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstatp->ro_uri)), key);
+    filecache_object_path(key, node_path);
+  } else {
+    filecache_object_key(record.cap_hash, key);
+    filecache_object_path(key, node_path);
+  }
+  struct stat stbuf;
+  if (fstatat(FILECACHE_AT(node_path), &stbuf, 0) == 0) {
+    residencyp->cached_size = stbuf.st_size;
+  }
+
+  return (0);
+}
+
+/*
+ * cache the contents of the file, or warm up the subtree of the
+ * directory, specified as the path parameter regardless of the
+ * warm-up filters.  it runs in background if the prefetch module is
+ * enabled.
+ */
+int
+filecache_request_prefetch(const char *path)
+{
+  assert(path != NULL);
+
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  int errcode = filecache_getattr(path, &tstat);
+  if (errcode) {
+    return (errcode);
+  }
+  int type = tstat.type;
+  captable_tstat_release(&tstat);
+  if (type == TAHOEFS_STAT_TYPE_DIRNODE) {
+    return (filecache_request_warmup(path));
+  }
+
+  if (prefetch_enqueue(PREFETCH_CONTENTS, path, 1) == -1) {
+    if (filecache_prefetch_contents(path, 1) == -1) {
+      return (EIO);
+    }
+  }
+  return (0);
+}
+
+/*
+ * remove the cached contents of the file specified as the path
+ * parameter.  returns EBUSY if the file is open or pinned.
+ */
+int
+filecache_request_evict(const char *path)
+{
+  assert(path != NULL);
+
+  filecache_residency_t residency;
+  int errcode = filecache_get_residency(path, &residency);
+  if (errcode) {
+    return (errcode == ENOENT ? 0 : errcode);
+  }
+  int type = residency.tstat.type;
+  int cached = (residency.cached_size > 0);
+  u_int64_t cap_hash = 0;
+  cacheindex_record_t record;
+  if (residency.tstat.ro_uri) {
+    cap_hash = cacheindex_hash(residency.tstat.ro_uri);
+  } else if (cacheindex_lookup(path, &record) == 0) {
+    cap_hash = record.cap_hash;
+  } else {
+    cached = 0;
+  }
+  captable_tstat_release(&residency.tstat);
+  if (type != TAHOEFS_STAT_TYPE_FILENODE) {
+    return (EISDIR);
+  }
+  if (!cached || filecache_is_dirty(path)) {
+    /* nothing to evict, or the writes are not flushed yet. */
+    return (cached ? EBUSY : 0);
+  }
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  filecache_object_key(cap_hash, key);
+  return (filecache_evict(key));
+}
+
+/*
+ * fetch the listing of the directory specified as the path parameter,
+ * and queue its subdirectories down to the levels specified as the
+ * ahead parameter.
+ */
+static int
+filecache_prefetch_listing(const char *path, int ahead)
+{
+  assert(path != NULL);
+
+  if (metacache_is_listed(path)) {
+    /* someone has already fetched it. */
+    if (ahead > 0) {
+      filecache_cached_listing(path, NULL, NULL, NULL, ahead, 0);
+    }
+    return (0);
+  }
+  return (filecache_fetch_listing(path, NULL, NULL, NULL, ahead) == -1
+	  ? -1 : 0);
+}
+
+/*
+ * cache the contents of the file specified as the path parameter if
+ * it is pinned, or if it passes the --warmup-pattern and
+ * --warmup-max-size filters.  the filters are not applied if the
+ * force parameter is true.  a no-cache file is never prefetched.
+ */
+static int
+filecache_prefetch_contents(const char *path, int force)
+{
+  assert(path != NULL);
+
+  int policy = policy_lookup(path);
+  if (policy == POLICY_NOCACHE) {
+    return (0);
+  }
+  int filtered = (policy != POLICY_PIN && !force);
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char object_path[MAXPATHLEN];
+  if (filecache_body_path(path, object_path, key) == -1) {
+    return (-1);
+  }
+  if (faccessat(FILECACHE_AT(object_path), F_OK, 0) == 0) {
+    if (policy == POLICY_PIN && key[0]) {
+      evictor_pin(key);
+    }
+    return (0);
+  }
+
+  char *infop = NULL;
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_get_child_info(path, &tstat, &infop, NULL) == -1) {
+    return (-1);
+  }
+  free(infop);
+  int wanted = (tstat.type == TAHOEFS_STAT_TYPE_FILENODE);
+  if (config.warmup_max_size > 0 && filtered
+      && tstat.size > (u_int64_t)config.warmup_max_size) {
+    wanted = 0;
+  }
+  captable_tstat_release(&tstat);
+  if (config.warmup_pattern && filtered) {
+    const char *name = strrchr(path, '/');
+    name = name ? name + 1 : path;
+    if (fnmatch(config.warmup_pattern, name, 0) != 0) {
+      wanted = 0;
+    }
+  }
+  if (!wanted) {
+    return (0);
+  }
+
+  return (filecache_cache_file(path, object_path));
+}
+
+/*
+ * warm up the subtree specified as the path parameter.  the deep
+ * manifest of the subtree is retrieved in one streamed request, and
+ * the listings of all the directories in it (and the contents of the
+ * pinned files, and of the other files if --warmup-pattern or
+ * --warmup-max-size is specified) are
+ * fetched by the prefetch workers in parallel.  the manifest doesn't
+ * carry the link metadata, so the listings are still needed.
+ */
+static int
+filecache_warmup(const char *path)
+{
+  assert(path != NULL);
+
+  DEBUGV("warming up %s.\n", path);
+  if (http_stub_stream_manifest(path, filecache_warmup_callback,
+				(void *)path) == -1) {
+    warnx("failed to get the manifest of %s.", path);
+    return (-1);
+  }
+  return (0);
+}
+
+static int
+filecache_warmup_callback(const char *line, void *batonp)
+{
+  assert(line != NULL);
+  assert(batonp != NULL);
+
+  const char *root_path = (const char *)batonp;
+  int type;
+  char unit_path[MAXPATHLEN];
+  if (json_stub_manifest_unit(line, &type, unit_path,
+			      sizeof(unit_path)) == -1) {
+    /* skip a broken line. */
+    return (0);
+  }
+
+  char path[MAXPATHLEN];
+  if (strcmp(root_path, "/") == 0) {
+    snprintf(path, sizeof(path), "%s", unit_path[0] ? unit_path : "/");
+  } else {
+    snprintf(path, sizeof(path), "%s%s", root_path, unit_path);
+  }
+
+  /* when the queue is full, do the job here to bound the memory. */
+  int policy;
+  switch (type) {
+  case TAHOEFS_STAT_TYPE_DIRNODE:
+    if (prefetch_enqueue(PREFETCH_LISTING, path, 0) == -1) {
+      filecache_prefetch_listing(path, 0);
+    }
+    break;
+  case TAHOEFS_STAT_TYPE_FILENODE:
+    policy = policy_lookup(path);
+    if (policy == POLICY_NOCACHE
+	|| (policy != POLICY_PIN && config.warmup_pattern == NULL
+	    && config.warmup_max_size <= 0)) {
+      break;
+    }
+    if (prefetch_enqueue(PREFETCH_CONTENTS, path, 0) == -1) {
+      filecache_prefetch_contents(path, 0);
+    }
+    break;
+  default:
+    break;
+  }
+
   return (0);
 }
 
@@ -336,18 +2658,26 @@ filecache_get_real_size(const char *path, size_t *real_size)
   assert(path != NULL);
   assert(real_size != NULL);
 
-  char cache_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(path, cache_path);
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char body_path[MAXPATHLEN];
+  if (filecache_body_path(path, body_path, key) == -1) {
+    return (ENOENT);
+  }
 
   struct stat stat;
   memset(&stat, 0, sizeof(struct stat));
-  if (filecache_get_cache_stat(cache_path, &stat) == -1) {
-    if (filecache_cache_file(path, cache_path) == -1) {
+  /* a spooled copy may have been uploaded meanwhile. */
+  if (key[0] == '\0' && fstatat(FILECACHE_AT(body_path), &stat, 0) == -1
+      && errno == ENOENT && filecache_body_path(path, body_path, key) == -1) {
+    return (ENOENT);
+  }
+  if (filecache_get_cache_stat(body_path, &stat) == -1) {
+    if (filecache_cache_file(path, body_path) == -1) {
       warnx("failed to cache %s.", path);
       return (EIO);
     }
-    if (filecache_get_cache_stat(cache_path, &stat) == -1) {
-      warnx("failed to get cache stat of %s.", cache_path);
+    if (filecache_get_cache_stat(body_path, &stat) == -1) {
+      warnx("failed to get cache stat of %s.", body_path);
       return (EIO);
     }
   }
@@ -356,10 +2686,18 @@ filecache_get_real_size(const char *path, size_t *real_size)
   return (0);
 }
 
+/*
+ * open the file specified as the path parameter.  the handlep
+ * parameter is set to the cap hash of the object held for the open
+ * file, which must be passed to filecache_release().
+ */
 int
-filecache_open(const char *path, int flags)
+filecache_open(const char *path, int flags, u_int64_t *handlep)
 {
   assert(path != NULL);
+  assert(handlep != NULL);
+
+  *handlep = 0;
 
   /* exclude unsupported options. */
   if (flags && !(flags & FILECACHE_SUPPORTED_OPEN_FLAGS)) {
@@ -367,7 +2705,7 @@ filecache_open(const char *path, int flags)
   }
 
   /* when the read op is specified, the specified file must exist. */
-  if (flags & (O_RDONLY|O_RDWR)) {
+  if ((flags & O_ACCMODE) != O_WRONLY) {
     tahoefs_stat_t tstat;
     memset(&tstat, 0, sizeof(tahoefs_stat_t));
     int errcode = 0;
@@ -376,32 +2714,83 @@ filecache_open(const char *path, int flags)
       /* cannot get attribute of the file. */
       return (errcode);
     }
+
+    /* the object of an open file must stay in the cache. */
+    if (tstat.type == TAHOEFS_STAT_TYPE_FILENODE && tstat.ro_uri != NULL) {
+      char key[FILECACHE_OBJECT_KEY_SIZE];
+      char object_path[MAXPATHLEN];
+      *handlep = cacheindex_hash(TAHOEFS_CAP(tstat.ro_uri));
+      filecache_object_key(*handlep, key);
+      filecache_object_path(key, object_path);
+      if (filecache_is_foreign(object_path, tstat.ro_uri)) {
+	/* fetched again for this cap on the first read. */
+	filecache_uncache_object(&tstat);
+      }
+      filecache_hold(key);
+    }
+    captable_tstat_release(&tstat);
   }
 
   return (0);
 }
 
 int
-filecache_create(const char *path, mode_t mode)
+filecache_release(const char *path, int flags, u_int64_t handle)
 {
   assert(path != NULL);
 
-  char cached_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
+  if (handle) {
+    char key[FILECACHE_OBJECT_KEY_SIZE];
+    filecache_object_key(handle, key);
+    filecache_unhold(key);
+    /* the contents of a no-cache file are not kept after the last close. */
+    if (policy_lookup(path) == POLICY_NOCACHE) {
+      /* EBUSY if it is still open. */
+      filecache_evict(key);
+    }
+  }
+
+  return (0);
+}
+
+int
+filecache_create(const char *path, mode_t mode, u_int64_t *handlep)
+{
+  assert(path != NULL);
+  assert(handlep != NULL);
+
+  *handlep = 0;
 
-  int fd = open(cached_path, (O_CREAT|O_TRUNC|O_WRONLY), (S_IRUSR|S_IWUSR));
+  /* the uploads of the previous contents must not overwrite it. */
+  uploader_cancel(path);
+
+  char dirty_path[MAXPATHLEN];
+  filecache_dirty_path(path, dirty_path);
+  if (filecache_mkdir_parent(dirty_path) == -1) {
+    warnx("failed to create a parent directory of %s.", dirty_path);
+    return (EIO);
+  }
+
+  int fd = openat(FILECACHE_AT(dirty_path), (O_CREAT|O_TRUNC|O_WRONLY),
+		    (S_IRUSR|S_IWUSR));
   if (fd == -1) {
-    warn("failed to create a file %s", cached_path);
+    warn("failed to create a file %s", dirty_path);
     return (errno);
   }
   close(fd);
 
-  if (http_stub_create(path, cached_path, (mode & S_IWUSR)) == -1) {
+  if (http_stub_create(path, dirty_path, (mode & S_IWUSR)) == -1) {
     warnx("failed to create the file %s via HTTP", path);
+    unlinkat(FILECACHE_AT(dirty_path), 0);
     return (EIO);
   }
+  metacache_invalidate(path);
 
-  filecache_cache_file(path, cached_path);
+  /* the new file is written through its private copy. */
+  if (filecache_set_dirty(path, 1) == -1) {
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+    return (ENOMEM);
+  }
 
   return (0);
 }
@@ -411,10 +2800,22 @@ filecache_unlink(const char *path)
 {
   assert(path != NULL);
 
+  /* the file must not come back by an upload queued before. */
+  uploader_cancel(path);
+
   if (http_stub_unlink_rmdir(path) == -1) {
     warnx("failed to remove a file %s via HTTP", path);
     return (EIO);
   }
+  metacache_invalidate(path);
+
+  /* unflushed writes to the file are gone with it. */
+  if (filecache_is_dirty(path)) {
+    char dirty_path[MAXPATHLEN];
+    filecache_dirty_path(path, dirty_path);
+    unlinkat(FILECACHE_AT(dirty_path), 0);
+    filecache_set_dirty(path, 0);
+  }
 
   return (0);
 }
@@ -429,20 +2830,32 @@ filecache_read(const char *path, char *buf, size_t size, off_t offset,
   if (flags & O_WRONLY)
     return (-1);
 
-  char cache_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(path, cache_path);
-
-  struct stat stat;
-  memset(&stat, 0, sizeof(struct stat));
-  if (filecache_get_cache_stat(cache_path, &stat) == -1) {
-    filecache_cache_file(path, cache_path);
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char body_path[MAXPATHLEN];
+  if (filecache_body_path(path, body_path, key) == -1) {
+    warnx("failed to locate the contents of %s.", path);
+    return (-1);
   }
 
-  int fd = open(cache_path, O_RDONLY);
+  int fd = openat(FILECACHE_AT(body_path), O_RDONLY);
+  if (fd == -1 && errno == ENOENT && key[0] == '\0'
+      && filecache_body_path(path, body_path, key) == 0) {
+    /* the spooled copy has been uploaded meanwhile. */
+    fd = openat(FILECACHE_AT(body_path), O_RDONLY);
+  }
+  if (fd == -1 && errno == ENOENT && key[0]) {
+    /* not cached yet, or evicted meanwhile. */
+    filecache_cache_file(path, body_path);
+    fd = openat(FILECACHE_AT(body_path), O_RDONLY);
+  }
   if (fd == -1) {
-    warn("failed to open cache file %s.", cache_path);
+    warn("failed to open cache file %s.", body_path);
     return (-1);
   }
+  if (key[0]) {
+    evictor_touch(key);
+    filecache_hold_object(key, fd);
+  }
   ssize_t read = pread(fd, buf, size, offset);
   close(fd);
 
@@ -456,24 +2869,22 @@ filecache_write(const char *path, const char *buf, size_t size, off_t offset,
   assert(path != NULL);
   assert(buf != NULL);
 
-  if (flags & O_RDONLY) {
+  if ((flags & O_ACCMODE) == O_RDONLY) {
     warnx("writing to a file opened as read only: %s", path);
     return (-1);
   }
 
-  char cached_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
-
-  struct stat stat;
-  memset(&stat, 0, sizeof(struct stat));
-  if (filecache_get_cache_stat(cached_path, &stat) == -1) {
-    filecache_cache_file(path, cached_path);
-    /* error is ignored. */
+  /* the object of the current cap must not be modified. */
+  if (!filecache_is_dirty(path) && filecache_make_dirty(path) == -1) {
+    warnx("failed to make a private copy of %s.", path);
+    return (-1);
   }
 
-  int fd = open(cached_path, O_RDWR);
+  char dirty_path[MAXPATHLEN];
+  filecache_dirty_path(path, dirty_path);
+  int fd = openat(FILECACHE_AT(dirty_path), O_RDWR);
   if (fd == -1) {
-    warn("failed to open a cache file %s.", cached_path);
+    warn("failed to open a cache file %s.", dirty_path);
     return (-1);
   }
 
@@ -488,18 +2899,55 @@ filecache_flush(const char *path, int flags)
 {
   assert(path != NULL);
 
-  /* read only operation doesn't need to flush anything. */
-  if (flags & O_RDONLY) {
+  /* nothing to flush unless something has been written. */
+  if (!filecache_is_dirty(path)) {
     return (0);
   }
 
-  char cached_path[MAXPATHLEN];
-  FILECACHE_PATH_TO_CACHED_PATH(path, cached_path);
+  char dirty_path[MAXPATHLEN];
+  filecache_dirty_path(path, dirty_path);
+
+  /* with write-back, the copy is uploaded in background. */
+  if (uploader_enqueue(path, dirty_path) == 0) {
+    filecache_set_dirty(path, 0);
+    return (0);
+  }
+  /* the uploads left by the previous run are older than this. */
+  uploader_cancel(path);
 
-  if (http_stub_flush(path, cached_path) == -1) {
+  if (http_stub_flush(path, dirty_path) == -1) {
+    /* keep the private copy for the next flush. */
     warnx("failed to flush the contents of %s", path);
     return (EIO);
   }
+  metacache_invalidate(path);
+
+  /* the uploaded contents are the object of the new cap. */
+  if (filecache_publish_dirty(path, dirty_path) == -1) {
+    warnx("failed to cache the flushed contents of %s.", path);
+  }
+  filecache_set_dirty(path, 0);
+
+  return (0);
+}
+
+/*
+ * flush the file specified as the path parameter and wait until its
+ * contents are stored at remote storage.
+ */
+int
+filecache_fsync(const char *path)
+{
+  assert(path != NULL);
+
+  int errcode = filecache_flush(path, 0);
+  if (errcode) {
+    return (errcode);
+  }
+  if (uploader_wait(path) == -1) {
+    warnx("failed to upload the contents of %s.", path);
+    return (EIO);
+  }
 
   return (0);
 }
@@ -513,6 +2961,7 @@ filecache_mkdir(const char *path, mode_t mode)
     warnx("failed to create a directory %s via HTTP", path);
     return (-EIO);
   }
+  metacache_invalidate(path);
 
   return (0);
 }
@@ -526,203 +2975,575 @@ filecache_rmdir(const char *path)
     warnx("failed to remove a directory %s via HTTP", path);
     return (EIO);
   }
+  metacache_invalidate(path);
+
+  return (0);
+}
+
+/*
+ * remove the object specified as the key parameter unless it is held.
+ * returns EBUSY if it is.  the paths bound to it are left in the
+ * index, and it is fetched again on the next read.
+ */
+int
+filecache_evict(const char *key)
+{
+  return (filecache_remove_object(key, 1));
+}
+
+/*
+ * remove the object specified as the key parameter.  if the evict
+ * parameter is true, an object held by this or another process is
+ * left and EBUSY is returned.
+ * otherwise, it is removed anyway since its contents are wrong.
+ */
+static int
+filecache_remove_object(const char *key, int evict)
+{
+  assert(key != NULL);
+
+  char object_path[MAXPATHLEN];
+  filecache_object_path(key, object_path);
+
+  int lock_fd = filecache_lock_object(object_path);
+  /* the evictor may have picked it before it was held. */
+  if (evict && !evictor_drop(key)) {
+    filecache_unlock_object(lock_fd);
+    return (EBUSY);
+  }
+  struct stat stbuf;
+  if (fstatat(FILECACHE_AT(object_path), &stbuf, 0) == -1) {
+    /* someone else has removed it. */
+    filecache_unlock_object(lock_fd);
+    return (0);
+  }
+  int fd = -1;
+  if (evict && config.shared_cache_dir) {
+    /* an open file of another process holds it by flock(LOCK_SH). */
+    fd = openat(FILECACHE_AT(object_path), O_RDONLY);
+    if (fd != -1 && flock(fd, LOCK_EX|LOCK_NB) == -1) {
+      close(fd);
+      filecache_unlock_object(lock_fd);
+      /* keep it known as recently used. */
+      evictor_add(key, stbuf.st_size, 0);
+      return (EBUSY);
+    }
+  }
+  if (unlinkat(FILECACHE_AT(object_path), 0) == -1) {
+    int errcode = errno;
+    if (fd != -1) {
+      close(fd);
+    }
+    filecache_unlock_object(lock_fd);
+    if (errcode == ENOENT) {
+      return (0);
+    }
+    warn("failed to unlink %s.", object_path);
+    return (errcode);
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  filecache_account(-(int64_t)stbuf.st_size, -1);
+  filecache_unlock_object(lock_fd);
+
+  return (0);
+}
+
+/*
+ * start checking the cache left by the previous run in background.
+ * the valid objects are registered to the evictor, the objects with a
+ * broken record and the partial downloads of dead processes are
+ * removed, and the directories missing in the cache index are put
+ * back into it.  until a node is reached, it is checked lazily on
+ * access as usual.
+ */
+int
+filecache_start_scan(void)
+{
+  memset(&filecache_scanned, 0, sizeof(filecache_usage_t));
+  filecache_scan_discarded = filecache_scan_indexed = 0;
+  filecache_scan_started = time(NULL);
+  if (filecache_usagep) {
+    filecache_scan_published_bytes = filecache_usagep->published_bytes;
+    filecache_scan_published_files = filecache_usagep->published_files;
+  }
+
+  char root_dir[MAXPATHLEN];
+  snprintf(root_dir, sizeof(root_dir), "%s%s", filecache_cache_dir,
+	   FILECACHE_ROOT_DIR);
+  const char *roots[] = { filecache_object_dir, root_dir };
+
+  return (scanner_start(roots, sizeof(roots) / sizeof(roots[0]),
+			filecache_scan_visit, filecache_scan_report));
+}
+
+static int
+filecache_scan_visit(const char *node_path, const struct stat *statp)
+{
+  assert(node_path != NULL);
+  assert(statp != NULL);
+
+  int is_object = (filecache_at_fd(node_path) == filecache_object_fd);
+  if (S_ISDIR(statp->st_mode)) {
+    if (!is_object) {
+      filecache_scan_directory(node_path);
+    }
+  } else if (is_object) {
+    filecache_scan_object(node_path, statp);
+  }
 
   return (0);
 }
 
+static void
+filecache_scan_object(const char *object_path, const struct stat *statp)
+{
+  assert(object_path != NULL);
+  assert(statp != NULL);
+
+  const char *key = strrchr(object_path, '/') + 1;
+  size_t key_len = strlen(key);
+  if (key[0] == '.') {
+    /* the lock files and the usage file. */
+    return;
+  }
+  if (key_len > FILECACHE_OBJECT_KEY_SIZE - 1
+      && key[FILECACHE_OBJECT_KEY_SIZE - 1] == '.') {
+    /*
+     * a partial download, named key.pid.thread.  it is removed unless
+     * the process is still filling it.
+     */
+    char *endp;
+    pid_t pid = (pid_t)strtoul(key + FILECACHE_OBJECT_KEY_SIZE, &endp, 16);
+    if (*endp == '.'
+	&& (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH)) {
+      return;
+    }
+    if (unlinkat(FILECACHE_AT(object_path), 0) == 0) {
+      __sync_fetch_and_add(&filecache_scan_discarded, 1);
+    }
+    return;
+  }
+  if (key_len != FILECACHE_OBJECT_KEY_SIZE - 1) {
+    return;
+  }
+
+  /*
+   * the record must be there, and describe the cap of the name.  the
+   * cap expected for a name is unknown here.  an object of a colliding
+   * cap is found by filecache_is_filled() or filecache_is_foreign()
+   * when it is looked up for a cap.
+   */
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_load_record(object_path, &tstat) == -1) {
+    if (errno != EINVAL && errno != ENOATTR) {
+      /* evicted meanwhile, or another user's object not readable. */
+      return;
+    }
+  } else {
+    char record_key[FILECACHE_OBJECT_KEY_SIZE];
+    filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstat.ro_uri)),
+			 record_key);
+    int valid = (tstat.type == TAHOEFS_STAT_TYPE_FILENODE
+		 && strcmp(record_key, key) == 0);
+    captable_tstat_release(&tstat);
+    if (valid) {
+      evictor_add(key, statp->st_size,
+		  statp->st_atime > statp->st_mtime ? statp->st_atime
+		  : statp->st_mtime);
+      __sync_fetch_and_add(&filecache_scanned.bytes,
+			   (u_int64_t)statp->st_size);
+      __sync_fetch_and_add(&filecache_scanned.files, 1);
+      return;
+    }
+  }
+
+  DEBUGV("discarding %s with a broken record.\n", object_path);
+  if (filecache_remove_object(key, 0) == 0) {
+    __sync_fetch_and_add(&filecache_scan_discarded, 1);
+  }
+}
+
+static void
+filecache_scan_directory(const char *cached_path)
+{
+  assert(cached_path != NULL);
+
+  const char *path = filecache_cached_path_to_path(cached_path);
+  cacheindex_record_t record;
+  if (path == NULL || path[0] == '\0'
+      || cacheindex_lookup(path, &record) == 0) {
+    return;
+  }
+
+  /* lost from the index by a crash.  a broken one is rewritten lazily. */
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_load_record(cached_path, &tstat) == -1) {
+    return;
+  }
+  if (tstat.type == TAHOEFS_STAT_TYPE_DIRNODE) {
+    /* a newer one stored meanwhile is only rewritten on the next access. */
+    cacheindex_record_from_tstat(&tstat, &record);
+    cacheindex_store(path, &record);
+    __sync_fetch_and_add(&filecache_scan_indexed, 1);
+  }
+  captable_tstat_release(&tstat);
+}
+
+static void
+filecache_scan_report(size_t ndirs, size_t nfiles, int done)
+{
+  if (!done) {
+    printf("scanning the cache: %lu directories and %lu files so far.\n",
+	   (unsigned long)ndirs, (unsigned long)nfiles);
+    return;
+  }
+
+  /*
+   * correct the drift of the shared usage left by crashed processes.
+   * the scan may or may not have seen an object published by any
+   * process since it started, so those are added on top of the scan
+   * totals, and the removals meanwhile are ignored.  the usage is
+   * over-counted rather than under-counted until the next scan.  the
+   * correction is added as a delta, so that the changes made while it
+   * is computed are kept.
+   */
+  if (filecache_usagep && config.scan_threads > 0) {
+    u_int64_t bytes = filecache_usagep->bytes;
+    u_int64_t files = filecache_usagep->files;
+    __sync_synchronize();
+    u_int64_t published_bytes
+      = filecache_usagep->published_bytes - filecache_scan_published_bytes;
+    u_int64_t published_files
+      = filecache_usagep->published_files - filecache_scan_published_files;
+    __sync_fetch_and_add(&filecache_usagep->bytes,
+			 filecache_scanned.bytes + published_bytes - bytes);
+    __sync_fetch_and_add(&filecache_usagep->files,
+			 filecache_scanned.files + published_files - files);
+  }
+  evictor_scanned();
+
+  printf("scanned the cache in %lds: %llu files (%llu bytes) ready, "
+	 "%llu discarded, %llu directories reindexed.\n",
+	 (long)(time(NULL) - filecache_scan_started),
+	 (unsigned long long)filecache_scanned.files,
+	 (unsigned long long)filecache_scanned.bytes,
+	 (unsigned long long)filecache_scan_discarded,
+	 (unsigned long long)filecache_scan_indexed);
+}
+
 static int
 filecache_get_cache_stat(const char *cached_path, struct stat *statp)
 {
   assert(cached_path != NULL);
   assert(statp != NULL);
 
-  if (stat(cached_path, statp) == -1) {
+  if (fstatat(FILECACHE_AT(cached_path), statp, 0) == -1) {
     warn("failed to stat a cache file for %s.", cached_path);
     return (-1);
   }
   return (0);
 }
 
+/*
+ * cache the contents of the file specified as the remote_path
+ * parameter in the object of its cap.  the object_path parameter, if
+ * not NULL, is set to the path of the object.  the contents are
+ * downloaded to a temporary file and renamed into place, so that a
+ * partially downloaded object is never seen.
+ */
 static int
-filecache_cache_file(const char *remote_path, const char *cached_path)
+filecache_cache_file(const char *remote_path, char *object_path)
 {
-  assert(cached_path != NULL);
   assert(remote_path != NULL);
 
-  printf("caching %s to %s\n", remote_path, cached_path);
+  /* the metadata usually comes from the listing cached by getattr. */
+  char *cached_infop = NULL;
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (filecache_get_child_info(remote_path, &tstat, &cached_infop, NULL)
+      == -1) {
+    warnx("failed to get nodeinfo of the file %s.", remote_path);
+    return (-1);
+  }
+  if (tstat.type != TAHOEFS_STAT_TYPE_FILENODE || tstat.ro_uri == NULL) {
+    warnx("%s is not a file.", remote_path);
+    free(cached_infop);
+    captable_tstat_release(&tstat);
+    return (-1);
+  }
+
+  char key[FILECACHE_OBJECT_KEY_SIZE];
+  char cached_path[MAXPATHLEN];
+  filecache_object_key(cacheindex_hash(TAHOEFS_CAP(tstat.ro_uri)), key);
+  filecache_object_path(key, cached_path);
+  if (object_path) {
+    strcpy(object_path, cached_path);
+  }
 
   if (filecache_mkdir_parent(cached_path) == -1) {
     warnx("failed to create a parent directory of %s.", cached_path);
+    free(cached_infop);
+    captable_tstat_release(&tstat);
     return (-1);
   }
+  int advertise = 0;
+  int lock_fd = filecache_lock_object(cached_path);
+  if (filecache_is_filled(cached_path, &tstat)) {
+    /* another thread or process has filled it meanwhile. */
+    filecache_unlock_object(lock_fd);
+    free(cached_infop);
+  } else {
+    printf("caching %s to %s\n", remote_path, cached_path);
 
-  if (http_stub_read_file(remote_path, cached_path) == -1) {
-    warnx("failed to cache the contents of the file %s.", remote_path);
-    return (-1);
+    char temp_path[MAXPATHLEN];
+    snprintf(temp_path, sizeof(temp_path), "%s.%lx.%lx", cached_path,
+	     (unsigned long)getpid(), (unsigned long)pthread_self());
+
+    /*
+     * the contents of an immutable file are retrieved by its cap, so
+     * that they exactly match the cap stored with them even if the
+     * path is relinked meanwhile.
+     */
+    int ret;
+    if (filecache_is_immutable_file(&tstat)) {
+      ret = peer_read_cap(tstat.ro_uri, temp_path);
+      if (ret == -1) {
+	ret = http_stub_read_cap(tstat.ro_uri, temp_path);
+	advertise = (ret == 0);
+      }
+    } else {
+      ret = http_stub_read_file(remote_path, temp_path);
+    }
+    if (ret == -1) {
+      warnx("failed to cache the contents of the file %s.", remote_path);
+    } else {
+      if (cached_infop) {
+	filecache_set_info_xattr(temp_path, cached_infop,
+				 strlen(cached_infop));
+      }
+      if (filecache_set_record_xattr(temp_path, &tstat) == -1) {
+	warnx("failed to set the metadata record to %s.", temp_path);
+	ret = -1;
+      } else {
+	ret = filecache_publish(temp_path, cached_path);
+      }
+    }
+    filecache_unlock_object(lock_fd);
+    free(cached_infop);
+    if (ret == -1) {
+      captable_tstat_release(&tstat);
+      unlinkat(FILECACHE_AT(temp_path), 0);
+      return (-1);
+    }
   }
 
-  char *cached_infop = NULL;
-  size_t cached_info_size;
-  if (http_stub_get_info(remote_path, &cached_infop, &cached_info_size) == -1) {
-    warnx("failed to get nodeinfo of the file %s.", remote_path);
-    return (-1);
+  if (advertise) {
+    peer_advertise(tstat.ro_uri);
   }
-  if (filecache_set_info_xattr(cached_path, cached_infop, cached_info_size)
-      == -1) {
-    warnx("failed to set xattr of tahoefs_info attr to %s.", cached_path);
-    free(cached_infop);
-    unlink(cached_path);
-    return (-1);
+  cacheindex_record_t record;
+  cacheindex_record_from_tstat(&tstat, &record);
+  cacheindex_store(remote_path, &record);
+  captable_tstat_release(&tstat);
+
+  struct stat stbuf;
+  if (fstatat(FILECACHE_AT(cached_path), &stbuf, 0) == 0) {
+    evictor_add(key, stbuf.st_size, 0);
+  }
+  if (policy_lookup(remote_path) == POLICY_PIN) {
+    evictor_pin(key);
   }
-  free(cached_infop);
-  
+
   return (0);
 }
 
 static int
-filecache_cache_directory(const char *remote_path, const char *cached_path,
-			  char *cached_infop, int cached_info_size)
+filecache_cache_directory(const char *cached_path,
+			  const tahoefs_stat_t *tstatp, const char *infop)
 {
   assert(cached_path != NULL);
-  assert(!(remote_path == NULL && cached_infop == NULL));
+  assert(tstatp != NULL);
+
+  /* write nothing if the metadata is the same as the cached one. */
+  const char *path = filecache_cached_path_to_path(cached_path);
+  cacheindex_record_t record, cached_record;
+  cacheindex_record_from_tstat(tstatp, &record);
+  if (path
+      && cacheindex_lookup(path, &cached_record) == 0
+      && cached_record.type == TAHOEFS_STAT_TYPE_DIRNODE
+      && cached_record.fingerprint == record.fingerprint) {
+    return (0);
+  }
 
   if (filecache_mkdir_parent(cached_path) == -1) {
     warnx("failed to create a parent directory of %s.", cached_path);
     return (-1);
   }
 
-  if (mkdir(cached_path, S_IRWXU) == -1) {
+  if (mkdirat(FILECACHE_AT(cached_path), S_IRWXU) == -1) {
     if (errno != EEXIST) {
       warn("failed to create a directory %s", cached_path);
       return (-1);
     }
   }
 
-  char *infop = cached_infop;
-  int info_size = 0;
-  if (cached_infop == NULL) {
-    size_t info_size;
-    if (http_stub_get_info(remote_path, &infop, &info_size) == -1) {
-      warnx("failed to get nodeinfo of the file %s.", cached_path);
-      rmdir(cached_path);
+  if (infop) {
+    filecache_set_info_xattr(cached_path, infop, strlen(infop));
+  }
+  if (path == NULL) {
+    /* not in the index.  the record must be written right now. */
+    if (filecache_set_record_xattr(cached_path, tstatp) == -1) {
+      warnx("failed to set the metadata record to %s.", cached_path);
+      unlinkat(FILECACHE_AT(cached_path), AT_REMOVEDIR);
       return (-1);
     }
-  } else {
-    infop = cached_infop;
-    info_size = cached_info_size;
+    return (0);
   }
-
-  if (filecache_set_info_xattr(cached_path, infop, info_size) == -1) {
-    warnx("failed to set xattr of tahoefs_info attr to %s.", cached_path);
-    if (cached_infop == NULL) {
-      /* when cached_infop is not specified, we allocate infop in this
-	 function.  so free it. */
-      free(infop);
-    }
-    rmdir(cached_path);
+  if (filecache_defer_record_xattr(cached_path, tstatp) == -1) {
+    warnx("failed to set the metadata record to %s.", cached_path);
     return (-1);
   }
-
-  if (cached_infop == NULL) {
-    /* when cached_infop is not specified, we allocate infop in this
-       function.  so free it. */
-    free(infop);
-  }
+  cacheindex_store(path, &record);
 
   return (0);
 }
 
+/*
+ * remove the cache node specified as the cached_path parameter.  a
+ * directory may hold a large subtree, so the node is just moved to
+ * the trash, and the reaper deletes it and forgets its descendants in
+ * the cache index later.
+ */
 static int
 filecache_uncache_node(const char *cached_path)
 {
   assert(cached_path != NULL);
 
-  struct stat stbuf;
-  memset(&stbuf, 0, sizeof(struct stat));
-  if (stat(cached_path, &stbuf) == -1) {
-    warn("failed to get stat{} of %s.", cached_path);
-    return (-1);
+  /* forget the node first.  the cache node is useless from now. */
+  const char *path = filecache_cached_path_to_path(cached_path);
+  if (path) {
+    cacheindex_remove(path);
   }
 
-  if (stbuf.st_mode & S_IFDIR) {
-    /* is a directory. */
-    char child_path[MAXPATHLEN];
-    DIR *dirp;
-    dirp = opendir(cached_path);
-    struct dirent *dentp;
-    while ((dentp = readdir(dirp)) != NULL) {
-      if (strcmp(dentp->d_name, ".") == 0)
-	continue;
-      if (strcmp(dentp->d_name, "..") == 0)
-	continue;
-
-      child_path[0] = '\0';
-      strcat(child_path, cached_path);
-      strcat(child_path, "/");
-      strcat(child_path, dentp->d_name);
-      struct stat child_stbuf;
-      memset(&child_stbuf, 0, sizeof(struct stat));
-      if (stat(child_path, &child_stbuf) == -1) {
-	warn("failed to get stat{} of child %s.", child_path);
-	return (-1);
-      }
-      if (child_stbuf.st_mode & S_IFDIR) {
-	if (filecache_uncache_node(child_path) == -1) {
-	  warn("failed to unlink child %s recursively.", child_path);
-	  return (-1);
-	}
-      } else {
-	if (unlink(child_path) == -1) {
-	  warn("failed to unlink child %s.", child_path);
-	  return (-1);
-	}
-      }
+  if (reaper_trash(cached_path, path) == -1) {
+    if (errno == ENOENT) {
+      /* nothing is cached. */
+      return (0);
     }
-    if (rmdir(cached_path) == -1) {
-      warn("failed to rmkdir %s.", cached_path);
+    if (errno != EAGAIN) {
+      warnx("failed to move %s to the trash.", cached_path);
       return (-1);
     }
-  } else {
-    /* is a file. */
-    if (unlink(cached_path) == -1) {
-      warn("failed to unlink %s.", cached_path);
+    /* the trash is not available.  remove it in the foreground. */
+    if (reaper_remove(cached_path, path) == -1) {
+      warnx("failed to remove %s.", cached_path);
       return (-1);
     }
   }
+
+  /* the directories under the node are gone. */
+  pthread_mutex_lock(&filecache_dir_memo_lock);
+  memset(filecache_dir_memo, 0, sizeof(filecache_dir_memo));
+  pthread_mutex_unlock(&filecache_dir_memo_lock);
+
   return (0);
 }
 
+static void
+filecache_forget(const char *path)
+{
+  assert(path != NULL);
+
+  cacheindex_remove(path);
+}
+
+/*
+ * create the parent directories of the cache node specified as the
+ * cached_path parameter.  only the missing ones are created from the
+ * nearest existing ancestor down.
+ */
 static int
 filecache_mkdir_parent(const char *cached_path)
 {
   assert(cached_path != NULL);
 
-  char *parent = strdup(cached_path);
-  if (parent == NULL) {
-    warn("failed to allocate memory in duplicating string %s.", cached_path);
-    return (-1);
-  }
+  char parent[MAXPATHLEN];
+  strcpy(parent, cached_path);
   char *slash = strrchr(parent, '/');
   if (slash == NULL) {
     warnx("invalid cache_path value %s.", cached_path);
-    free(parent);
     return (-1);
   }
   *slash = '\0';
 
-  struct stat stbuf;
-  if (stat(parent, &stbuf) == -1) {
-    if (filecache_mkdir_parent(parent) == -1) {
-      warnx("failed to create a parent directory %s.", parent);
-      free(parent);
-      return (-1);
-    }
-    free(parent);
+  return (filecache_mkdirs(parent));
+}
+
+/*
+ * create the directory specified as the dir parameter under the cache
+ * directory or the object directory, and its missing ancestors.  the
+ * dir parameter is modified during the call, and restored.
+ */
+static int
+filecache_mkdirs(char *dir)
+{
+  assert(dir != NULL);
 
-    if (mkdir(parent, S_IRWXU) == -1) {
-      warn("failed to create a directory %s.", parent);
+  if (strcmp(dir, filecache_cache_dir) == 0
+      || strcmp(dir, filecache_object_dir) == 0) {
+    return (0);
+  }
+
+  u_int64_t hash = cacheindex_hash(dir);
+  u_int64_t *slotp = &filecache_dir_memo[hash % FILECACHE_DIR_MEMO_SIZE];
+  pthread_mutex_lock(&filecache_dir_memo_lock);
+  int known = (*slotp == hash);
+  pthread_mutex_unlock(&filecache_dir_memo_lock);
+  if (known) {
+    return (0);
+  }
+
+  /* the shared directories must be writable by the other users. */
+  mode_t mode = S_IRWXU;
+  if (config.shared_cache_dir && filecache_at_fd(dir) == filecache_object_fd) {
+    mode |= S_IRWXG;
+  }
+  if (mkdirat(FILECACHE_AT(dir), mode) == -1) {
+    if (errno == ENOENT) {
+      char *slash = strrchr(dir, '/');
+      if (slash == NULL) {
+	warn("failed to create a directory %s.", dir);
+	return (-1);
+      }
+      *slash = '\0';
+      int ret = filecache_mkdirs(dir);
+      *slash = '/';
+      if (ret == -1) {
+	return (-1);
+      }
+      if (mkdirat(FILECACHE_AT(dir), mode) == -1) {
+	if (errno != EEXIST) {
+	  warn("failed to create a directory %s.", dir);
+	  return (-1);
+	}
+      } else if (mode != S_IRWXU) {
+	fchmodat(FILECACHE_AT(dir), mode, 0);
+      }
+    } else if (errno != EEXIST) {
+      warn("failed to create a directory %s.", dir);
       return (-1);
     }
+  } else if (mode != S_IRWXU) {
+    /* not to be masked by the umask. */
+    fchmodat(FILECACHE_AT(dir), mode, 0);
   }
+
+  pthread_mutex_lock(&filecache_dir_memo_lock);
+  *slotp = hash;
+  pthread_mutex_unlock(&filecache_dir_memo_lock);
+
   return (0);
 }
@@ -25,15 +25,43 @@
 #ifndef _FILECACHE_H_
 #define _FILECACHE_H_
 
+#define FILECACHE_FRESHNESS_UNKNOWN	0
+#define FILECACHE_FRESHNESS_FRESH	1	/* validated within meta_ttl. */
+#define FILECACHE_FRESHNESS_STALE	2	/* older than the metadata. */
+#define FILECACHE_FRESHNESS_UNVERIFIED	3	/* not validated recently. */
+
+typedef struct filecache_residency {
+  tahoefs_stat_t tstat;
+  u_int64_t cached_size;	/* bytes of the contents cached locally. */
+  int freshness;
+} filecache_residency_t;
+
+int filecache_initialize(void);
+int filecache_terminate(void);
 int filecache_getattr(const char *, tahoefs_stat_t *);
 int filecache_get_real_size(const char *, size_t *);
-int filecache_open(const char *, int);
-int filecache_create(const char *, mode_t);
+int filecache_open(const char *, int, u_int64_t *);
+int filecache_release(const char *, int, u_int64_t);
+int filecache_create(const char *, mode_t, u_int64_t *);
 int filecache_unlink(const char *);
 int filecache_read(const char *, char *, size_t, off_t, int);
 int filecache_write(const char *, const char *, size_t, off_t, int);
 int filecache_flush(const char *, int);
+int filecache_fsync(const char *);
 int filecache_mkdir(const char *, mode_t);
 int filecache_rmdir(const char *);
+int filecache_refresh(const char *);
+int filecache_poll(const char *, poller_listing_t *);
+int filecache_readdir(const char *, void *, void *,
+		      json_stub_iterate_children_callback_t);
+int filecache_prefetch(int, const char *, int);
+int filecache_request_warmup(const char *);
+int filecache_request_prefetch(const char *);
+int filecache_request_evict(const char *);
+int filecache_get_residency(const char *, filecache_residency_t *);
+int filecache_evict(const char *);
+int filecache_start_scan(void);
+void filecache_usage(u_int64_t *, u_int64_t *);
+int filecache_open_object(const char *);
 
 #endif
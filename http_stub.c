@@ -42,19 +42,46 @@
 #define URL_GET_INFO "http://%s:%s/uri/%s%s?t=json"
 #define URL_CREATE "http://%s:%s/uri/%s%s%s"
 #define URL_READ_FILE "http://%s:%s/uri/%s%s"
+#define URL_READ_CAP "http://%s:%s/uri/%s"
 #define URL_WRITE_FILE "http://%s:%s/uri/%s%s"
 #define URL_WRITE_FILE2 "http://%s:%s/uri/%s%s%s"
 #define URL_MKDIR "http://%s:%s/uri/%s%s%s"
 #define URL_RMDIR "http://%s:%s/uri/%s%s"
+#define URL_STREAM_MANIFEST "http://%s:%s/uri/%s%s?t=stream-manifest"
+#define URL_READ_PEER "http://%s/cap/%s"
+#define URL_ADVERTISE_PEER "http://%s/have/%s?peer=%s"
+
+/*
+ * a request to another tahoefs instance.  it must fail fast if the
+ * peer is down or stalls, and a miss is not an error.  a transfer
+ * slower than HTTP_STUB_PEER_LOW_SPEED bytes per second for
+ * HTTP_STUB_PEER_LOW_SPEED_TIME is given up.
+ */
+#define HTTP_STUB_PEER 0x01
+#define HTTP_STUB_PEER_CONNECT_TIMEOUT 1	/* in seconds. */
+#define HTTP_STUB_PEER_LOW_SPEED 1024
+#define HTTP_STUB_PEER_LOW_SPEED_TIME 3		/* in seconds. */
+#define HTTP_STUB_PEER_MAX_REDIRS 1
+
+/*
+ * a failed request leaves ENOENT in errno only if the gateway says
+ * the node doesn't exist.  anything else, like a refused connection
+ * or a 5xx of the gateway which can't reach the grid, is EIO, and the
+ * caller must not take it as a removal.
+ */
+#define HTTP_STUB_ERRNO(response_code)				\
+  ((response_code) == 404 ? ENOENT : EIO)
 
 typedef struct http_stub_writefunc_baton {
   u_int8_t *datap;
   size_t size;
 } http_stub_writefunc_baton_t;
 
-static int http_stub_get_to_memory(const char *, http_stub_writefunc_baton_t *);
+static int http_stub_get_to_memory(const char *, http_stub_writefunc_baton_t *,
+				   int, const char *);
 static size_t http_stub_writefunc_callback(void *, size_t, size_t, void *);
-static int http_stub_get_to_file(const char *, const char *);
+static int http_stub_get_to_file(const char *, const char *, int);
+static void http_stub_set_peer_options(CURL *);
 static size_t http_stub_get_to_file_callback(void *, size_t, size_t, void *);
 static int http_stub_put(const char *, http_stub_writefunc_baton_t *);
 static int http_stub_delete(const char *);
@@ -62,6 +89,24 @@ static int http_stub_put_from_file(const char *, const char *,
 				   http_stub_writefunc_baton_t *);
 static size_t http_stub_put_from_file_callback(void *, size_t, size_t, void *);
 static int http_stub_post_from_file(const char *, const char *);
+static int http_stub_stream(const char *, int, http_stub_chunk_callback_t,
+			    void *);
+static size_t http_stub_stream_callback(void *, size_t, size_t, void *);
+static int http_stub_stream_lines(const char *, size_t, void *);
+
+typedef struct http_stub_stream_baton {
+  CURL *curl_handle;
+  long response_code;	/* 0 until the first chunk arrives. */
+  http_stub_chunk_callback_t callback;
+  void *callback_batonp;
+} http_stub_stream_baton_t;
+
+typedef struct http_stub_lines_baton {
+  char *linep;		/* an incomplete line received so far. */
+  size_t size;
+  http_stub_line_callback_t callback;
+  void *callback_batonp;
+} http_stub_lines_baton_t;
 
 int
 http_stub_initialize(void)
@@ -107,10 +152,12 @@ http_stub_get_info(const char *path, char **infopp, size_t *info_sizep)
   http_stub_writefunc_baton_t response;
   response.datap = malloc(1);
   response.size = 0;
-  if (http_stub_get_to_memory(tahoe_url, &response) == -1) {
+  if (http_stub_get_to_memory(tahoe_url, &response, 0, NULL) == -1) {
+    int errcode = errno;
     warnx("failed to get contents from %s.", tahoe_url);
     if (response.datap)
       free(response.datap);
+    errno = errcode;
     return (-1);
   }
   *infopp = (char *)response.datap;
@@ -119,13 +166,224 @@ http_stub_get_info(const char *path, char **infopp, size_t *info_sizep)
   return (0);
 }
 
+/*
+ * issue a HTTP GET request to get filenode or dirnode information
+ * like http_stub_get_info(), but without buffering the response.  the
+ * callback is called with each chunk of the response body as soon as
+ * it arrives, so that the caller can parse it while the rest is still
+ * being transferred.  if the callback returns -1, the request is
+ * aborted.
+ */
+int
+http_stub_stream_info(const char *path, http_stub_chunk_callback_t callback,
+		      void *batonp)
+{
+  assert(path != NULL);
+  assert(callback != NULL);
+
+  char tahoe_url[MAXPATHLEN];
+  tahoe_url[0] = '\0';
+  snprintf(tahoe_url, sizeof(tahoe_url), URL_GET_INFO, config.webapi_server,
+	   config.webapi_port, config.root_cap, path);
+
+  return (http_stub_stream(tahoe_url, 0, callback, batonp));
+}
+
+/*
+ * issue a HTTP POST request to get the manifest of the subtree at the
+ * location specified as the path parameter.  the manifest is streamed
+ * and the callback is called with each line of it (a JSON object per
+ * node) as soon as it arrives, so that the whole manifest of a large
+ * tree is never held in memory.  if the callback returns -1, the
+ * request is aborted.
+ */
+int
+http_stub_stream_manifest(const char *path, http_stub_line_callback_t callback,
+			  void *batonp)
+{
+  assert(path != NULL);
+  assert(callback != NULL);
+
+  char tahoe_url[MAXPATHLEN];
+  tahoe_url[0] = '\0';
+  snprintf(tahoe_url, sizeof(tahoe_url), URL_STREAM_MANIFEST,
+	   config.webapi_server, config.webapi_port, config.root_cap, path);
+
+  http_stub_lines_baton_t lines;
+  lines.linep = NULL;
+  lines.size = 0;
+  lines.callback = callback;
+  lines.callback_batonp = batonp;
+
+  int ret = http_stub_stream(tahoe_url, 1, http_stub_stream_lines, &lines);
+  free(lines.linep);
+
+  return (ret);
+}
+
+/*
+ * the chunk callback used by the http_stub_stream_manifest()
+ * function.  the received data is split into lines, and each complete
+ * line is passed to the callback of the caller.  a partial line is
+ * kept until the rest of it arrives.
+ */
+static int
+http_stub_stream_lines(const char *datap, size_t size, void *batonp)
+{
+  assert(datap != NULL);
+  assert(batonp != NULL);
+
+  http_stub_lines_baton_t *linesp = (http_stub_lines_baton_t *)batonp;
+  char *linep = realloc(linesp->linep, linesp->size + size + 1);
+  if (linep == NULL) {
+    warnx("failed to reallocate memory for HTTP response.");
+    return (-1);
+  }
+  linesp->linep = linep;
+  memcpy(&linep[linesp->size], datap, size);
+  linesp->size += size;
+  linep[linesp->size] = '\0';
+
+  char *startp = linep;
+  char *newlinep;
+  while ((newlinep = memchr(startp, '\n', linesp->size - (startp - linep)))
+	 != NULL) {
+    *newlinep = '\0';
+    if (newlinep > startp
+	&& linesp->callback(startp, linesp->callback_batonp) == -1)
+      return (-1);
+    startp = newlinep + 1;
+  }
+  linesp->size -= startp - linep;
+  memmove(linep, startp, linesp->size + 1);
+
+  return (0);
+}
+
+/*
+ * call CURL functions to get the contents of the url specified as the
+ * url parameter, and pass the response body to the callback chunk by
+ * chunk.  if the post parameter is non-zero, an empty POST request is
+ * issued instead of GET.  a response other than 200 is detected
+ * before the first chunk is passed, so the callback never sees an
+ * error page.
+ */
+static int
+http_stub_stream(const char *url, int post,
+		 http_stub_chunk_callback_t callback, void *batonp)
+{
+  assert(url != NULL);
+  assert(callback != NULL);
+
+  CURL *curl_handle;
+  if ((curl_handle = curl_easy_init()) == NULL) {
+    warnx("failed to initialize the CURL easy interface.");
+    return (-1);
+  }
+
+  http_stub_stream_baton_t stream;
+  stream.curl_handle = curl_handle;
+  stream.response_code = 0;
+  stream.callback = callback;
+  stream.callback_batonp = batonp;
+
+  CURLcode ret;
+  ret = curl_easy_setopt(curl_handle, CURLOPT_URL, url);
+  if (ret != CURLE_OK) {
+    warnx("failed to set URL %s. (CURL: %s)", url, curl_easy_strerror(ret));
+    curl_easy_cleanup(curl_handle);
+    return (-1);
+  }
+  if (post) {
+    ret = curl_easy_setopt(curl_handle, CURLOPT_POSTFIELDS, "");
+    if (ret != CURLE_OK) {
+      warnx("failed to specify POST parameters (CURL: %s)",
+	    curl_easy_strerror(ret));
+      curl_easy_cleanup(curl_handle);
+      return (-1);
+    }
+  }
+  ret = curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION,
+			 http_stub_stream_callback);
+  if (ret != CURLE_OK) {
+    warnx("failed to set write function for stream. (CURL: %s)",
+	  curl_easy_strerror(ret));
+    curl_easy_cleanup(curl_handle);
+    return (-1);
+  }
+  ret = curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&stream);
+  if (ret != CURLE_OK) {
+    warnx("failed to set callback baton for stream. (CURL: %s)",
+	  curl_easy_strerror(ret));
+    curl_easy_cleanup(curl_handle);
+    return (-1);
+  }
+  ret = curl_easy_perform(curl_handle);
+  if (ret != CURLE_OK && stream.response_code == 0) {
+    warnx("failed to perform CURL operation for %s. (CURL: %s)",
+	  url, curl_easy_strerror(ret));
+    curl_easy_cleanup(curl_handle);
+    errno = EIO;
+    return (-1);
+  }
+  if (stream.response_code == 0)
+    curl_easy_getinfo(curl_handle, CURLINFO_RESPONSE_CODE,
+		      &stream.response_code);
+  curl_easy_cleanup(curl_handle);
+
+  if (stream.response_code != 200) {
+    warnx("received HTTP error response %ld.", stream.response_code);
+    errno = HTTP_STUB_ERRNO(stream.response_code);
+    return (-1);
+  }
+  if (ret != CURLE_OK) {
+    warnx("failed to receive the response from %s. (CURL: %s)",
+	  url, curl_easy_strerror(ret));
+    errno = EIO;
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * the write callback function of the http_stub_stream() function.
+ * the response code is checked once when the first chunk arrives.
+ */
+static size_t
+http_stub_stream_callback(void *newdatap, size_t size, size_t nmemb,
+			  void *batonp)
+{
+  assert(newdatap != NULL);
+  assert(batonp != NULL);
+
+  size_t real_size = size * nmemb;
+  http_stub_stream_baton_t *streamp = (http_stub_stream_baton_t *)batonp;
+
+  if (streamp->response_code == 0) {
+    curl_easy_getinfo(streamp->curl_handle, CURLINFO_RESPONSE_CODE,
+		      &streamp->response_code);
+    if (streamp->response_code != 200) {
+      /* returning a short count aborts the transfer. */
+      return (0);
+    }
+  }
+
+  if (streamp->callback(newdatap, real_size, streamp->callback_batonp) == -1)
+    return (0);
+
+  return (real_size);
+}
+
 /*
  * call CURL functions to get the contents of the url specified as the
  * url parameter.  the response will be stored in the memory space
- * specified by the responsep->datap parameter.
+ * specified by the responsep->datap parameter.  if the range parameter
+ * ("first-last") is given, only the range is requested.
  */
 static int
-http_stub_get_to_memory(const char *url, http_stub_writefunc_baton_t *responsep)
+http_stub_get_to_memory(const char *url, http_stub_writefunc_baton_t *responsep,
+			int flags, const char *range)
 {
   assert(url != NULL);
   assert(responsep != NULL);
@@ -162,11 +420,20 @@ http_stub_get_to_memory(const char *url, http_stub_writefunc_baton_t *responsep)
     curl_easy_cleanup(curl_handle);
     return (-1);
   }
+  if (flags & HTTP_STUB_PEER) {
+    http_stub_set_peer_options(curl_handle);
+  }
+  if (range) {
+    curl_easy_setopt(curl_handle, CURLOPT_RANGE, range);
+  }
   ret = curl_easy_perform(curl_handle);
   if (ret != CURLE_OK) {
-    warnx("failed to perform CURL operation for %s. (CURL: %s)",
-	  url, curl_easy_strerror(ret));
+    if (!(flags & HTTP_STUB_PEER)) {
+      warnx("failed to perform CURL operation for %s. (CURL: %s)",
+	    url, curl_easy_strerror(ret));
+    }
     curl_easy_cleanup(curl_handle);
+    errno = EIO;
     return (-1);
   }
 
@@ -183,9 +450,12 @@ http_stub_get_to_memory(const char *url, http_stub_writefunc_baton_t *responsep)
   curl_easy_cleanup(curl_handle);
 
   /* check HTTP response code. */
-  if (response_code != 200) {
+  if (response_code != 200 && !(range && response_code == 206)) {
     /* treat all the response codes other than 200 as no existent entry. */
-    warnx("received HTTP error response %ld.", response_code);
+    if (!(flags & HTTP_STUB_PEER)) {
+      warnx("received HTTP error response %ld.", response_code);
+    }
+    errno = HTTP_STUB_ERRNO(response_code);
     return (-1);
   }
   if (responsep->datap == NULL) {
@@ -272,8 +542,10 @@ http_stub_read_file(const char *path, const char *local_path)
   snprintf(tahoe_url, sizeof(tahoe_url), URL_READ_FILE, config.webapi_server,
 	   config.webapi_port, config.root_cap, path);
 
-  if (http_stub_get_to_file(tahoe_url, local_path) == -1) {
+  if (http_stub_get_to_file(tahoe_url, local_path, 0) == -1) {
+    int errcode = errno;
     warnx("failed to get contents from %s.", tahoe_url);
+    errno = errcode;
     return (-1);
   }
 
@@ -281,13 +553,91 @@ http_stub_read_file(const char *path, const char *local_path)
   
 }
 
+/*
+ * issue a HTTP GET request to get the content of a filenode specified
+ * by its cap, instead of the path from the root_cap.  the gateway
+ * doesn't have to traverse directories to find the node.  the
+ * received content will be saved at the local_path of the local
+ * filesystem.
+ */
+int
+http_stub_read_cap(const char *cap, const char *local_path)
+{
+  assert(cap != NULL);
+  assert(local_path != NULL);
+
+  char tahoe_url[MAXPATHLEN];
+  tahoe_url[0] = '\0';
+  snprintf(tahoe_url, sizeof(tahoe_url), URL_READ_CAP, config.webapi_server,
+	   config.webapi_port, cap);
+
+  if (http_stub_get_to_file(tahoe_url, local_path, 0) == -1) {
+    int errcode = errno;
+    warnx("failed to get contents from %s.", tahoe_url);
+    errno = errcode;
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * read the size bytes at the offset of the immutable file of the cap
+ * through the gateway into the buffer.  returns the number of bytes
+ * read, or -1.
+ */
+ssize_t
+http_stub_read_cap_range(const char *cap, off_t offset, size_t size,
+			 char *buf)
+{
+  assert(cap != NULL);
+  assert(buf != NULL);
+
+  char tahoe_url[MAXPATHLEN];
+  tahoe_url[0] = '\0';
+  snprintf(tahoe_url, sizeof(tahoe_url), URL_READ_CAP, config.webapi_server,
+	   config.webapi_port, cap);
+  char range[64];
+  snprintf(range, sizeof(range), "%lld-%lld", (long long)offset,
+	   (long long)(offset + size - 1));
+
+  http_stub_writefunc_baton_t response;
+  response.datap = malloc(1);
+  response.size = 0;
+  if (response.datap == NULL) {
+    warn("failed to allocate memory for HTTP response.");
+    return (-1);
+  }
+  if (http_stub_get_to_memory(tahoe_url, &response, 0, range) == -1) {
+    int errcode = errno;
+    warnx("failed to get a range of %s.", tahoe_url);
+    free(response.datap);
+    errno = errcode;
+    return (-1);
+  }
+  if (response.size > size) {
+    /* the gateway has ignored the range. */
+    if (response.size < (size_t)offset + size) {
+      free(response.datap);
+      errno = EIO;
+      return (-1);
+    }
+    memmove(response.datap, response.datap + offset, size);
+    response.size = size;
+  }
+  memcpy(buf, response.datap, response.size);
+  free(response.datap);
+
+  return (response.size);
+}
+
 /*
  * call CURL functions to get the contents of the url specified as the
  * url parameter.  the response will be stored at the path specified
  * by the local_path parameter.
  */
 static int
-http_stub_get_to_file(const char *url, const char *local_path)
+http_stub_get_to_file(const char *url, const char *local_path, int flags)
 {
   assert(url != NULL);
   assert(local_path != NULL);
@@ -328,12 +678,18 @@ http_stub_get_to_file(const char *url, const char *local_path)
     curl_easy_cleanup(curl_handle);
     return (-1);
   }
+  if (flags & HTTP_STUB_PEER) {
+    http_stub_set_peer_options(curl_handle);
+  }
   ret = curl_easy_perform(curl_handle);
   if (ret != CURLE_OK) {
-    warnx("failed to perform CURL operation for %s. (CURL: %s)",
-	  url, curl_easy_strerror(ret));
+    if (!(flags & HTTP_STUB_PEER)) {
+      warnx("failed to perform CURL operation for %s. (CURL: %s)",
+	    url, curl_easy_strerror(ret));
+    }
     fclose(fp);
     curl_easy_cleanup(curl_handle);
+    errno = EIO;
     return (-1);
   }
 
@@ -346,15 +702,80 @@ http_stub_get_to_file(const char *url, const char *local_path)
   /* check HTTP response code. */
   if (response_code != 200) {
     /* treat all the response codes other than 200 as an error. */
-    warnx("received HTTP error response %ld.", response_code);
+    if (!(flags & HTTP_STUB_PEER)) {
+      warnx("received HTTP error response %ld.", response_code);
+    }
     /* remove an incomplete file. */
     unlink(local_path);
+    errno = HTTP_STUB_ERRNO(response_code);
     return (-1);
   }
 
   return(0);
 }
 
+/*
+ * issue a HTTP GET request to another tahoefs instance specified as
+ * the peer parameter (host:port) for the contents of the immutable
+ * file of the cap.  the peer may redirect the request to the peer
+ * which has the contents.  a miss is not reported.
+ */
+int
+http_stub_read_peer(const char *peer, const char *cap, const char *local_path)
+{
+  assert(peer != NULL);
+  assert(cap != NULL);
+  assert(local_path != NULL);
+
+  char peer_url[MAXPATHLEN];
+  peer_url[0] = '\0';
+  snprintf(peer_url, sizeof(peer_url), URL_READ_PEER, peer, cap);
+
+  return (http_stub_get_to_file(peer_url, local_path, HTTP_STUB_PEER));
+}
+
+/*
+ * tell the peer specified as the peer parameter that the peer self
+ * has the contents of the cap.
+ */
+int
+http_stub_advertise_peer(const char *peer, const char *cap, const char *self)
+{
+  assert(peer != NULL);
+  assert(cap != NULL);
+  assert(self != NULL);
+
+  char peer_url[MAXPATHLEN];
+  peer_url[0] = '\0';
+  snprintf(peer_url, sizeof(peer_url), URL_ADVERTISE_PEER, peer, cap, self);
+
+  http_stub_writefunc_baton_t response;
+  response.datap = malloc(1);
+  response.size = 0;
+  int ret = http_stub_get_to_memory(peer_url, &response, HTTP_STUB_PEER,
+				    NULL);
+  free(response.datap);
+
+  return (ret);
+}
+
+static void
+http_stub_set_peer_options(CURL *curl_handle)
+{
+  assert(curl_handle != NULL);
+
+  curl_easy_setopt(curl_handle, CURLOPT_CONNECTTIMEOUT,
+		   (long)HTTP_STUB_PEER_CONNECT_TIMEOUT);
+  curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_LIMIT,
+		   (long)HTTP_STUB_PEER_LOW_SPEED);
+  curl_easy_setopt(curl_handle, CURLOPT_LOW_SPEED_TIME,
+		   (long)HTTP_STUB_PEER_LOW_SPEED_TIME);
+  curl_easy_setopt(curl_handle, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl_handle, CURLOPT_MAXREDIRS,
+		   (long)HTTP_STUB_PEER_MAX_REDIRS);
+  curl_easy_setopt(curl_handle, CURLOPT_NOSIGNAL, 1L);
+}
+
 /*
  * the callback function of the http_stub_get_to_file() function.
  * every time the CURL library receives a part of the response
@@ -25,11 +25,20 @@
 #ifndef _HTTP_STUB_H_
 #define _HTTP_STUB_H_
 
+typedef int (*http_stub_line_callback_t)(const char *, void *);
+typedef int (*http_stub_chunk_callback_t)(const char *, size_t, void *);
+
 int http_stub_initialize(void);
 int http_stub_terminate(void);
 int http_stub_get_info(const char *, char **, size_t *);
+int http_stub_stream_info(const char *, http_stub_chunk_callback_t, void *);
 int http_stub_create(const char *, const char *, int);
 int http_stub_read_file(const char *, const char *);
+int http_stub_read_cap(const char *, const char *);
+ssize_t http_stub_read_cap_range(const char *, off_t, size_t, char *);
+int http_stub_read_peer(const char *, const char *, const char *);
+int http_stub_advertise_peer(const char *, const char *, const char *);
+int http_stub_stream_manifest(const char *, http_stub_line_callback_t, void *);
 int http_stub_flush(const char *, const char *);
 int http_stub_mkdir(const char *, int);
 int http_stub_unlink_rmdir(const char *);
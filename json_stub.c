@@ -26,18 +26,74 @@
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <assert.h>
 #include <err.h>
 #include <sys/time.h>
 
 #include <json.h>
-#include <json_object_private.h>
 
 #include "tahoefs.h"
 #include "json_stub.h"
+#include "captable.h"
 
-static int json_stub_json_to_tstat(struct json_object *, tahoefs_stat_t *);
-static int json_stub_get_nodetype(struct json_object *);
+/*
+ * the state of an incremental scan of a dirnode JSON.  the members of
+ * the "children" object are cut out one by one and parsed as soon as
+ * each of them is complete.  everything else (the information of the
+ * directory itself) is kept as the skeleton, in which "children" is
+ * left empty.
+ */
+struct json_stub_stream {
+  int depth;		/* the nesting level of arrays and objects. */
+  int in_string;
+  int escaped;
+  int in_children;	/* inside the "children" object. */
+  int in_member;	/* inside a member of the "children" object. */
+  char last_key[8];	/* the head of the last string at depth 2. */
+  size_t last_key_len;
+  char *skeleton;
+  size_t skeleton_len;
+  size_t skeleton_size;
+  char *member;		/* the current member of "children". */
+  size_t member_len;
+  size_t member_size;
+  void *buf;
+  json_stub_iterate_children_callback_t callback;
+};
+
+/*
+ * a cursor of the purpose-built parser of the tahoe node JSON
+ * (["dirnode"|"filenode", {...}]).  it fills tahoefs_stat_t{} in a
+ * single pass over the text without building a tree or allocating
+ * memory, except for interning new caps.  the text must be NUL
+ * terminated at endp.
+ */
+typedef struct json_stub_scanner {
+  const char *p;
+  const char *endp;
+} json_stub_scanner_t;
+
+#define JSON_STUB_KEY_MAX 32
+#define JSON_STUB_URI_MAX 1024
+#define JSON_STUB_NAME_MAX 1024
+
+static int json_stub_scan_node(json_stub_scanner_t *, tahoefs_stat_t *);
+static int json_stub_scan_metadata(json_stub_scanner_t *, tahoefs_stat_t *);
+static int json_stub_scan_string(json_stub_scanner_t *, const char **,
+				 size_t *, char *, size_t);
+static int json_stub_scan_number(json_stub_scanner_t *, double *,
+				 u_int64_t *);
+static int json_stub_hex4(const char *, unsigned int *);
+static int json_stub_key_is(const char *, size_t, const char *);
+static int json_stub_skip_value(json_stub_scanner_t *);
+static int json_stub_expect(json_stub_scanner_t *, char);
+static void json_stub_skip_space(json_stub_scanner_t *);
+static int json_stub_stream_putc(json_stub_stream_t *, char);
+static int json_stub_stream_append(char **, size_t *, size_t *, const char *,
+				   size_t);
+static int json_stub_stream_write(json_stub_stream_t *, const char *, size_t);
+static int json_stub_stream_emit(json_stub_stream_t *);
 
 int
 json_stub_jsonstring_to_tstat(const char *jsons, tahoefs_stat_t *tstatp)
@@ -45,266 +101,802 @@ json_stub_jsonstring_to_tstat(const char *jsons, tahoefs_stat_t *tstatp)
   assert(jsons != NULL);
   assert(tstatp != NULL);
 
-  /* parse the node information. */
-  struct json_object *jnodeinfop;
-  jnodeinfop = json_tokener_parse(jsons);
-  if (jnodeinfop == NULL) {
-    warnx("failed to parse the node information in JSON format.");
-    return (-1);
-  }
-
-  if (json_stub_json_to_tstat(jnodeinfop, tstatp) == -1) {
+  json_stub_scanner_t scanner;
+  scanner.p = jsons;
+  scanner.endp = jsons + strlen(jsons);
+  if (json_stub_scan_node(&scanner, tstatp) == -1) {
     warnx("failed to convert JSON data to tahoefs_stat_t{}.");
-    json_object_put(jnodeinfop);
     return (-1);
   }
 
-  json_object_put(jnodeinfop);
-
   return (0);
 }
 
+/*
+ * parse a node JSON and fill the tstatp parameter.  "mutable",
+ * "ro_uri" and "verify_uri" are required.  the caps are interned only
+ * after all the checks passed.
+ */
 static int
-json_stub_json_to_tstat(struct json_object *jsonp, tahoefs_stat_t *tstatp)
+json_stub_scan_node(json_stub_scanner_t *sp, tahoefs_stat_t *tstatp)
 {
-  assert(jsonp != NULL);
+  assert(sp != NULL);
   assert(tstatp != NULL);
 
-  /* the first entry of jsonp always specifies nodetype. */
-  struct json_object *jnodetypep;
-  jnodetypep = json_object_array_get_idx(jsonp, 0);
-  if (jnodetypep == NULL) {
+  const char *strp;
+  size_t len;
+  if (json_stub_expect(sp, '[') == -1
+      || json_stub_scan_string(sp, &strp, &len, NULL, 0) == -1) {
     warnx("node type information is missing.");
     return (-1);
   }
-  const char *nodetype;
-  nodetype = json_object_get_string(jnodetypep);
-  if (nodetype == NULL) {
-    warnx("failed to convert JSON nodetype string to C string.");
-    return (-1);
-  }
-  if (strcmp(nodetype, "dirnode") == 0) {
+  if (len == 7 && memcmp(strp, "dirnode", 7) == 0) {
     tstatp->type = TAHOEFS_STAT_TYPE_DIRNODE;
-  } else if (strcmp(nodetype, "filenode") == 0) {
+  } else if (len == 8 && memcmp(strp, "filenode", 8) == 0) {
     tstatp->type = TAHOEFS_STAT_TYPE_FILENODE;
   } else {
-    warnx("unknown nodetype (%s).", nodetype); 
+    warnx("unknown nodetype (%.*s).", (int)len, strp);
     return (-1);
   }
-
-  /* the second entry of jsonp contains node specific data. */
-  struct json_object *jnodeinfop;
-  jnodeinfop = json_object_array_get_idx(jsonp, 1);
-  if (jnodeinfop == NULL) {
+  if (json_stub_expect(sp, ',') == -1 || json_stub_expect(sp, '{') == -1) {
     warnx("node information is missing.");
     return (-1);
   }
 
-  /* "metadata" and "metadata":{"tahoe"} exist only in a file node. */
-  struct json_object *jmetap = NULL;
-  struct json_object *jmeta_tahoep = NULL;
-  jmetap = json_object_object_get(jnodeinfop, "metadata");
-  if (jmetap) {
-    jmeta_tahoep = json_object_object_get(jmetap, "tahoe");
-  }
+  /* no "size" entry means a directory. */
+  tstatp->size = 0;
 
-  /* "size" key. */
-  struct json_object *jsizep;
-  jsizep = json_object_object_get(jnodeinfop, "size");
-  if (jsizep) {
-    tstatp->size = json_object_get_int(jsizep);
+  int mutable = -1;
+  const char *ro_urip = NULL, *rw_urip = NULL, *verify_urip = NULL;
+  size_t ro_uri_len = 0, rw_uri_len = 0, verify_uri_len = 0;
+  char ro_uri[JSON_STUB_URI_MAX], rw_uri[JSON_STUB_URI_MAX];
+  char verify_uri[JSON_STUB_URI_MAX];
+
+  json_stub_skip_space(sp);
+  if (*sp->p == '}') {
+    sp->p++;
   } else {
-    /* no "size" entry.  maybe this node is a directory. */
-    tstatp->size = 0;
+    for (;;) {
+      char key[JSON_STUB_KEY_MAX];
+      const char *keyp;
+      size_t key_len;
+      if (json_stub_scan_string(sp, &keyp, &key_len, key, sizeof(key)) == -1
+	  || json_stub_expect(sp, ':') == -1) {
+	return (-1);
+      }
+      json_stub_skip_space(sp);
+
+      int ret;
+      if (json_stub_key_is(keyp, key_len, "size") && *sp->p != 'n') {
+	ret = json_stub_scan_number(sp, NULL, &tstatp->size);
+      } else if (json_stub_key_is(keyp, key_len, "mutable")
+		 && (*sp->p == 't' || *sp->p == 'f')) {
+	mutable = (*sp->p == 't');
+	ret = json_stub_skip_value(sp);
+      } else if (json_stub_key_is(keyp, key_len, "ro_uri") && *sp->p == '"') {
+	ret = json_stub_scan_string(sp, &ro_urip, &ro_uri_len,
+				    ro_uri, sizeof(ro_uri));
+      } else if (json_stub_key_is(keyp, key_len, "rw_uri") && *sp->p == '"') {
+	ret = json_stub_scan_string(sp, &rw_urip, &rw_uri_len,
+				    rw_uri, sizeof(rw_uri));
+      } else if (json_stub_key_is(keyp, key_len, "verify_uri")
+		 && *sp->p == '"') {
+	ret = json_stub_scan_string(sp, &verify_urip, &verify_uri_len,
+				    verify_uri, sizeof(verify_uri));
+      } else if (json_stub_key_is(keyp, key_len, "metadata")
+		 && *sp->p == '{') {
+	ret = json_stub_scan_metadata(sp, tstatp);
+      } else {
+	ret = json_stub_skip_value(sp);
+      }
+      if (ret == -1) {
+	return (-1);
+      }
+
+      json_stub_skip_space(sp);
+      if (*sp->p == ',') {
+	sp->p++;
+	continue;
+      }
+      if (json_stub_expect(sp, '}') == -1) {
+	return (-1);
+      }
+      break;
+    }
+  }
+  if (json_stub_expect(sp, ']') == -1) {
+    return (-1);
   }
 
-  /* "mutable" key. */
-  struct json_object *jmutablep;
-  jmutablep = json_object_object_get(jnodeinfop, "mutable");
-  if (jmutablep == NULL) {
+  if (mutable == -1) {
     warnx("no mutable key exist.");
     return (-1);
   }
-  tstatp->mutable = json_object_get_boolean(jmutablep);
-
-  /* uri keys. */
-  struct json_object *jurip;
-  jurip = json_object_object_get(jnodeinfop, "ro_uri");
-  if (jurip == NULL) {
+  if (ro_urip == NULL) {
     warnx("no ro_uri key exist.");
     return (-1);
   }
-  strncpy(tstatp->ro_uri, json_object_get_string(jurip),
-	  TAHOEFS_CAPABILITY_SIZE);
-
-  jurip = json_object_object_get(jnodeinfop, "verify_uri");
-  if (jurip == NULL) {
+  if (verify_urip == NULL) {
     warnx("no verify_uri key exist.");
     return (-1);
   }
-  strncpy(tstatp->verify_uri, json_object_get_string(jurip),
-	  TAHOEFS_CAPABILITY_SIZE);
+  tstatp->mutable = mutable;
+  tstatp->ro_uri = captable_intern_n(ro_urip, ro_uri_len);
+  tstatp->verify_uri = captable_intern_n(verify_urip, verify_uri_len);
+  if (rw_urip) {
+    tstatp->rw_uri = captable_intern_n(rw_urip, rw_uri_len);
+  }
+
+  return (0);
+}
+
+/*
+ * parse the "metadata" object of a node and take the link times from
+ * "metadata":{"tahoe"} in it.
+ */
+static int
+json_stub_scan_metadata(json_stub_scanner_t *sp, tahoefs_stat_t *tstatp)
+{
+  assert(sp != NULL);
+  assert(tstatp != NULL);
 
-  jurip = json_object_object_get(jnodeinfop, "rw_uri");
-  if (jurip) {
-    strncpy(tstatp->rw_uri, json_object_get_string(jurip),
-	    TAHOEFS_CAPABILITY_SIZE);
+  if (json_stub_expect(sp, '{') == -1) {
+    return (-1);
+  }
+  json_stub_skip_space(sp);
+  if (*sp->p == '}') {
+    sp->p++;
+    return (0);
   }
 
-  /* "linkcrtime" and "linkmotime" keys. */
-  if (jmeta_tahoep) {
-    struct json_object *jtimep;
-    jtimep = json_object_object_get(jmeta_tahoep, "linkcrtime");
-    tstatp->link_creation_time = json_object_get_double(jtimep);
+  int in_tahoe = 0;
+  for (;;) {
+    char key[JSON_STUB_KEY_MAX];
+    const char *keyp;
+    size_t key_len;
+    if (json_stub_scan_string(sp, &keyp, &key_len, key, sizeof(key)) == -1
+	|| json_stub_expect(sp, ':') == -1) {
+      return (-1);
+    }
+    json_stub_skip_space(sp);
+
+    int ret;
+    if (!in_tahoe && json_stub_key_is(keyp, key_len, "tahoe")
+	&& *sp->p == '{') {
+      /* descend into "tahoe". */
+      sp->p++;
+      json_stub_skip_space(sp);
+      if (*sp->p != '}') {
+	in_tahoe = 1;
+	continue;
+      }
+      sp->p++;
+      ret = 0;
+    } else if (in_tahoe && json_stub_key_is(keyp, key_len, "linkcrtime")
+	       && *sp->p != 'n') {
+      ret = json_stub_scan_number(sp, &tstatp->link_creation_time, NULL);
+    } else if (in_tahoe && json_stub_key_is(keyp, key_len, "linkmotime")
+	       && *sp->p != 'n') {
+      ret = json_stub_scan_number(sp, &tstatp->link_modification_time, NULL);
+    } else {
+      ret = json_stub_skip_value(sp);
+    }
+    if (ret == -1) {
+      return (-1);
+    }
 
-    jtimep = json_object_object_get(jmeta_tahoep, "linkmotime");
-    tstatp->link_modification_time = json_object_get_double(jtimep);
+    json_stub_skip_space(sp);
+    if (*sp->p == ',') {
+      sp->p++;
+      continue;
+    }
+    if (json_stub_expect(sp, '}') == -1) {
+      return (-1);
+    }
+    if (!in_tahoe) {
+      return (0);
+    }
+    /* the end of "tahoe".  go back to "metadata". */
+    in_tahoe = 0;
+    json_stub_skip_space(sp);
+    if (*sp->p == ',') {
+      sp->p++;
+      continue;
+    }
+    return (json_stub_expect(sp, '}'));
   }
+}
+
+/*
+ * parse a string.  strpp and lenp are set to the contents.  they point
+ * into the text itself unless the string has escapes, in which case
+ * it is decoded into the buf parameter.  if buf is NULL or too small
+ * for the decoded string, it fails.
+ *
+ * the closing quote is looked up with memchr(), which scans many
+ * bytes at a time with the vector instructions of the platform.
+ */
+static int
+json_stub_scan_string(json_stub_scanner_t *sp, const char **strpp,
+		      size_t *lenp, char *buf, size_t buf_size)
+{
+  assert(sp != NULL);
+
+  if (json_stub_expect(sp, '"') == -1) {
+    return (-1);
+  }
+  const char *startp = sp->p;
+  const char *quotep = startp;
+  for (;;) {
+    quotep = memchr(quotep, '"', sp->endp - quotep);
+    if (quotep == NULL) {
+      warnx("unterminated string in JSON.");
+      return (-1);
+    }
+    /* the quote is escaped if an odd number of backslashes precede. */
+    const char *bsp = quotep;
+    while (bsp > startp && *(bsp - 1) == '\\') {
+      bsp--;
+    }
+    if ((quotep - bsp) % 2 == 0) {
+      break;
+    }
+    quotep++;
+  }
+  sp->p = quotep + 1;
+
+  if (memchr(startp, '\\', quotep - startp) == NULL) {
+    /* the common case.  no copy is needed. */
+    if (strpp) {
+      *strpp = startp;
+      *lenp = quotep - startp;
+    }
+    return (0);
+  }
+  if (strpp == NULL) {
+    return (0);
+  }
+  if (buf == NULL) {
+    return (-1);
+  }
+
+  size_t len = 0;
+  const char *cp;
+  for (cp = startp; cp < quotep; cp++) {
+    if (len + 4 >= buf_size) {
+      warnx("too long string in JSON.");
+      return (-1);
+    }
+    if (*cp != '\\') {
+      buf[len++] = *cp;
+      continue;
+    }
+    switch (*++cp) {
+    case 'b': buf[len++] = '\b'; break;
+    case 'f': buf[len++] = '\f'; break;
+    case 'n': buf[len++] = '\n'; break;
+    case 'r': buf[len++] = '\r'; break;
+    case 't': buf[len++] = '\t'; break;
+    case 'u': {
+      unsigned int code, low;
+      if (cp + 4 >= quotep || json_stub_hex4(cp + 1, &code) == -1) {
+	warnx("broken unicode escape in JSON.");
+	return (-1);
+      }
+      cp += 4;
+      if (code >= 0xd800 && code < 0xdc00 && cp + 6 < quotep
+	  && cp[1] == '\\' && cp[2] == 'u' && json_stub_hex4(cp + 3, &low) == 0
+	  && low >= 0xdc00 && low < 0xe000) {
+	/* a surrogate pair. */
+	code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+	cp += 6;
+      }
+      if (code < 0x80) {
+	buf[len++] = code;
+      } else if (code < 0x800) {
+	buf[len++] = 0xc0 | (code >> 6);
+	buf[len++] = 0x80 | (code & 0x3f);
+      } else if (code < 0x10000) {
+	buf[len++] = 0xe0 | (code >> 12);
+	buf[len++] = 0x80 | ((code >> 6) & 0x3f);
+	buf[len++] = 0x80 | (code & 0x3f);
+      } else {
+	buf[len++] = 0xf0 | (code >> 18);
+	buf[len++] = 0x80 | ((code >> 12) & 0x3f);
+	buf[len++] = 0x80 | ((code >> 6) & 0x3f);
+	buf[len++] = 0x80 | (code & 0x3f);
+      }
+      break;
+    }
+    default:
+      /* '"', '\\' and '/'. */
+      buf[len++] = *cp;
+      break;
+    }
+  }
+  buf[len] = '\0';
+  *strpp = buf;
+  *lenp = len;
 
   return (0);
 }
 
 static int
-json_stub_get_nodetype(struct json_object *jnodeinfop)
+json_stub_hex4(const char *hexp, unsigned int *codep)
+{
+  assert(hexp != NULL);
+  assert(codep != NULL);
+
+  *codep = 0;
+  int i;
+  for (i = 0; i < 4; i++) {
+    char c = hexp[i];
+    *codep <<= 4;
+    if (c >= '0' && c <= '9') {
+      *codep |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      *codep |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      *codep |= c - 'A' + 10;
+    } else {
+      return (-1);
+    }
+  }
+
+  return (0);
+}
+
+static int
+json_stub_key_is(const char *keyp, size_t key_len, const char *name)
+{
+  assert(keyp != NULL);
+  assert(name != NULL);
+
+  return (strlen(name) == key_len && memcmp(keyp, name, key_len) == 0);
+}
+
+static int
+json_stub_scan_number(json_stub_scanner_t *sp, double *doublep,
+		      u_int64_t *uint64p)
 {
-  assert(jnodeinfop != NULL);
+  assert(sp != NULL);
 
-  struct json_object *jnodetypep;
-  jnodetypep = json_object_array_get_idx(jnodeinfop, 0);
-  if (jnodetypep == NULL) {
-    warnx("no node type information exists.");
+  char *endp;
+  double value = strtod(sp->p, &endp);
+  if (endp == sp->p) {
+    warnx("a number is expected in JSON.");
     return (-1);
   }
-  const char *nodetype;
-  nodetype = json_object_get_string(jnodetypep);
-  if (nodetype == NULL) {
-    warnx("failed to convert JSON string to string.");
-    return (-1);
+  if (doublep) {
+    *doublep = value;
+  }
+  if (uint64p) {
+    *uint64p = value < 0 ? 0 : strtoull(sp->p, NULL, 10);
   }
+  sp->p = endp;
+
+  return (0);
+}
+
+/*
+ * skip a value of any type.  nested values are skipped by counting
+ * the brackets, with the strings in them skipped as a whole.
+ */
+static int
+json_stub_skip_value(json_stub_scanner_t *sp)
+{
+  assert(sp != NULL);
+
+  json_stub_skip_space(sp);
+  int depth = 0;
+  do {
+    switch (*sp->p) {
+    case '\0':
+      warnx("unexpected end of JSON.");
+      return (-1);
+    case '"':
+      if (json_stub_scan_string(sp, NULL, NULL, NULL, 0) == -1) {
+	return (-1);
+      }
+      break;
+    case '{':
+    case '[':
+      depth++;
+      sp->p++;
+      break;
+    case '}':
+    case ']':
+      if (depth == 0) {
+	warnx("unbalanced JSON.");
+	return (-1);
+      }
+      depth--;
+      sp->p++;
+      break;
+    default:
+      if (depth == 0) {
+	/* a number or a literal ends at a delimiter. */
+	while (*sp->p != '\0' && strchr(",}] \t\r\n", *sp->p) == NULL) {
+	  sp->p++;
+	}
+      } else {
+	sp->p++;
+      }
+      break;
+    }
+  } while (depth > 0);
+
+  return (0);
+}
 
-  /* check node type. */
-  if (strcmp(nodetype, "dirnode") == 0) {
-    return (TAHOEFS_STAT_TYPE_DIRNODE);
-  } else if (strcmp(nodetype, "filenode") == 0) {
-    return (TAHOEFS_STAT_TYPE_FILENODE);
+static int
+json_stub_expect(json_stub_scanner_t *sp, char c)
+{
+  assert(sp != NULL);
+
+  json_stub_skip_space(sp);
+  if (*sp->p != c) {
+    warnx("'%c' is expected in JSON.", c);
+    return (-1);
   }
+  sp->p++;
 
-  return (TAHOEFS_STAT_TYPE_UNKNOWN);
+  return (0);
 }
 
+static void
+json_stub_skip_space(json_stub_scanner_t *sp)
+{
+  assert(sp != NULL);
 
-int
-json_stub_iterate_children(void *buf, void *fillerp, const char *json,
-			   json_stub_iterate_children_callback_t callback)
+  while (*sp->p == ' ' || *sp->p == '\t' || *sp->p == '\r'
+	 || *sp->p == '\n') {
+    sp->p++;
+  }
+}
+
+/*
+ * start an incremental scan of a dirnode JSON.  the data is given
+ * with json_stub_stream_feed() as it arrives, and the callback is
+ * called with the buf parameter for each child as soon as its entry is
+ * complete.  the baton passed to the callback has the name, the raw
+ * JSON and the parsed metadata of the child.  only one child is held
+ * in memory at a time.
+ */
+json_stub_stream_t *
+json_stub_stream_new(void *buf, json_stub_iterate_children_callback_t callback)
 {
-  assert(json != NULL);
   assert(callback != NULL);
 
-  /* parse the dirnode information. */
-  struct json_object *jnodeinfop;
-  jnodeinfop = json_tokener_parse(json);
-  if (jnodeinfop == NULL) {
-    warnx("failed to parse the dirnode information in JSON format.");
-    return (-1);
+  json_stub_stream_t *streamp = calloc(1, sizeof(json_stub_stream_t));
+  if (streamp == NULL) {
+    warn("failed to allocate memory for a JSON stream.");
+    return (NULL);
   }
+  streamp->buf = buf;
+  streamp->callback = callback;
 
-  /* check if this node is a directory. */
-  int nodetype = json_stub_get_nodetype(jnodeinfop);
-  if (nodetype != TAHOEFS_STAT_TYPE_DIRNODE) {
-    warn("this is not a dirnode.");
-    json_object_put(jnodeinfop);
+  return (streamp);
+}
+
+int
+json_stub_stream_feed(json_stub_stream_t *streamp, const char *datap,
+		      size_t size)
+{
+  assert(streamp != NULL);
+  assert(datap != NULL);
+
+  const char *endp = datap + size;
+  while (datap < endp) {
+    if (streamp->in_string && !streamp->escaped
+	&& (streamp->in_member || streamp->depth != 2)) {
+      /*
+       * the plain part of a string needs no state change.  it is
+       * looked up with memchr() and copied at once.
+       */
+      const char *stopp = memchr(datap, '"', endp - datap);
+      if (stopp == NULL) {
+	stopp = endp;
+      }
+      const char *backslashp = memchr(datap, '\\', stopp - datap);
+      if (backslashp) {
+	stopp = backslashp;
+      }
+      if (stopp > datap) {
+	if (json_stub_stream_write(streamp, datap, stopp - datap) == -1) {
+	  return (-1);
+	}
+	datap = stopp;
+	continue;
+      }
+    }
+    if (json_stub_stream_putc(streamp, *datap++) == -1) {
+      return (-1);
+    }
   }
 
-  /* the second entry of jnodeinfop contains node specific data. */
-  struct json_object *jfileinfop;
-  jfileinfop = json_object_array_get_idx(jnodeinfop, 1);
-  if (jfileinfop == NULL) {
-    warnx("no fileinfo exists.");
-    json_object_put(jnodeinfop);
+  return (0);
+}
+
+/*
+ * finish the scan, and fill the tstatp parameter with the information
+ * of the directory itself.  THE CALLER MUST RELEASE the tstatp
+ * parameter with captable_tstat_release() on success.
+ */
+int
+json_stub_stream_finish(json_stub_stream_t *streamp, tahoefs_stat_t *tstatp)
+{
+  assert(streamp != NULL);
+  assert(tstatp != NULL);
+
+  if (streamp->depth != 0 || streamp->in_string
+      || streamp->skeleton == NULL) {
+    warnx("the dirnode information is truncated.");
     return (-1);
   }
-
-  /* children exist only in dirnode. */
-  struct json_object *jchildrenp = NULL;
-  jchildrenp = json_object_object_get(jfileinfop, "children");
-  if (jchildrenp == NULL) {
-    warnx("no children key in a dirnode fileinfo.");
-    json_object_put(jnodeinfop);
+  if (json_stub_stream_append(&streamp->skeleton, &streamp->skeleton_len,
+			      &streamp->skeleton_size, "", 1) == -1) {
     return (-1);
   }
 
-  struct json_object_iter iter;
-  json_object_object_foreachC(jchildrenp, iter) {
-    tahoefs_readdir_baton_t baton;
-    baton.nodename = iter.key;
-    baton.infop = json_object_to_json_string(iter.val);
-    baton.nodename_listp = buf;
-    baton.fillerp = fillerp;
-    if (callback(&baton) == -1) {
-      warnx("failed to add %s to directory list.", iter.key);
-      continue;
+  return (json_stub_jsonstring_to_tstat(streamp->skeleton, tstatp));
+}
+
+void
+json_stub_stream_free(json_stub_stream_t *streamp)
+{
+  assert(streamp != NULL);
+
+  free(streamp->skeleton);
+  free(streamp->member);
+  free(streamp);
+}
+
+static int
+json_stub_stream_putc(json_stub_stream_t *streamp, char c)
+{
+  assert(streamp != NULL);
+
+  if (streamp->in_string) {
+    if (streamp->escaped) {
+      streamp->escaped = 0;
+    } else if (c == '\\') {
+      streamp->escaped = 1;
+    } else if (c == '"') {
+      streamp->in_string = 0;
+    } else if (streamp->depth == 2 && !streamp->in_member) {
+      if (streamp->last_key_len < sizeof(streamp->last_key)) {
+	streamp->last_key[streamp->last_key_len] = c;
+      }
+      streamp->last_key_len++;
+    }
+  } else {
+    if (streamp->in_children && streamp->depth == 3) {
+      if (c == ',' || c == '}') {
+	/* the end of a member. */
+	if (streamp->in_member && json_stub_stream_emit(streamp) == -1) {
+	  return (-1);
+	}
+	streamp->in_member = 0;
+	if (c == ',') {
+	  return (0);
+	}
+	streamp->in_children = 0;
+      } else if (!streamp->in_member) {
+	if (isspace((unsigned char)c)) {
+	  return (0);
+	}
+	/* the beginning of a member. */
+	streamp->in_member = 1;
+	streamp->member_len = 0;
+      }
+    }
+
+    switch (c) {
+    case '"':
+      streamp->in_string = 1;
+      if (streamp->depth == 2) {
+	streamp->last_key_len = 0;
+      }
+      break;
+    case '{':
+      if (streamp->depth == 2
+	  && streamp->last_key_len == sizeof(streamp->last_key)
+	  && memcmp(streamp->last_key, "children",
+		    sizeof(streamp->last_key)) == 0) {
+	streamp->in_children = 1;
+      }
+      /* FALLTHROUGH */
+    case '[':
+      streamp->depth++;
+      break;
+    case '}':
+    case ']':
+      if (streamp->depth == 0) {
+	warnx("unbalanced dirnode information.");
+	return (-1);
+      }
+      streamp->depth--;
+      break;
     }
   }
 
-  json_object_put(jnodeinfop);
+  return (json_stub_stream_write(streamp, &c, 1));
+}
+
+static int
+json_stub_stream_append(char **bufp, size_t *lenp, size_t *sizep,
+			const char *datap, size_t size)
+{
+  assert(bufp != NULL);
+  assert(lenp != NULL);
+  assert(sizep != NULL);
+  assert(datap != NULL);
+
+  if (*lenp + size > *sizep) {
+    size_t new_size = *sizep ? *sizep * 2 : 256;
+    while (new_size < *lenp + size) {
+      new_size *= 2;
+    }
+    char *new_buf = realloc(*bufp, new_size);
+    if (new_buf == NULL) {
+      warn("failed to grow the buffer of a JSON stream.");
+      return (-1);
+    }
+    *bufp = new_buf;
+    *sizep = new_size;
+  }
+  memcpy(&(*bufp)[*lenp], datap, size);
+  *lenp += size;
 
   return (0);
 }
 
-int
-json_stub_extract_child(const char *child_name, char **child_jsons,
-			const char *parent_jsons)
+/*
+ * append the data to the member being read or to the skeleton.
+ */
+static int
+json_stub_stream_write(json_stub_stream_t *streamp, const char *datap,
+		       size_t size)
 {
-  assert(child_name != NULL);
-  assert(child_jsons != NULL);
-  assert(*child_jsons == NULL);
-  assert(parent_jsons != NULL);
-
-  /* parse the dirnode information. */
-  struct json_object *jnodeinfop;
-  jnodeinfop = json_tokener_parse(parent_jsons);
-  if (jnodeinfop == NULL) {
-    warnx("failed to parse the dirnode information in JSON format.");
+  assert(streamp != NULL);
+  assert(datap != NULL);
+
+  if (streamp->in_member) {
+    return (json_stub_stream_append(&streamp->member, &streamp->member_len,
+				    &streamp->member_size, datap, size));
+  }
+  return (json_stub_stream_append(&streamp->skeleton, &streamp->skeleton_len,
+				  &streamp->skeleton_size, datap, size));
+}
+
+/*
+ * parse the member of the "children" object held in the stream, and
+ * pass it to the callback.  a broken member is skipped.
+ */
+static int
+json_stub_stream_emit(json_stub_stream_t *streamp)
+{
+  assert(streamp != NULL);
+  assert(streamp->member != NULL);
+
+  if (json_stub_stream_append(&streamp->member, &streamp->member_len,
+			      &streamp->member_size, "", 1) == -1) {
     return (-1);
   }
 
-  /* check if this node is a directory. */
-  int nodetype = json_stub_get_nodetype(jnodeinfop);
-  if (nodetype != TAHOEFS_STAT_TYPE_DIRNODE) {
-    warn("this is not a dirnode.");
-    json_object_put(jnodeinfop);
+  json_stub_scanner_t scanner;
+  scanner.p = streamp->member;
+  scanner.endp = streamp->member + streamp->member_len - 1;
+
+  char name[JSON_STUB_NAME_MAX];
+  const char *namep;
+  size_t name_len;
+  if (json_stub_scan_string(&scanner, &namep, &name_len,
+			    name, sizeof(name)) == -1
+      || name_len >= sizeof(name)
+      || json_stub_expect(&scanner, ':') == -1) {
+    warnx("failed to parse a child entry in JSON format.");
+    return (0);
   }
+  if (namep != name) {
+    memcpy(name, namep, name_len);
+    name[name_len] = '\0';
+  }
+  json_stub_skip_space(&scanner);
+
+  /* the raw text of the value is passed as it is. */
+  tahoefs_readdir_baton_t baton;
+  baton.infop = scanner.p;
+
+  tahoefs_stat_t tstat;
+  memset(&tstat, 0, sizeof(tahoefs_stat_t));
+  if (json_stub_scan_node(&scanner, &tstat) == -1) {
+    warnx("failed to convert JSON stat data of %s.", name);
+    return (0);
+  }
+  baton.nodename = name;
+  baton.tstatp = &tstat;
+  baton.nodename_listp = streamp->buf;
+  baton.fillerp = NULL;
+  if (streamp->callback(&baton) == -1) {
+    warnx("failed to add %s to directory list.", name);
+  }
+  captable_tstat_release(&tstat);
 
-  /* the second entry of jnodeinfop contains node specific data. */
-  struct json_object *jfileinfop;
-  jfileinfop = json_object_array_get_idx(jnodeinfop, 1);
-  if (jfileinfop == NULL) {
-    warnx("no fileinfo exists.");
-    json_object_put(jnodeinfop);
+  return (0);
+}
+
+/*
+ * parse a line of the stream-manifest output.  the typep parameter is
+ * filled with the node type (TAHOEFS_STAT_TYPE_UNKNOWN for the stats
+ * line at the end), and the path parameter with the path of the node
+ * relative to the manifest root ("" for the root itself).
+ */
+int
+json_stub_manifest_unit(const char *json, int *typep, char *path,
+			size_t path_size)
+{
+  assert(json != NULL);
+  assert(typep != NULL);
+  assert(path != NULL);
+  assert(path_size > 0);
+
+  struct json_object *junitp;
+  junitp = json_tokener_parse(json);
+  if (junitp == NULL) {
+    warnx("failed to parse a manifest unit in JSON format.");
     return (-1);
   }
 
-  /* children exist only in dirnode. */
-  struct json_object *jchildrenp = NULL;
-  jchildrenp = json_object_object_get(jfileinfop, "children");
-  if (jchildrenp == NULL) {
-    warnx("no children key in a dirnode fileinfo.");
-    json_object_put(jnodeinfop);
+  *typep = TAHOEFS_STAT_TYPE_UNKNOWN;
+  path[0] = '\0';
+  struct json_object *jtypep;
+  jtypep = json_object_object_get(junitp, "type");
+  const char *type = jtypep ? json_object_get_string(jtypep) : NULL;
+  if (type == NULL) {
+    /* not a node. */
+    json_object_put(junitp);
+    return (0);
+  }
+  if (strcmp(type, "directory") == 0) {
+    *typep = TAHOEFS_STAT_TYPE_DIRNODE;
+  } else if (strcmp(type, "file") == 0) {
+    *typep = TAHOEFS_STAT_TYPE_FILENODE;
+  } else {
+    json_object_put(junitp);
+    return (0);
+  }
+
+  /* "path" is a list of the names from the manifest root. */
+  struct json_object *jpathp;
+  jpathp = json_object_object_get(junitp, "path");
+  if (jpathp == NULL) {
+    warnx("no path key exist in a manifest unit.");
+    json_object_put(junitp);
     return (-1);
   }
-  
-  struct json_object_iter iter;
-  json_object_object_foreachC(jchildrenp, iter) {
-    if (strcmp(child_name, iter.key) == 0) {
-      /* found. */
-      *child_jsons = strdup(json_object_to_json_string(iter.val));
-      json_object_put(jnodeinfop);
-      return (0);
+  size_t path_len = 0;
+  int i;
+  for (i = 0; i < json_object_array_length(jpathp); i++) {
+    const char *name
+      = json_object_get_string(json_object_array_get_idx(jpathp, i));
+    if (name == NULL) {
+      continue;
+    }
+    size_t name_len = strlen(name);
+    if (path_len + 1 + name_len >= path_size) {
+      warnx("too long path in a manifest unit.");
+      json_object_put(junitp);
+      return (-1);
     }
+    path[path_len++] = '/';
+    memcpy(&path[path_len], name, name_len + 1);
+    path_len += name_len;
   }
 
-  json_object_put(jnodeinfop);
+  json_object_put(junitp);
 
-  /* not found. */
-  return (-1);
+  return (0);
 }
+
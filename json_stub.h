@@ -27,10 +27,14 @@
 
 typedef int (*json_stub_iterate_children_callback_t)
 	(tahoefs_readdir_baton_t *);
+typedef struct json_stub_stream json_stub_stream_t;
 
 int json_stub_jsonstring_to_tstat(const char *, tahoefs_stat_t *);
-int json_stub_iterate_children(void *, void *, const char *,
-			       json_stub_iterate_children_callback_t);
-int json_stub_extract_child(const char *, char **, const char *);
+json_stub_stream_t *json_stub_stream_new(void *,
+					 json_stub_iterate_children_callback_t);
+int json_stub_stream_feed(json_stub_stream_t *, const char *, size_t);
+int json_stub_stream_finish(json_stub_stream_t *, tahoefs_stat_t *);
+void json_stub_stream_free(json_stub_stream_t *);
+int json_stub_manifest_unit(const char *, int *, char *, size_t);
 
 #endif
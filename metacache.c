@@ -0,0 +1,1040 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "metacache.h"
+#include "captable.h"
+
+#define METACACHE_INITIAL_BUCKETS 1024
+#define METACACHE_HOT_HITS 4	/* hits per lifetime to be refreshed ahead. */
+#define METACACHE_MAX_LISTINGS 256	/* directory JSONs kept in memory. */
+
+/*
+ * an in-memory cache of remote node metadata, keyed by the tahoe path.
+ * entries are filled from a single parent listing (a dirnode JSON
+ * includes complete metadata of its children), so the getattr
+ * operations for all the siblings can be answered by one round trip.
+ */
+typedef struct metacache_entry {
+  struct metacache_entry *next;
+  char *path;
+  unsigned int hash;
+  int has_tstat;
+  tahoefs_stat_t tstat;
+  char *infop;		/* the JSON representation of the node. */
+  time_t fetched;	/* when tstat and infop were retrieved. */
+  time_t listed;	/* when the children of this node were listed. */
+  int flags;		/* METACACHE_FLAG_* */
+  int listed_permanent;	/* the listing never expires. */
+  int permanent_children;	/* some children head permanent subtrees. */
+  unsigned int hits;	/* lookups since the last refresh. */
+  time_t revalidated;	/* when a background listing was last asked. */
+  int hot;		/* linked in the hot list or not. */
+  struct metacache_entry *hot_prev;
+  struct metacache_entry *hot_next;
+  char *listing;	/* the names of the children, if kept. */
+  size_t listing_len;
+  struct metacache_entry *listing_prev;
+  struct metacache_entry *listing_next;
+} metacache_entry_t;
+
+static metacache_entry_t **metacache_buckets = NULL;
+static size_t metacache_nbuckets = 0;
+static size_t metacache_nentries = 0;
+static pthread_mutex_t metacache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * entries looked up frequently are linked in the hot list.  the
+ * refresher thread revalidates them shortly before they expire, so
+ * that foreground operations don't have to wait for the gateway.
+ */
+static metacache_entry_t *metacache_hot_list = NULL;
+static metacache_refresh_func_t metacache_refresh_func = NULL;
+static pthread_t metacache_refresher;
+static int metacache_refresher_running = 0;
+static pthread_cond_t metacache_refresher_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * the names of the children of recently listed directories are kept,
+ * so that a readdir right after the listing (typically one fetched
+ * ahead by the prefetcher) needs no round trip.  the metadata of each
+ * child is in its own entry.  only the newest METACACHE_MAX_LISTINGS
+ * are kept as they are large.
+ */
+static metacache_entry_t *metacache_listing_head = NULL;
+static metacache_entry_t *metacache_listing_tail = NULL;
+static size_t metacache_nlistings = 0;
+
+static unsigned int metacache_hash(const char *);
+static int metacache_is_fresh(time_t, time_t);
+static int metacache_is_kept(time_t, time_t);
+static metacache_entry_t *metacache_find(const char *, unsigned int);
+static metacache_entry_t *metacache_find_or_create(const char *);
+static void metacache_remove(metacache_entry_t *);
+static void metacache_remove_descendants(const char *);
+static int metacache_heads_permanent(const metacache_entry_t *);
+static int metacache_parent_path(const char *, char *, size_t);
+static void metacache_sweep(time_t);
+static void metacache_grow(void);
+static void metacache_free_entry(metacache_entry_t *);
+static void metacache_hot_link(metacache_entry_t *);
+static void metacache_hot_unlink(metacache_entry_t *);
+static void metacache_listing_unlink(metacache_entry_t *);
+static void *metacache_refresher_main(void *);
+static int metacache_needs_refresh(const metacache_entry_t *, time_t);
+
+int
+metacache_initialize(void)
+{
+  pthread_mutex_lock(&metacache_lock);
+  metacache_buckets = calloc(METACACHE_INITIAL_BUCKETS,
+			     sizeof(metacache_entry_t *));
+  if (metacache_buckets == NULL) {
+    warn("failed to allocate memory for the metadata cache.");
+    pthread_mutex_unlock(&metacache_lock);
+    return (-1);
+  }
+  metacache_nbuckets = METACACHE_INITIAL_BUCKETS;
+  metacache_nentries = 0;
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+int
+metacache_terminate(void)
+{
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_refresher_running) {
+    metacache_refresher_running = 0;
+    pthread_cond_signal(&metacache_refresher_cond);
+    pthread_mutex_unlock(&metacache_lock);
+    pthread_join(metacache_refresher, NULL);
+    pthread_mutex_lock(&metacache_lock);
+  }
+  size_t i;
+  for (i = 0; i < metacache_nbuckets; i++) {
+    metacache_entry_t *entryp = metacache_buckets[i];
+    while (entryp) {
+      metacache_entry_t *nextp = entryp->next;
+      metacache_free_entry(entryp);
+      entryp = nextp;
+    }
+  }
+  free(metacache_buckets);
+  metacache_buckets = NULL;
+  metacache_nbuckets = 0;
+  metacache_nentries = 0;
+  metacache_hot_list = NULL;
+  metacache_listing_head = metacache_listing_tail = NULL;
+  metacache_nlistings = 0;
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+/*
+ * start the refresher thread.  the refresh_func parameter is called
+ * with the path of a hot entry which is about to expire, and must
+ * store the latest metadata of the path with metacache_store().
+ */
+int
+metacache_start_refresher(metacache_refresh_func_t refresh_func)
+{
+  assert(refresh_func != NULL);
+
+  if (config.refresh_ahead <= 0 || config.refresh_rate <= 0) {
+    /* refresh-ahead is disabled. */
+    return (0);
+  }
+
+  pthread_mutex_lock(&metacache_lock);
+  metacache_refresh_func = refresh_func;
+  metacache_refresher_running = 1;
+  if (pthread_create(&metacache_refresher, NULL, metacache_refresher_main,
+		     NULL) != 0) {
+    warnx("failed to create the metadata refresher thread.");
+    metacache_refresher_running = 0;
+    pthread_mutex_unlock(&metacache_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+/*
+ * look up the metadata of the node specified as the path parameter.
+ *
+ * returns METACACHE_HIT and fills tstatp (and infopp, if not NULL)
+ * when fresh metadata is cached.  returns METACACHE_NEGATIVE when the
+ * parent directory was listed recently and the node was not there.
+ * otherwise returns METACACHE_MISS.  the flagsp parameter, if not
+ * NULL, is filled with the METACACHE_FLAG_* flags of the entry on a
+ * hit.  THE CALLER MUST FREE THE MEMORY allocated to the infopp
+ * parameter, and release tstatp by captable_tstat_release().
+ */
+int
+metacache_lookup(const char *path, tahoefs_stat_t *tstatp, char **infopp,
+		 int *flagsp)
+{
+  return (metacache_lookup_stale(path, tstatp, infopp, flagsp, 0));
+}
+
+/*
+ * look up the metadata like metacache_lookup(), but an entry expired
+ * up to max_stale seconds ago is a hit as well.
+ */
+int
+metacache_lookup_stale(const char *path, tahoefs_stat_t *tstatp,
+		       char **infopp, int *flagsp, time_t max_stale)
+{
+  assert(path != NULL);
+  assert(tstatp != NULL);
+  assert(infopp == NULL || *infopp == NULL);
+
+  time_t now = time(NULL);
+
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (METACACHE_MISS);
+  }
+
+  metacache_entry_t *entryp = metacache_find(path, metacache_hash(path));
+  if (entryp && entryp->has_tstat
+      && ((entryp->flags & METACACHE_FLAG_PERMANENT)
+	  || metacache_is_fresh(entryp->fetched + max_stale, now))) {
+    entryp->hits++;
+    if (entryp->hits >= METACACHE_HOT_HITS && !entryp->hot
+	&& !(entryp->flags & METACACHE_FLAG_PERMANENT)) {
+      metacache_hot_link(entryp);
+    }
+    if (infopp && entryp->infop) {
+      *infopp = strdup(entryp->infop);
+      if (*infopp == NULL) {
+	warn("failed to duplicate a string (%s).", entryp->infop);
+	pthread_mutex_unlock(&metacache_lock);
+	return (METACACHE_MISS);
+      }
+    }
+    captable_tstat_copy(tstatp, &entryp->tstat);
+    if (flagsp) {
+      *flagsp = entryp->flags;
+    }
+    pthread_mutex_unlock(&metacache_lock);
+    return (METACACHE_HIT);
+  }
+
+  /* check if the parent directory knows the node doesn't exist. */
+  char parent_path[MAXPATHLEN];
+  if (metacache_parent_path(path, parent_path, sizeof(parent_path)) == -1) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (METACACHE_MISS);
+  }
+
+  metacache_entry_t *parentp = metacache_find(parent_path,
+					      metacache_hash(parent_path));
+  if (parentp && parentp->listed
+      && (parentp->listed_permanent
+	  || metacache_is_fresh(parentp->listed, now))) {
+    /*
+     * the parent listing is fresh.  if the node was not refreshed by
+     * that listing, it has been removed from the parent.
+     */
+    if (entryp == NULL || !entryp->has_tstat
+	|| entryp->fetched < parentp->listed) {
+      pthread_mutex_unlock(&metacache_lock);
+      return (METACACHE_NEGATIVE);
+    }
+  }
+
+  pthread_mutex_unlock(&metacache_lock);
+  return (METACACHE_MISS);
+}
+
+/*
+ * store the metadata of the node specified as the path parameter.
+ * the infop parameter is the JSON representation of the node and may
+ * be NULL.  the fetched parameter is the time when the metadata was
+ * retrieved from the tahoe storage.  if METACACHE_FLAG_PERMANENT is
+ * specified in the flags parameter, the entry never expires.  it is
+ * the case for the children of an immutable directory.
+ */
+int
+metacache_store(const char *path, const tahoefs_stat_t *tstatp,
+		const char *infop, time_t fetched, int flags)
+{
+  assert(path != NULL);
+  assert(tstatp != NULL);
+
+  char *new_infop = NULL;
+  if (infop) {
+    new_infop = strdup(infop);
+    if (new_infop == NULL) {
+      warn("failed to duplicate a string (%s).", infop);
+      return (-1);
+    }
+  }
+
+  pthread_mutex_lock(&metacache_lock);
+  metacache_entry_t *entryp = metacache_find_or_create(path);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    free(new_infop);
+    return (-1);
+  }
+  /* caps are interned.  comparing the pointers is enough. */
+  if (entryp->has_tstat && entryp->tstat.ro_uri != tstatp->ro_uri) {
+    /* the path is bound to another node.  the listing is obsolete. */
+    entryp->listed = 0;
+    entryp->listed_permanent = 0;
+    if (metacache_heads_permanent(entryp)) {
+      /* so are the permanent entries taken from it. */
+      metacache_remove_descendants(path);
+    }
+  }
+  captable_tstat_release(&entryp->tstat);
+  captable_tstat_copy(&entryp->tstat, tstatp);
+  entryp->has_tstat = 1;
+  entryp->flags = (flags & METACACHE_FLAG_PERMANENT);
+  free(entryp->infop);
+  entryp->infop = new_infop;
+  entryp->fetched = fetched;
+  /* decay the access frequency every time the entry is refreshed. */
+  entryp->hits /= 2;
+  if (tstatp->type != TAHOEFS_STAT_TYPE_DIRNODE) {
+    entryp->listed = 0;
+    entryp->listed_permanent = 0;
+  }
+  if (metacache_heads_permanent(entryp)) {
+    /*
+     * the parent is mutable.  when it is listed again without this
+     * node, the permanent entries beneath must be dropped.
+     */
+    char parent_path[MAXPATHLEN];
+    if (metacache_parent_path(path, parent_path, sizeof(parent_path)) == 0) {
+      metacache_entry_t *parentp = metacache_find_or_create(parent_path);
+      if (parentp) {
+	parentp->permanent_children = 1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+/*
+ * record that the children of the directory specified as the path
+ * parameter were listed (and stored by metacache_store()) at the time
+ * specified as the listed parameter.  if the permanent parameter is
+ * true, the directory is immutable and the listing never expires.
+ */
+int
+metacache_set_listed(const char *path, time_t listed, int permanent)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&metacache_lock);
+  metacache_entry_t *entryp = metacache_find_or_create(path);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (-1);
+  }
+  entryp->listed = listed;
+  entryp->listed_permanent = permanent;
+  if (entryp->permanent_children && !permanent) {
+    /*
+     * a child heading a permanent subtree which was not refreshed by
+     * this listing has been unlinked.  drop it and its subtree.
+     */
+    size_t path_len = strlen(path);
+    if (strcmp(path, "/") == 0) {
+      path_len = 0;
+    }
+    entryp->permanent_children = 0;
+    size_t i;
+    for (i = 0; i < metacache_nbuckets; i++) {
+      metacache_entry_t **prevpp = &metacache_buckets[i];
+      while (*prevpp) {
+	metacache_entry_t *childp = *prevpp;
+	if (strncmp(childp->path, path, path_len) != 0
+	    || childp->path[path_len] != '/'
+	    || strchr(childp->path + path_len + 1, '/') != NULL
+	    || !metacache_heads_permanent(childp)) {
+	  prevpp = &childp->next;
+	  continue;
+	}
+	if (childp->fetched >= listed) {
+	  entryp->permanent_children = 1;
+	  prevpp = &childp->next;
+	  continue;
+	}
+	/* the removal may free the entries after this one in the bucket. */
+	metacache_remove_descendants(childp->path);
+	metacache_remove(childp);
+	prevpp = &metacache_buckets[i];
+      }
+    }
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+/*
+ * keep the names of the children of the directory specified as the
+ * path parameter.  the names parameter is a sequence of NUL
+ * terminated names of names_len bytes in total.  it is returned by
+ * metacache_lookup_listing() while the listing time set by
+ * metacache_set_listed() is fresh.
+ */
+int
+metacache_store_listing(const char *path, const char *names,
+			size_t names_len)
+{
+  assert(path != NULL);
+  assert(names != NULL || names_len == 0);
+
+  char *new_listing = malloc(names_len + 1);
+  if (new_listing == NULL) {
+    warn("failed to duplicate a listing of %s.", path);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&metacache_lock);
+  metacache_entry_t *entryp = metacache_find_or_create(path);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    free(new_listing);
+    return (-1);
+  }
+  if (entryp->listing) {
+    metacache_listing_unlink(entryp);
+  }
+  memcpy(new_listing, names, names_len);
+  new_listing[names_len] = '\0';
+  entryp->listing = new_listing;
+  entryp->listing_len = names_len;
+  entryp->listing_prev = NULL;
+  entryp->listing_next = metacache_listing_head;
+  if (metacache_listing_head) {
+    metacache_listing_head->listing_prev = entryp;
+  } else {
+    metacache_listing_tail = entryp;
+  }
+  metacache_listing_head = entryp;
+  metacache_nlistings++;
+
+  /* drop the oldest ones. */
+  while (metacache_nlistings > METACACHE_MAX_LISTINGS) {
+    metacache_listing_unlink(metacache_listing_tail);
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (0);
+}
+
+/*
+ * get a copy of the names kept by metacache_store_listing() for the
+ * directory specified as the path parameter if its listing is fresh,
+ * or expired up to max_stale seconds ago.  THE CALLER MUST FREE THE
+ * MEMORY allocated to the namesp parameter.
+ */
+int
+metacache_lookup_listing(const char *path, char **namesp, size_t *names_lenp,
+			 time_t max_stale)
+{
+  assert(path != NULL);
+  assert(namesp != NULL);
+  assert(*namesp == NULL);
+  assert(names_lenp != NULL);
+
+  time_t now = time(NULL);
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (-1);
+  }
+  metacache_entry_t *entryp = metacache_find(path, metacache_hash(path));
+  if (entryp == NULL || entryp->listing == NULL || !entryp->listed
+      || !(entryp->listed_permanent
+	   || metacache_is_fresh(entryp->listed + max_stale, now))) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (-1);
+  }
+  *namesp = malloc(entryp->listing_len + 1);
+  if (*namesp) {
+    memcpy(*namesp, entryp->listing, entryp->listing_len + 1);
+    *names_lenp = entryp->listing_len;
+  }
+  pthread_mutex_unlock(&metacache_lock);
+  if (*namesp == NULL) {
+    warn("failed to duplicate a listing of %s.", path);
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * returns true if the listing of the directory specified as the path
+ * parameter is fresh.
+ */
+int
+metacache_is_listed(const char *path)
+{
+  assert(path != NULL);
+
+  time_t now = time(NULL);
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (0);
+  }
+  metacache_entry_t *entryp = metacache_find(path, metacache_hash(path));
+  int listed = (entryp && entryp->listed
+		&& (entryp->listed_permanent
+		    || metacache_is_fresh(entryp->listed, now)));
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (listed);
+}
+
+/*
+ * returns true if the caller should list the directory specified as
+ * the path parameter again in background, to revalidate the stale
+ * metadata it is serving.  only one of the callers is told so within
+ * the lifetime of the metadata.
+ */
+int
+metacache_start_revalidate(const char *path)
+{
+  assert(path != NULL);
+
+  time_t now = time(NULL);
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return (0);
+  }
+  metacache_entry_t *entryp = metacache_find_or_create(path);
+  int start = (entryp && !metacache_is_fresh(entryp->revalidated, now));
+  if (start) {
+    entryp->revalidated = now;
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  return (start);
+}
+
+/*
+ * mark the entry of the path parameter as validated against the local
+ * cache.  a permanent entry doesn't have to be validated again.
+ */
+void
+metacache_set_validated(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return;
+  }
+  metacache_entry_t *entryp = metacache_find(path, metacache_hash(path));
+  if (entryp) {
+    entryp->flags |= METACACHE_FLAG_VALIDATED;
+  }
+  pthread_mutex_unlock(&metacache_lock);
+}
+
+/*
+ * forget the metadata of the node specified as the path parameter and
+ * the listing of its parent directory.  this must be called whenever
+ * we modify the node.
+ */
+void
+metacache_invalidate(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&metacache_lock);
+  if (metacache_buckets == NULL) {
+    pthread_mutex_unlock(&metacache_lock);
+    return;
+  }
+
+  metacache_entry_t *entryp = metacache_find(path, metacache_hash(path));
+  if (entryp && entryp->permanent_children) {
+    /*
+     * keep the entry to remember that the next listing must look for
+     * unlinked children heading permanent subtrees.
+     */
+    if (entryp->listing) {
+      metacache_listing_unlink(entryp);
+    }
+    captable_tstat_release(&entryp->tstat);
+    memset(&entryp->tstat, 0, sizeof(tahoefs_stat_t));
+    entryp->has_tstat = 0;
+    free(entryp->infop);
+    entryp->infop = NULL;
+    entryp->listed = 0;
+    entryp->listed_permanent = 0;
+    entryp->flags = 0;
+  } else if (entryp) {
+    if (metacache_heads_permanent(entryp)) {
+      metacache_remove_descendants(path);
+    }
+    metacache_remove(entryp);
+  }
+
+  char parent_path[MAXPATHLEN];
+  if (metacache_parent_path(path, parent_path, sizeof(parent_path)) == 0) {
+    metacache_entry_t *parentp = metacache_find(parent_path,
+						metacache_hash(parent_path));
+    if (parentp) {
+      parentp->listed = 0;
+    }
+  }
+  pthread_mutex_unlock(&metacache_lock);
+}
+
+static unsigned int
+metacache_hash(const char *path)
+{
+  assert(path != NULL);
+
+  /* FNV-1a */
+  unsigned int hash = 2166136261U;
+  while (*path) {
+    hash ^= (unsigned char)*path++;
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+static int
+metacache_is_fresh(time_t stamp, time_t now)
+{
+  return (stamp + config.meta_ttl > now);
+}
+
+/*
+ * returns true if the entry may still be served as stale.
+ */
+static int
+metacache_is_kept(time_t stamp, time_t now)
+{
+  time_t max_stale = config.stale_while_revalidate;
+  if (config.stale_if_error > max_stale) {
+    max_stale = config.stale_if_error;
+  }
+  return (metacache_is_fresh(stamp + max_stale, now));
+}
+
+static metacache_entry_t *
+metacache_find(const char *path, unsigned int hash)
+{
+  assert(path != NULL);
+
+  metacache_entry_t *entryp
+    = metacache_buckets[hash & (metacache_nbuckets - 1)];
+  while (entryp) {
+    if (entryp->hash == hash && strcmp(entryp->path, path) == 0) {
+      return (entryp);
+    }
+    entryp = entryp->next;
+  }
+  return (NULL);
+}
+
+static metacache_entry_t *
+metacache_find_or_create(const char *path)
+{
+  assert(path != NULL);
+
+  if (metacache_buckets == NULL) {
+    return (NULL);
+  }
+
+  unsigned int hash = metacache_hash(path);
+  metacache_entry_t *entryp = metacache_find(path, hash);
+  if (entryp) {
+    return (entryp);
+  }
+
+  entryp = calloc(1, sizeof(metacache_entry_t));
+  if (entryp == NULL) {
+    warn("failed to allocate memory for a metadata cache entry.");
+    return (NULL);
+  }
+  entryp->path = strdup(path);
+  if (entryp->path == NULL) {
+    warn("failed to duplicate a string (%s).", path);
+    free(entryp);
+    return (NULL);
+  }
+  entryp->hash = hash;
+
+  if (metacache_nentries >= metacache_nbuckets) {
+    /* drop expired entries first, and enlarge the table if still full. */
+    metacache_sweep(time(NULL));
+    if (metacache_nentries >= metacache_nbuckets) {
+      metacache_grow();
+    }
+  }
+  size_t index = hash & (metacache_nbuckets - 1);
+  entryp->next = metacache_buckets[index];
+  metacache_buckets[index] = entryp;
+  metacache_nentries++;
+
+  return (entryp);
+}
+
+static void
+metacache_remove(metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  metacache_entry_t **prevpp
+    = &metacache_buckets[entryp->hash & (metacache_nbuckets - 1)];
+  while (*prevpp) {
+    if (*prevpp == entryp) {
+      *prevpp = entryp->next;
+      metacache_free_entry(entryp);
+      metacache_nentries--;
+      return;
+    }
+    prevpp = &(*prevpp)->next;
+  }
+}
+
+/*
+ * remove the entries beneath the path parameter.  the caller must hold
+ * metacache_lock.  this walks the whole table, but is needed only
+ * when a permanent subtree becomes unreachable, which is rare.
+ */
+static void
+metacache_remove_descendants(const char *path)
+{
+  assert(path != NULL);
+
+  size_t path_len = strlen(path);
+  size_t i;
+  for (i = 0; i < metacache_nbuckets; i++) {
+    metacache_entry_t **prevpp = &metacache_buckets[i];
+    while (*prevpp) {
+      metacache_entry_t *entryp = *prevpp;
+      if (strncmp(entryp->path, path, path_len) == 0
+	  && entryp->path[path_len] == '/') {
+	*prevpp = entryp->next;
+	metacache_free_entry(entryp);
+	metacache_nentries--;
+	continue;
+      }
+      prevpp = &entryp->next;
+    }
+  }
+}
+
+/*
+ * returns true if the entry is an immutable directory linked from a
+ * mutable one.  the children taken from its listing are permanent,
+ * but it can be unlinked or relinked to another node at any time.
+ */
+static int
+metacache_heads_permanent(const metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  return (entryp->has_tstat
+	  && !(entryp->flags & METACACHE_FLAG_PERMANENT)
+	  && entryp->tstat.type == TAHOEFS_STAT_TYPE_DIRNODE
+	  && !entryp->tstat.mutable
+	  && TAHOEFS_IS_IMMUTABLE_DIRCAP(TAHOEFS_CAP(entryp->tstat.ro_uri)));
+}
+
+/*
+ * copy the parent path of the path parameter to the buffer.  returns
+ * -1 if the path is the root or too long.
+ */
+static int
+metacache_parent_path(const char *path, char *parent_path, size_t size)
+{
+  assert(path != NULL);
+  assert(parent_path != NULL);
+
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || slash[1] == '\0') {
+    return (-1);
+  }
+  size_t parent_len = slash - path;
+  if (parent_len == 0) {
+    /* this means the root directory. */
+    parent_len = 1;
+  }
+  if (parent_len >= size) {
+    return (-1);
+  }
+  memcpy(parent_path, path, parent_len);
+  parent_path[parent_len] = '\0';
+
+  return (0);
+}
+
+static void
+metacache_sweep(time_t now)
+{
+  size_t i;
+  for (i = 0; i < metacache_nbuckets; i++) {
+    metacache_entry_t **prevpp = &metacache_buckets[i];
+    while (*prevpp) {
+      metacache_entry_t *entryp = *prevpp;
+      if (!(entryp->flags & METACACHE_FLAG_PERMANENT)
+	  && !entryp->listed_permanent
+	  && !entryp->permanent_children
+	  && !metacache_heads_permanent(entryp)
+	  && !metacache_is_kept(entryp->fetched, now)
+	  && !metacache_is_kept(entryp->listed, now)) {
+	*prevpp = entryp->next;
+	metacache_free_entry(entryp);
+	metacache_nentries--;
+	continue;
+      }
+      prevpp = &entryp->next;
+    }
+  }
+}
+
+static void
+metacache_grow(void)
+{
+  size_t new_nbuckets = metacache_nbuckets * 2;
+  metacache_entry_t **new_buckets = calloc(new_nbuckets,
+					   sizeof(metacache_entry_t *));
+  if (new_buckets == NULL) {
+    /* keep using the current table.  chains just become longer. */
+    warn("failed to enlarge the metadata cache.");
+    return;
+  }
+
+  size_t i;
+  for (i = 0; i < metacache_nbuckets; i++) {
+    metacache_entry_t *entryp = metacache_buckets[i];
+    while (entryp) {
+      metacache_entry_t *nextp = entryp->next;
+      size_t index = entryp->hash & (new_nbuckets - 1);
+      entryp->next = new_buckets[index];
+      new_buckets[index] = entryp;
+      entryp = nextp;
+    }
+  }
+  free(metacache_buckets);
+  metacache_buckets = new_buckets;
+  metacache_nbuckets = new_nbuckets;
+}
+
+static void
+metacache_free_entry(metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  if (entryp->hot) {
+    metacache_hot_unlink(entryp);
+  }
+  if (entryp->listing) {
+    metacache_listing_unlink(entryp);
+  }
+  captable_tstat_release(&entryp->tstat);
+  free(entryp->path);
+  free(entryp->infop);
+  free(entryp);
+}
+
+static void
+metacache_hot_link(metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+  assert(!entryp->hot);
+
+  entryp->hot_prev = NULL;
+  entryp->hot_next = metacache_hot_list;
+  if (metacache_hot_list) {
+    metacache_hot_list->hot_prev = entryp;
+  }
+  metacache_hot_list = entryp;
+  entryp->hot = 1;
+}
+
+static void
+metacache_hot_unlink(metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+  assert(entryp->hot);
+
+  if (entryp->hot_prev) {
+    entryp->hot_prev->hot_next = entryp->hot_next;
+  } else {
+    metacache_hot_list = entryp->hot_next;
+  }
+  if (entryp->hot_next) {
+    entryp->hot_next->hot_prev = entryp->hot_prev;
+  }
+  entryp->hot_prev = entryp->hot_next = NULL;
+  entryp->hot = 0;
+}
+
+/*
+ * unlink the entry from the listing list and free its listing.
+ */
+static void
+metacache_listing_unlink(metacache_entry_t *entryp)
+{
+  assert(entryp != NULL);
+  assert(entryp->listing != NULL);
+
+  if (entryp->listing_prev) {
+    entryp->listing_prev->listing_next = entryp->listing_next;
+  } else {
+    metacache_listing_head = entryp->listing_next;
+  }
+  if (entryp->listing_next) {
+    entryp->listing_next->listing_prev = entryp->listing_prev;
+  } else {
+    metacache_listing_tail = entryp->listing_prev;
+  }
+  entryp->listing_prev = entryp->listing_next = NULL;
+  free(entryp->listing);
+  entryp->listing = NULL;
+  entryp->listing_len = 0;
+  metacache_nlistings--;
+}
+
+/*
+ * returns true if the entry is still fresh but will expire within
+ * config.refresh_ahead seconds.
+ */
+static int
+metacache_needs_refresh(const metacache_entry_t *entryp, time_t now)
+{
+  assert(entryp != NULL);
+
+  if (entryp->flags & METACACHE_FLAG_PERMANENT) {
+    return (0);
+  }
+  time_t expire = entryp->fetched + config.meta_ttl;
+  return (entryp->has_tstat && expire > now
+	  && expire - now <= config.refresh_ahead);
+}
+
+/*
+ * the main loop of the refresher thread.  every second, hot entries
+ * which are about to expire are passed to the refresh function.  at
+ * most config.refresh_rate entries are refreshed per second so that
+ * the refresher never crowds out foreground requests.
+ */
+static void *
+metacache_refresher_main(void *arg)
+{
+  char **paths = calloc(config.refresh_rate, sizeof(char *));
+  if (paths == NULL) {
+    warn("failed to allocate memory for the metadata refresher.");
+    return (NULL);
+  }
+
+  pthread_mutex_lock(&metacache_lock);
+  while (metacache_refresher_running) {
+    struct timespec wakeup;
+    wakeup.tv_sec = time(NULL) + 1;
+    wakeup.tv_nsec = 0;
+    pthread_cond_timedwait(&metacache_refresher_cond, &metacache_lock,
+			   &wakeup);
+    if (!metacache_refresher_running) {
+      break;
+    }
+
+    /* pick up candidates, and drop entries which cooled down. */
+    time_t now = time(NULL);
+    int npaths = 0;
+    metacache_entry_t *entryp = metacache_hot_list;
+    while (entryp) {
+      metacache_entry_t *nextp = entryp->hot_next;
+      if (!metacache_needs_refresh(entryp, now)) {
+	if (!metacache_is_fresh(entryp->fetched, now)) {
+	  /* expired without being refreshed. it's not hot any more. */
+	  metacache_hot_unlink(entryp);
+	}
+	entryp = nextp;
+	continue;
+      }
+      if (entryp->hits < METACACHE_HOT_HITS) {
+	metacache_hot_unlink(entryp);
+	entryp = nextp;
+	continue;
+      }
+      if (npaths < config.refresh_rate) {
+	paths[npaths] = strdup(entryp->path);
+	if (paths[npaths]) {
+	  npaths++;
+	}
+      }
+      entryp = nextp;
+    }
+    pthread_mutex_unlock(&metacache_lock);
+
+    int i;
+    for (i = 0; i < npaths; i++) {
+      /* a sibling refreshed by the same listing doesn't need it. */
+      pthread_mutex_lock(&metacache_lock);
+      entryp = metacache_find(paths[i], metacache_hash(paths[i]));
+      int needed = (entryp && metacache_needs_refresh(entryp, time(NULL)));
+      pthread_mutex_unlock(&metacache_lock);
+      if (needed) {
+	DEBUGV("refreshing the metadata of %s ahead.\n", paths[i]);
+	if (metacache_refresh_func(paths[i]) == -1) {
+	  warnx("failed to refresh the metadata of %s.", paths[i]);
+	}
+      }
+      free(paths[i]);
+    }
+
+    pthread_mutex_lock(&metacache_lock);
+  }
+  pthread_mutex_unlock(&metacache_lock);
+
+  free(paths);
+  return (NULL);
+}
@@ -0,0 +1,53 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _METACACHE_H_
+#define _METACACHE_H_
+
+#define METACACHE_MISS		0
+#define METACACHE_HIT		1
+#define METACACHE_NEGATIVE	2
+
+#define METACACHE_FLAG_PERMANENT	0x01	/* never expires. */
+#define METACACHE_FLAG_VALIDATED	0x02	/* local cache is checked. */
+
+typedef int (*metacache_refresh_func_t)(const char *);
+
+int metacache_initialize(void);
+int metacache_terminate(void);
+int metacache_start_refresher(metacache_refresh_func_t);
+int metacache_lookup(const char *, tahoefs_stat_t *, char **, int *);
+int metacache_lookup_stale(const char *, tahoefs_stat_t *, char **, int *,
+			   time_t);
+int metacache_store(const char *, const tahoefs_stat_t *, const char *, time_t,
+		    int);
+int metacache_set_listed(const char *, time_t, int);
+int metacache_is_listed(const char *);
+int metacache_store_listing(const char *, const char *, size_t);
+int metacache_lookup_listing(const char *, char **, size_t *, time_t);
+int metacache_start_revalidate(const char *);
+void metacache_set_validated(const char *);
+void metacache_invalidate(const char *);
+
+#endif
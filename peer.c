@@ -0,0 +1,698 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <time.h>
+#include <netdb.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "cacheindex.h"
+#include "http_stub.h"
+#include "peer.h"
+
+#define PEER_MAX 64
+#define PEER_VNODES 64		/* points of a peer on the hash ring. */
+#define PEER_SERVER_THREADS 4
+#define PEER_HINT_SIZE 4096
+#define PEER_REQUEST_MAX 4096
+#define PEER_IO_TIMEOUT 10	/* in seconds. */
+#define PEER_CAP_PREFIX "URI:CHK:"
+#define PEER_VERIFY_SAMPLE 65536	/* bytes compared with the gateway. */
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+/*
+ * the tahoefs instances listed by --peers share the immutable files
+ * they have cached.  each cap is owned by one of them, chosen by
+ * consistent hashing, so that all the instances ask the same peer
+ * for it and adding or removing a peer moves few caps.  an instance
+ * which has downloaded a cap from the gateway tells its owner (GET
+ * /have/<cap>), and the owner either serves the cap from its own
+ * cache or redirects the requester to the instance which told it (GET
+ * /cap/<cap>).  the contents from a peer are checked against the size
+ * in the cap and a range sampled from the gateway, and a miss or a
+ * failure falls back to the gateway.  only CHK caps larger than the
+ * sample are shared.  the contents of a mutable file may change, those
+ * of a LIT cap are in the cap itself, and checking a smaller file
+ * would read all of it from the gateway anyway.
+ */
+typedef struct peer_point {
+  u_int64_t hash;
+  int peer;
+} peer_point_t;
+
+typedef struct peer_hint {
+  u_int64_t hash;	/* of the cap.  0 if unused. */
+  int peer;		/* which has the contents. */
+} peer_hint_t;
+
+static char *peer_addrs[PEER_MAX];
+static int peer_npeers = 0;
+static int peer_self = -1;
+static peer_point_t *peer_ring = NULL;
+static size_t peer_nring = 0;
+static peer_hint_t peer_hints[PEER_HINT_SIZE];
+static pthread_mutex_t peer_hint_lock = PTHREAD_MUTEX_INITIALIZER;
+static int peer_listen_fd = -1;
+static pthread_t peer_threads[PEER_SERVER_THREADS];
+static int peer_nthreads = 0;
+static volatile int peer_running = 0;
+static peer_open_func_t peer_open_func = NULL;
+
+static int peer_add(const char *, size_t);
+static int peer_find(const char *);
+static int peer_point_compare(const void *, const void *);
+static int peer_owner(const char *);
+static int peer_cap_size(const char *, u_int64_t *);
+static int peer_verify(const char *, const char *);
+static int peer_listen(const char *);
+static void *peer_main(void *);
+static void peer_serve(int);
+static void peer_send_file(int, int);
+static void peer_reply(int, const char *, const char *);
+static int peer_write_all(int, const void *, size_t);
+
+/*
+ * start serving the cached contents to the peers, and enable asking
+ * them.  the open function is called with a cap, and returns the
+ * descriptor of its cached contents, or -1.
+ */
+int
+peer_start(peer_open_func_t open_func)
+{
+  assert(open_func != NULL);
+
+  if (config.peer_addr == NULL) {
+    /* the peer cache is disabled. */
+    return (0);
+  }
+  if (strrchr(config.peer_addr, ':') == NULL) {
+    warnx("invalid peer address %s.", config.peer_addr);
+    return (-1);
+  }
+
+  peer_self = peer_add(config.peer_addr, strlen(config.peer_addr));
+  const char *peers = config.peers ? config.peers : "";
+  while (*peers) {
+    size_t len = strcspn(peers, ",");
+    if (len > 0 && peer_add(peers, len) == -1) {
+      break;
+    }
+    peers += len;
+    if (*peers == ',') {
+      peers++;
+    }
+  }
+  if (peer_self == -1) {
+    return (-1);
+  }
+
+  peer_ring = malloc(sizeof(peer_point_t) * peer_npeers * PEER_VNODES);
+  if (peer_ring == NULL) {
+    warn("failed to allocate memory for the peer ring.");
+    return (-1);
+  }
+  int i, j;
+  for (i = 0; i < peer_npeers; i++) {
+    for (j = 0; j < PEER_VNODES; j++) {
+      char point[MAXPATHLEN];
+      snprintf(point, sizeof(point), "%s#%d", peer_addrs[i], j);
+      peer_ring[peer_nring].hash = cacheindex_hash(point);
+      peer_ring[peer_nring].peer = i;
+      peer_nring++;
+    }
+  }
+  qsort(peer_ring, peer_nring, sizeof(peer_point_t), peer_point_compare);
+
+  peer_listen_fd = peer_listen(config.peer_addr);
+  if (peer_listen_fd == -1) {
+    warnx("failed to listen at %s.  the peers are still asked.",
+	  config.peer_addr);
+    return (-1);
+  }
+  peer_open_func = open_func;
+  peer_running = 1;
+  for (peer_nthreads = 0; peer_nthreads < PEER_SERVER_THREADS;
+       peer_nthreads++) {
+    if (pthread_create(&peer_threads[peer_nthreads], NULL, peer_main, NULL)
+	!= 0) {
+      warnx("failed to create a peer server thread.");
+      break;
+    }
+  }
+  if (peer_nthreads == 0) {
+    peer_running = 0;
+    close(peer_listen_fd);
+    peer_listen_fd = -1;
+    return (-1);
+  }
+
+  return (0);
+}
+
+int
+peer_stop(void)
+{
+  if (peer_running) {
+    peer_running = 0;
+    /* wakes up the threads blocked in accept(). */
+    shutdown(peer_listen_fd, SHUT_RDWR);
+    int i;
+    for (i = 0; i < peer_nthreads; i++) {
+      pthread_join(peer_threads[i], NULL);
+    }
+    peer_nthreads = 0;
+  }
+  if (peer_listen_fd != -1) {
+    close(peer_listen_fd);
+    peer_listen_fd = -1;
+  }
+
+  free(peer_ring);
+  peer_ring = NULL;
+  peer_nring = 0;
+  while (peer_npeers > 0) {
+    free(peer_addrs[--peer_npeers]);
+  }
+  peer_self = -1;
+
+  return (0);
+}
+
+/*
+ * get the contents of the cap from its owner peer to the local_path.
+ * returns -1 if the cap is not shared, the owner is this instance,
+ * or the peer doesn't have it.  the caller must fall back to the
+ * gateway.
+ */
+int
+peer_read_cap(const char *cap, const char *local_path)
+{
+  assert(cap != NULL);
+  assert(local_path != NULL);
+
+  int owner = peer_owner(cap);
+  if (owner == -1 || owner == peer_self) {
+    return (-1);
+  }
+  if (http_stub_read_peer(peer_addrs[owner], cap, local_path) == -1) {
+    DEBUGV("peer: %s missed at %s.\n", cap, peer_addrs[owner]);
+    return (-1);
+  }
+  if (peer_verify(cap, local_path) == -1) {
+    warnx("the contents of %s from the peer %s don't match the cap.",
+	  cap, peer_addrs[owner]);
+    unlink(local_path);
+    return (-1);
+  }
+  DEBUGV("peer: %s received from %s.\n", cap, peer_addrs[owner]);
+
+  return (0);
+}
+
+/*
+ * tell the owner of the cap that this instance has its contents.
+ */
+void
+peer_advertise(const char *cap)
+{
+  assert(cap != NULL);
+
+  int owner = peer_owner(cap);
+  if (owner == -1 || owner == peer_self) {
+    return;
+  }
+  if (http_stub_advertise_peer(peer_addrs[owner], cap,
+			       peer_addrs[peer_self]) == -1) {
+    DEBUGV("peer: failed to advertise %s to %s.\n", cap, peer_addrs[owner]);
+  }
+}
+
+/*
+ * add the peer address of the len bytes.  returns the index of the
+ * peer, or -1.
+ */
+static int
+peer_add(const char *addr, size_t len)
+{
+  assert(addr != NULL);
+
+  int i;
+  for (i = 0; i < peer_npeers; i++) {
+    if (strlen(peer_addrs[i]) == len && strncmp(peer_addrs[i], addr, len) == 0) {
+      return (i);
+    }
+  }
+  if (peer_npeers == PEER_MAX) {
+    warnx("too many peers.  up to %d are used.", PEER_MAX);
+    return (-1);
+  }
+  char *copy = malloc(len + 1);
+  if (copy == NULL) {
+    warn("failed to allocate memory for a peer address.");
+    return (-1);
+  }
+  memcpy(copy, addr, len);
+  copy[len] = '\0';
+  peer_addrs[peer_npeers] = copy;
+
+  return (peer_npeers++);
+}
+
+static int
+peer_find(const char *addr)
+{
+  assert(addr != NULL);
+
+  int i;
+  for (i = 0; i < peer_npeers; i++) {
+    if (strcmp(peer_addrs[i], addr) == 0) {
+      return (i);
+    }
+  }
+  return (-1);
+}
+
+static int
+peer_point_compare(const void *ap, const void *bp)
+{
+  const peer_point_t *a = ap, *b = bp;
+  if (a->hash != b->hash) {
+    return (a->hash < b->hash ? -1 : 1);
+  }
+  return (a->peer - b->peer);
+}
+
+/*
+ * returns the index of the peer owning the cap, the first point on the
+ * ring at or after the hash of the cap.  -1 if the cap is not shared.
+ */
+static int
+peer_owner(const char *cap)
+{
+  assert(cap != NULL);
+
+  u_int64_t size;
+  if (peer_npeers < 2 || peer_cap_size(cap, &size) == -1
+      || size <= PEER_VERIFY_SAMPLE) {
+    return (-1);
+  }
+
+  u_int64_t hash = cacheindex_hash(cap);
+  size_t low = 0, high = peer_nring;
+  while (low < high) {
+    size_t mid = (low + high) / 2;
+    if (peer_ring[mid].hash < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  if (low == peer_nring) {
+    low = 0;
+  }
+  return (peer_ring[low].peer);
+}
+
+/*
+ * get the size of the file of a CHK cap
+ * (URI:CHK:key:hash:needed:total:size).  returns -1 if the cap is not
+ * a CHK cap.
+ */
+static int
+peer_cap_size(const char *cap, u_int64_t *sizep)
+{
+  assert(cap != NULL);
+  assert(sizep != NULL);
+
+  if (strncmp(cap, PEER_CAP_PREFIX, strlen(PEER_CAP_PREFIX)) != 0) {
+    return (-1);
+  }
+  int ncolons = 0;
+  const char *p;
+  for (p = cap; *p; p++) {
+    if (*p == ':') {
+      ncolons++;
+    }
+  }
+  if (ncolons != 6) {
+    return (-1);
+  }
+  char *endp;
+  *sizep = strtoull(strrchr(cap, ':') + 1, &endp, 10);
+  if (*endp != '\0') {
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * check the contents received from a peer against the cap.  the hash
+ * in a CHK cap is of the encrypted shares, which can't be recomputed
+ * from the plaintext without encoding it again.  instead, the size in
+ * the cap is checked, which catches truncated transfers, and a range
+ * at a random offset is compared with the one read from the gateway,
+ * which catches the contents of another file.  the gateway has to
+ * decode only the segment of the range, not the whole file.
+ */
+static int
+peer_verify(const char *cap, const char *local_path)
+{
+  assert(cap != NULL);
+  assert(local_path != NULL);
+
+  u_int64_t size;
+  if (peer_cap_size(cap, &size) == -1) {
+    return (-1);
+  }
+  struct stat stbuf;
+  if (stat(local_path, &stbuf) == -1 || (u_int64_t)stbuf.st_size != size) {
+    return (-1);
+  }
+
+  /* only caps larger than the sample are shared. */
+  u_int64_t nsamples = (size + PEER_VERIFY_SAMPLE - 1) / PEER_VERIFY_SAMPLE;
+  off_t offset = (off_t)(((cacheindex_hash(cap) ^ (u_int64_t)time(NULL))
+			  % nsamples) * PEER_VERIFY_SAMPLE);
+  size_t sample_size = MIN(PEER_VERIFY_SAMPLE, size - offset);
+  char *expected = malloc(sample_size);
+  char *received = malloc(sample_size);
+  int ret = -1;
+  int fd = open(local_path, O_RDONLY);
+  if (expected && received && fd != -1
+      && http_stub_read_cap_range(cap, offset, sample_size, expected)
+      == (ssize_t)sample_size
+      && pread(fd, received, sample_size, offset) == (ssize_t)sample_size
+      && memcmp(expected, received, sample_size) == 0) {
+    ret = 0;
+  }
+  if (fd != -1) {
+    close(fd);
+  }
+  free(expected);
+  free(received);
+
+  return (ret);
+}
+
+/*
+ * listen on the address specified as the addr parameter (host:port).
+ * the cached contents are served in plaintext, so only the given
+ * host is bound.  an empty host (":port") binds all the interfaces.
+ */
+static int
+peer_listen(const char *addr)
+{
+  assert(addr != NULL);
+
+  char host[MAXPATHLEN];
+  const char *port = strrchr(addr, ':') + 1;
+  const char *hostp = addr;
+  size_t host_len = port - 1 - addr;
+  if (host_len >= 2 && addr[0] == '[' && addr[host_len - 1] == ']') {
+    /* [v6addr]:port */
+    hostp++;
+    host_len -= 2;
+  }
+  if (host_len >= sizeof(host)) {
+    warnx("too long peer address %s.", addr);
+    return (-1);
+  }
+  memcpy(host, hostp, host_len);
+  host[host_len] = '\0';
+
+  struct addrinfo hints, *res, *aip;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  int error = getaddrinfo(host[0] ? host : NULL, port, &hints, &res);
+  if (error) {
+    warnx("failed to resolve the address %s. (%s)", addr,
+	  gai_strerror(error));
+    return (-1);
+  }
+
+  int fd = -1;
+  for (aip = res; aip; aip = aip->ai_next) {
+    fd = socket(aip->ai_family, aip->ai_socktype, aip->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (bind(fd, aip->ai_addr, aip->ai_addrlen) == 0
+	&& listen(fd, SOMAXCONN) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  if (fd == -1) {
+    warn("failed to listen on %s.", addr);
+  }
+  freeaddrinfo(res);
+
+  return (fd);
+}
+
+static void *
+peer_main(void *arg)
+{
+  while (peer_running) {
+    int fd = accept(peer_listen_fd, NULL, NULL);
+    if (fd == -1) {
+      if (!peer_running) {
+	break;
+      }
+      if (errno == EINTR || errno == ECONNABORTED) {
+	continue;
+      }
+      warn("failed to accept a peer connection.");
+      break;
+    }
+
+    struct timeval timeout;
+    timeout.tv_sec = PEER_IO_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    peer_serve(fd);
+    close(fd);
+  }
+
+  return (NULL);
+}
+
+/*
+ * serve a request from a peer.  the requests are
+ *   GET /cap/<cap>[?local=1]
+ *	the contents of the cap.  unless local is set, the peer which
+ *	has advertised the cap is redirected to on a miss.
+ *   GET /have/<cap>?peer=<host:port>
+ *	the peer has the contents of the cap.
+ */
+static void
+peer_serve(int fd)
+{
+  char request[PEER_REQUEST_MAX];
+  size_t len = 0;
+  while (len < sizeof(request) - 1) {
+    ssize_t nread = recv(fd, request + len, sizeof(request) - 1 - len, 0);
+    if (nread <= 0) {
+      if (nread == -1 && errno == EINTR) {
+	continue;
+      }
+      break;
+    }
+    len += nread;
+    request[len] = '\0';
+    if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+      break;
+    }
+  }
+  request[len] = '\0';
+
+  /* only the request line is used. */
+  if (strncmp(request, "GET ", 4) != 0) {
+    peer_reply(fd, "405 Method Not Allowed", NULL);
+    return;
+  }
+  char *target = request + 4;
+  target[strcspn(target, " \r\n")] = '\0';
+  char *query = strchr(target, '?');
+  if (query) {
+    *query++ = '\0';
+  }
+
+  if (strncmp(target, "/cap/", 5) == 0) {
+    const char *cap = target + 5;
+    if (strncmp(cap, PEER_CAP_PREFIX, strlen(PEER_CAP_PREFIX)) != 0) {
+      peer_reply(fd, "404 Not Found", NULL);
+      return;
+    }
+    int object_fd = peer_open_func(cap);
+    if (object_fd != -1) {
+      peer_send_file(fd, object_fd);
+      close(object_fd);
+      return;
+    }
+    if (query && strcmp(query, "local=1") == 0) {
+      peer_reply(fd, "404 Not Found", NULL);
+      return;
+    }
+
+    u_int64_t hash = cacheindex_hash(cap);
+    pthread_mutex_lock(&peer_hint_lock);
+    peer_hint_t hint = peer_hints[hash % PEER_HINT_SIZE];
+    pthread_mutex_unlock(&peer_hint_lock);
+    if (hint.hash != hash || hint.peer == peer_self) {
+      peer_reply(fd, "404 Not Found", NULL);
+      return;
+    }
+    char location[PEER_REQUEST_MAX + MAXPATHLEN];
+    snprintf(location, sizeof(location),
+	     "Location: http://%s/cap/%s?local=1\r\n", peer_addrs[hint.peer],
+	     cap);
+    peer_reply(fd, "302 Found", location);
+    return;
+  }
+
+  if (strncmp(target, "/have/", 6) == 0) {
+    const char *cap = target + 6;
+    int peer = -1;
+    if (query && strncmp(query, "peer=", 5) == 0) {
+      peer = peer_find(query + 5);
+    }
+    if (peer == -1
+	|| strncmp(cap, PEER_CAP_PREFIX, strlen(PEER_CAP_PREFIX)) != 0) {
+      /* only the configured peers are redirected to. */
+      peer_reply(fd, "403 Forbidden", NULL);
+      return;
+    }
+    u_int64_t hash = cacheindex_hash(cap);
+    pthread_mutex_lock(&peer_hint_lock);
+    peer_hints[hash % PEER_HINT_SIZE].hash = hash;
+    peer_hints[hash % PEER_HINT_SIZE].peer = peer;
+    pthread_mutex_unlock(&peer_hint_lock);
+    peer_reply(fd, "200 OK", NULL);
+    return;
+  }
+
+  peer_reply(fd, "404 Not Found", NULL);
+}
+
+static void
+peer_send_file(int fd, int object_fd)
+{
+  struct stat stbuf;
+  if (fstat(object_fd, &stbuf) == -1) {
+    peer_reply(fd, "500 Internal Server Error", NULL);
+    return;
+  }
+
+  char header[256];
+  int header_len = snprintf(header, sizeof(header),
+			    "HTTP/1.0 200 OK\r\n"
+			    "Content-Type: application/octet-stream\r\n"
+			    "Content-Length: %llu\r\n"
+			    "Connection: close\r\n"
+			    "\r\n", (unsigned long long)stbuf.st_size);
+  if (peer_write_all(fd, header, header_len) == -1) {
+    return;
+  }
+
+  char buf[65536];
+  off_t left = stbuf.st_size;
+  while (left > 0) {
+    ssize_t nread = read(object_fd, buf,
+			 left < (off_t)sizeof(buf) ? (size_t)left : sizeof(buf));
+    if (nread == -1 && errno == EINTR) {
+      continue;
+    }
+    if (nread <= 0) {
+      /* the peer sees the short body and discards it. */
+      warn("failed to read a cached object to serve.");
+      return;
+    }
+    if (peer_write_all(fd, buf, nread) == -1) {
+      return;
+    }
+    left -= nread;
+  }
+}
+
+static void
+peer_reply(int fd, const char *status, const char *headers)
+{
+  assert(status != NULL);
+
+  char reply[PEER_REQUEST_MAX + MAXPATHLEN + 128];
+  int len = snprintf(reply, sizeof(reply),
+		     "HTTP/1.0 %s\r\n"
+		     "%s"
+		     "Content-Length: 0\r\n"
+		     "Connection: close\r\n"
+		     "\r\n", status, headers ? headers : "");
+  if (len >= (int)sizeof(reply)) {
+    len = sizeof(reply) - 1;
+  }
+  peer_write_all(fd, reply, len);
+}
+
+static int
+peer_write_all(int fd, const void *buf, size_t len)
+{
+  const char *p = buf;
+  while (len > 0) {
+    ssize_t nwritten = send(fd, p, len, MSG_NOSIGNAL);
+    if (nwritten == -1) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return (-1);
+    }
+    p += nwritten;
+    len -= nwritten;
+  }
+  return (0);
+}
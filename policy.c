@@ -0,0 +1,454 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "policy.h"
+
+/*
+ * the cache policies are assigned by path prefixes.  the longest
+ * prefix matching a path decides its policy, and a path without any
+ * matching prefix is POLICY_NORMAL.  the rules are read from
+ * config.policy_file, one "policy prefix" pair per line, and the file
+ * is read again when it is modified.  the rules set by policy_set()
+ * at runtime take precedence over the file.
+ *
+ * the policy thread warms up the pinned prefixes when the rules
+ * change, and every config.pin_interval seconds to pick up the files
+ * added remotely.
+ */
+typedef struct policy_rule {
+  char *prefix;
+  size_t prefix_len;
+  int policy;
+  int runtime;	/* set by policy_set(). */
+} policy_rule_t;
+
+static policy_rule_t *policy_rules = NULL;
+static size_t policy_nrules = 0;
+static size_t policy_rules_size = 0;
+static unsigned int policy_generation = 0;
+static time_t policy_file_mtime = 0;
+static pthread_mutex_t policy_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t policy_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t policy_thread;
+static int policy_running = 0;
+static policy_warm_func_t policy_warm_func = NULL;
+static policy_change_func_t policy_change_func = NULL;
+
+static void *policy_main(void *);
+static int policy_reload(void);
+static int policy_add_rule(const char *, int, int);
+static void policy_remove_file_rules(void);
+static policy_rule_t *policy_find_rule(const char *, size_t);
+static size_t policy_normalize(const char *);
+
+/*
+ * read the policy file and start the policy thread.  the warm
+ * function is called with each pinned prefix, and the change
+ * function is called before the warm-up when the rules have changed.
+ */
+int
+policy_start(policy_warm_func_t warm_func, policy_change_func_t change_func)
+{
+  assert(warm_func != NULL);
+
+  pthread_mutex_lock(&policy_lock);
+  policy_warm_func = warm_func;
+  policy_change_func = change_func;
+  pthread_mutex_unlock(&policy_lock);
+
+  if (config.policy_file && policy_reload() == -1) {
+    warnx("failed to read the policy file %s.", config.policy_file);
+  }
+
+  pthread_mutex_lock(&policy_lock);
+  policy_running = 1;
+  if (pthread_create(&policy_thread, NULL, policy_main, NULL) != 0) {
+    warnx("failed to create the policy thread.");
+    policy_running = 0;
+    pthread_mutex_unlock(&policy_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&policy_lock);
+
+  return (0);
+}
+
+int
+policy_stop(void)
+{
+  pthread_mutex_lock(&policy_lock);
+  if (policy_running) {
+    policy_running = 0;
+    pthread_cond_signal(&policy_cond);
+    pthread_mutex_unlock(&policy_lock);
+    pthread_join(policy_thread, NULL);
+    pthread_mutex_lock(&policy_lock);
+  }
+
+  size_t i;
+  for (i = 0; i < policy_nrules; i++) {
+    free(policy_rules[i].prefix);
+  }
+  free(policy_rules);
+  policy_rules = NULL;
+  policy_nrules = 0;
+  policy_rules_size = 0;
+  pthread_mutex_unlock(&policy_lock);
+
+  return (0);
+}
+
+/*
+ * returns the policy of the path specified as the path parameter.
+ */
+int
+policy_lookup(const char *path)
+{
+  assert(path != NULL);
+
+  size_t path_len = strlen(path);
+  int policy = POLICY_NORMAL;
+  size_t best_len = 0;
+  int best_runtime = 0;
+  pthread_mutex_lock(&policy_lock);
+  size_t i;
+  for (i = 0; i < policy_nrules; i++) {
+    policy_rule_t *rulep = &policy_rules[i];
+    size_t len = rulep->prefix_len;
+    if (len > path_len || strncmp(rulep->prefix, path, len) != 0) {
+      continue;
+    }
+    /* the prefix must end at a component boundary. */
+    if (len > 1 && path[len] != '\0' && path[len] != '/') {
+      continue;
+    }
+    if (len > best_len
+	|| (len == best_len && rulep->runtime && !best_runtime)) {
+      policy = rulep->policy;
+      best_len = len;
+      best_runtime = rulep->runtime;
+    }
+  }
+  pthread_mutex_unlock(&policy_lock);
+
+  return (policy);
+}
+
+/*
+ * set the policy of the prefix specified as the prefix parameter at
+ * runtime.  it is applied in background.
+ */
+int
+policy_set(const char *prefix, int policy)
+{
+  assert(prefix != NULL);
+
+  if (policy != POLICY_NORMAL && policy != POLICY_PIN
+      && policy != POLICY_NOCACHE) {
+    return (-1);
+  }
+
+  pthread_mutex_lock(&policy_lock);
+  int ret = policy_add_rule(prefix, policy, 1);
+  if (ret == 0) {
+    policy_generation++;
+    pthread_cond_signal(&policy_cond);
+  }
+  pthread_mutex_unlock(&policy_lock);
+
+  return (ret);
+}
+
+int
+policy_from_name(const char *name)
+{
+  assert(name != NULL);
+
+  if (strcmp(name, "normal") == 0) {
+    return (POLICY_NORMAL);
+  } else if (strcmp(name, "pin") == 0) {
+    return (POLICY_PIN);
+  } else if (strcmp(name, "nocache") == 0) {
+    return (POLICY_NOCACHE);
+  }
+  return (-1);
+}
+
+const char *
+policy_to_name(int policy)
+{
+  switch (policy) {
+  case POLICY_PIN:
+    return ("pin");
+  case POLICY_NOCACHE:
+    return ("nocache");
+  default:
+    return ("normal");
+  }
+}
+
+static void *
+policy_main(void *arg)
+{
+  unsigned int warmed_generation = 0;
+  time_t warmed = 0;
+
+  pthread_mutex_lock(&policy_lock);
+  while (policy_running) {
+    pthread_mutex_unlock(&policy_lock);
+    if (config.policy_file && policy_reload() == -1) {
+      warnx("failed to read the policy file %s.", config.policy_file);
+    }
+    pthread_mutex_lock(&policy_lock);
+
+    time_t now = time(NULL);
+    int changed = (policy_generation != warmed_generation);
+    if (changed
+	|| (config.pin_interval > 0 && now >= warmed + config.pin_interval)) {
+      /* copy the pinned prefixes not to call out with the lock. */
+      char **prefixes = calloc(policy_nrules + 1, sizeof(char *));
+      size_t nprefixes = 0;
+      size_t i;
+      for (i = 0; prefixes && i < policy_nrules; i++) {
+	if (policy_rules[i].policy == POLICY_PIN
+	    && (prefixes[nprefixes] = strdup(policy_rules[i].prefix))) {
+	  nprefixes++;
+	}
+      }
+      warmed_generation = policy_generation;
+      warmed = now;
+      pthread_mutex_unlock(&policy_lock);
+
+      if (changed && policy_change_func) {
+	policy_change_func();
+      }
+      for (i = 0; i < nprefixes; i++) {
+	DEBUGV("policy: warming up the pinned %s.\n", prefixes[i]);
+	if (policy_warm_func(prefixes[i]) != 0) {
+	  warnx("failed to warm up %s.", prefixes[i]);
+	}
+	free(prefixes[i]);
+      }
+      free(prefixes);
+
+      pthread_mutex_lock(&policy_lock);
+      continue;
+    }
+
+    /* the file is checked for modification at least once a minute. */
+    struct timespec until;
+    until.tv_sec = now + 60;
+    if (config.pin_interval > 0
+	&& warmed + config.pin_interval < until.tv_sec) {
+      until.tv_sec = warmed + config.pin_interval;
+    }
+    until.tv_nsec = 0;
+    pthread_cond_timedwait(&policy_cond, &policy_lock, &until);
+  }
+  pthread_mutex_unlock(&policy_lock);
+
+  return (NULL);
+}
+
+/*
+ * read config.policy_file again if it has been modified.  the rules
+ * of the file are replaced as a whole.
+ */
+static int
+policy_reload(void)
+{
+  struct stat stbuf;
+  if (stat(config.policy_file, &stbuf) == -1) {
+    return (-1);
+  }
+  pthread_mutex_lock(&policy_lock);
+  int modified = (stbuf.st_mtime != policy_file_mtime);
+  pthread_mutex_unlock(&policy_lock);
+  if (!modified) {
+    return (0);
+  }
+
+  FILE *fp = fopen(config.policy_file, "r");
+  if (fp == NULL) {
+    warn("failed to open %s.", config.policy_file);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&policy_lock);
+  policy_remove_file_rules();
+  char line[MAXPATHLEN + 32];
+  int lineno = 0;
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    lineno++;
+    char *name = line;
+    while (isspace((unsigned char)*name)) {
+      name++;
+    }
+    if (*name == '\0' || *name == '#') {
+      continue;
+    }
+    char *prefix = name;
+    while (*prefix && !isspace((unsigned char)*prefix)) {
+      prefix++;
+    }
+    if (*prefix) {
+      *prefix++ = '\0';
+    }
+    while (isspace((unsigned char)*prefix)) {
+      prefix++;
+    }
+    char *end = prefix + strlen(prefix);
+    while (end > prefix && isspace((unsigned char)end[-1])) {
+      *--end = '\0';
+    }
+
+    int policy = policy_from_name(name);
+    if (policy == -1 || prefix[0] != '/') {
+      warnx("%s:%d: invalid policy line.", config.policy_file, lineno);
+      continue;
+    }
+    policy_add_rule(prefix, policy, 0);
+  }
+  fclose(fp);
+  policy_file_mtime = stbuf.st_mtime;
+  policy_generation++;
+  pthread_mutex_unlock(&policy_lock);
+
+  return (0);
+}
+
+/*
+ * add a rule, or replace the rule of the same prefix.  a rule of the
+ * file doesn't replace a runtime rule.  the caller must hold
+ * policy_lock.
+ */
+static int
+policy_add_rule(const char *prefix, int policy, int runtime)
+{
+  assert(prefix != NULL);
+
+  size_t prefix_len = policy_normalize(prefix);
+  policy_rule_t *rulep = policy_find_rule(prefix, prefix_len);
+  if (rulep) {
+    if (rulep->runtime && !runtime) {
+      return (0);
+    }
+    rulep->policy = policy;
+    rulep->runtime = runtime;
+    return (0);
+  }
+
+  if (policy_nrules == policy_rules_size) {
+    size_t size = policy_rules_size ? policy_rules_size * 2 : 16;
+    policy_rule_t *rules = realloc(policy_rules, size * sizeof(policy_rule_t));
+    if (rules == NULL) {
+      warn("failed to allocate memory for policy rules.");
+      return (-1);
+    }
+    policy_rules = rules;
+    policy_rules_size = size;
+  }
+  rulep = &policy_rules[policy_nrules];
+  rulep->prefix = malloc(prefix_len + 1);
+  if (rulep->prefix == NULL) {
+    warn("failed to duplicate a string (%s).", prefix);
+    return (-1);
+  }
+  memcpy(rulep->prefix, prefix, prefix_len);
+  rulep->prefix[prefix_len] = '\0';
+  rulep->prefix_len = prefix_len;
+  rulep->policy = policy;
+  rulep->runtime = runtime;
+  policy_nrules++;
+
+  return (0);
+}
+
+/*
+ * remove the rules read from the file.  the caller must hold
+ * policy_lock.
+ */
+static void
+policy_remove_file_rules(void)
+{
+  size_t i, j;
+  for (i = j = 0; i < policy_nrules; i++) {
+    if (!policy_rules[i].runtime) {
+      free(policy_rules[i].prefix);
+    } else {
+      policy_rules[j++] = policy_rules[i];
+    }
+  }
+  policy_nrules = j;
+}
+
+static policy_rule_t *
+policy_find_rule(const char *prefix, size_t prefix_len)
+{
+  assert(prefix != NULL);
+
+  size_t i;
+  for (i = 0; i < policy_nrules; i++) {
+    if (policy_rules[i].prefix_len == prefix_len
+	&& strncmp(policy_rules[i].prefix, prefix, prefix_len) == 0) {
+      return (&policy_rules[i]);
+    }
+  }
+  return (NULL);
+}
+
+/*
+ * returns the length of the prefix without trailing slashes, except
+ * for the root.
+ */
+static size_t
+policy_normalize(const char *prefix)
+{
+  assert(prefix != NULL);
+
+  size_t len = strlen(prefix);
+  while (len > 1 && prefix[len - 1] == '/') {
+    len--;
+  }
+  return (len);
+}
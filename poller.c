@@ -0,0 +1,460 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "poller.h"
+
+#define POLLER_NBUCKETS 256
+#define POLLER_MAX_WATCHES 1024
+#define POLLER_WATCH_TTL 600	/* unused watches are dropped after this. */
+
+/*
+ * the poller periodically re-reads the listings of recently used
+ * directories, compares them with the previous listings, and tells
+ * the notify function which children were changed remotely.
+ */
+typedef struct poller_child {
+  char *name;
+  unsigned int signature;	/* a hash of the JSON info of the child. */
+} poller_child_t;
+
+struct poller_listing {
+  poller_child_t *children;
+  size_t nchildren;
+  size_t size;
+};
+
+typedef struct poller_watch {
+  struct poller_watch *next;
+  char *path;
+  unsigned int hash;
+  time_t used;
+  poller_listing_t *snapshot;
+} poller_watch_t;
+
+static poller_watch_t *poller_buckets[POLLER_NBUCKETS];
+static size_t poller_nwatches = 0;
+static pthread_mutex_t poller_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t poller_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t poller_thread;
+static int poller_running = 0;
+static poller_fetch_func_t poller_fetch_func = NULL;
+static poller_notify_func_t poller_notify_func = NULL;
+
+static unsigned int poller_hash(const char *);
+static poller_watch_t *poller_find(const char *, unsigned int);
+static void poller_unwatch(poller_watch_t *);
+static void *poller_main(void *);
+static void poller_poll(const char *);
+static poller_listing_t *poller_listing_new(void);
+static void poller_listing_free(poller_listing_t *);
+static int poller_child_compare(const void *, const void *);
+
+int
+poller_start(poller_fetch_func_t fetch_func, poller_notify_func_t notify_func)
+{
+  assert(fetch_func != NULL);
+  assert(notify_func != NULL);
+
+  if (config.poll_interval <= 0) {
+    /* polling is disabled. */
+    return (0);
+  }
+
+  pthread_mutex_lock(&poller_lock);
+  poller_fetch_func = fetch_func;
+  poller_notify_func = notify_func;
+  poller_running = 1;
+  if (pthread_create(&poller_thread, NULL, poller_main, NULL) != 0) {
+    warnx("failed to create the poller thread.");
+    poller_running = 0;
+    pthread_mutex_unlock(&poller_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&poller_lock);
+
+  return (0);
+}
+
+int
+poller_stop(void)
+{
+  pthread_mutex_lock(&poller_lock);
+  if (poller_running) {
+    poller_running = 0;
+    pthread_cond_signal(&poller_cond);
+    pthread_mutex_unlock(&poller_lock);
+    pthread_join(poller_thread, NULL);
+    pthread_mutex_lock(&poller_lock);
+  }
+
+  int i;
+  for (i = 0; i < POLLER_NBUCKETS; i++) {
+    while (poller_buckets[i]) {
+      poller_unwatch(poller_buckets[i]);
+    }
+  }
+  pthread_mutex_unlock(&poller_lock);
+
+  return (0);
+}
+
+/*
+ * mark the directory specified as the path parameter as recently
+ * used.  the directory will be polled until it is not used for
+ * POLLER_WATCH_TTL seconds.
+ */
+void
+poller_watch(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&poller_lock);
+  if (!poller_running) {
+    pthread_mutex_unlock(&poller_lock);
+    return;
+  }
+
+  unsigned int hash = poller_hash(path);
+  poller_watch_t *watchp = poller_find(path, hash);
+  if (watchp == NULL) {
+    if (poller_nwatches >= POLLER_MAX_WATCHES) {
+      pthread_mutex_unlock(&poller_lock);
+      return;
+    }
+    watchp = calloc(1, sizeof(poller_watch_t));
+    if (watchp == NULL) {
+      warn("failed to allocate memory for a watch of %s.", path);
+      pthread_mutex_unlock(&poller_lock);
+      return;
+    }
+    watchp->path = strdup(path);
+    if (watchp->path == NULL) {
+      warn("failed to duplicate a string (%s).", path);
+      free(watchp);
+      pthread_mutex_unlock(&poller_lock);
+      return;
+    }
+    watchp->hash = hash;
+    watchp->next = poller_buckets[hash % POLLER_NBUCKETS];
+    poller_buckets[hash % POLLER_NBUCKETS] = watchp;
+    poller_nwatches++;
+  }
+  watchp->used = time(NULL);
+  pthread_mutex_unlock(&poller_lock);
+}
+
+/*
+ * same as poller_watch(), but watches the parent directory of the
+ * node specified as the path parameter.
+ */
+void
+poller_watch_parent(const char *path)
+{
+  assert(path != NULL);
+
+  const char *slash = strrchr(path, '/');
+  if (slash == NULL || slash[1] == '\0') {
+    return;
+  }
+  char parent_path[MAXPATHLEN];
+  size_t parent_len = slash - path;
+  if (parent_len == 0) {
+    /* this means the root directory. */
+    parent_len = 1;
+  }
+  if (parent_len >= sizeof(parent_path)) {
+    return;
+  }
+  memcpy(parent_path, path, parent_len);
+  parent_path[parent_len] = '\0';
+
+  poller_watch(parent_path);
+}
+
+/*
+ * add a child to the listing.  this is called by the fetch function
+ * for each child of the polled directory.
+ */
+int
+poller_listing_add(poller_listing_t *listingp, const char *name,
+		   const char *infop)
+{
+  assert(listingp != NULL);
+  assert(name != NULL);
+  assert(infop != NULL);
+
+  if (listingp->nchildren == listingp->size) {
+    size_t new_size = listingp->size ? listingp->size * 2 : 16;
+    poller_child_t *new_children = realloc(listingp->children,
+					   new_size * sizeof(poller_child_t));
+    if (new_children == NULL) {
+      warn("failed to enlarge a listing.");
+      return (-1);
+    }
+    listingp->children = new_children;
+    listingp->size = new_size;
+  }
+
+  poller_child_t *childp = &listingp->children[listingp->nchildren];
+  childp->name = strdup(name);
+  if (childp->name == NULL) {
+    warn("failed to duplicate a string (%s).", name);
+    return (-1);
+  }
+  childp->signature = poller_hash(infop);
+  listingp->nchildren++;
+
+  return (0);
+}
+
+static unsigned int
+poller_hash(const char *s)
+{
+  assert(s != NULL);
+
+  /* FNV-1a */
+  unsigned int hash = 2166136261U;
+  while (*s) {
+    hash ^= (unsigned char)*s++;
+    hash *= 16777619U;
+  }
+  return (hash);
+}
+
+static poller_watch_t *
+poller_find(const char *path, unsigned int hash)
+{
+  assert(path != NULL);
+
+  poller_watch_t *watchp = poller_buckets[hash % POLLER_NBUCKETS];
+  while (watchp) {
+    if (watchp->hash == hash && strcmp(watchp->path, path) == 0) {
+      return (watchp);
+    }
+    watchp = watchp->next;
+  }
+  return (NULL);
+}
+
+static void
+poller_unwatch(poller_watch_t *watchp)
+{
+  assert(watchp != NULL);
+
+  poller_watch_t **prevpp = &poller_buckets[watchp->hash % POLLER_NBUCKETS];
+  while (*prevpp) {
+    if (*prevpp == watchp) {
+      *prevpp = watchp->next;
+      poller_nwatches--;
+      break;
+    }
+    prevpp = &(*prevpp)->next;
+  }
+  if (watchp->snapshot) {
+    poller_listing_free(watchp->snapshot);
+  }
+  free(watchp->path);
+  free(watchp);
+}
+
+/*
+ * the main loop of the poller thread.
+ */
+static void *
+poller_main(void *arg)
+{
+  pthread_mutex_lock(&poller_lock);
+  while (poller_running) {
+    struct timespec wakeup;
+    wakeup.tv_sec = time(NULL) + config.poll_interval;
+    wakeup.tv_nsec = 0;
+    pthread_cond_timedwait(&poller_cond, &poller_lock, &wakeup);
+    if (!poller_running) {
+      break;
+    }
+
+    /* collect the watched directories, and drop unused ones. */
+    time_t now = time(NULL);
+    char **paths = calloc(poller_nwatches + 1, sizeof(char *));
+    if (paths == NULL) {
+      warn("failed to allocate memory for the poller.");
+      continue;
+    }
+    size_t npaths = 0;
+    int i;
+    for (i = 0; i < POLLER_NBUCKETS; i++) {
+      poller_watch_t *watchp = poller_buckets[i];
+      while (watchp) {
+	poller_watch_t *nextp = watchp->next;
+	if (watchp->used + POLLER_WATCH_TTL < now) {
+	  poller_unwatch(watchp);
+	} else if ((paths[npaths] = strdup(watchp->path)) != NULL) {
+	  npaths++;
+	}
+	watchp = nextp;
+      }
+    }
+    pthread_mutex_unlock(&poller_lock);
+
+    size_t j;
+    for (j = 0; j < npaths; j++) {
+      poller_poll(paths[j]);
+      free(paths[j]);
+    }
+    free(paths);
+
+    pthread_mutex_lock(&poller_lock);
+  }
+  pthread_mutex_unlock(&poller_lock);
+
+  return (NULL);
+}
+
+/*
+ * poll one directory and notify the differences from the previous
+ * listing.
+ */
+static void
+poller_poll(const char *path)
+{
+  assert(path != NULL);
+
+  poller_listing_t *listingp = poller_listing_new();
+  if (listingp == NULL) {
+    return;
+  }
+  int ret = poller_fetch_func(path, listingp);
+  if (ret == -1) {
+    /* keep the previous snapshot and retry next time. */
+    warnx("failed to poll %s.", path);
+    poller_listing_free(listingp);
+    return;
+  }
+  qsort(listingp->children, listingp->nchildren, sizeof(poller_child_t),
+	poller_child_compare);
+
+  pthread_mutex_lock(&poller_lock);
+  poller_watch_t *watchp = poller_find(path, poller_hash(path));
+  if (watchp == NULL || ret == POLLER_FETCH_IMMUTABLE) {
+    /* unwatched meanwhile, or it will never change. */
+    if (watchp) {
+      poller_unwatch(watchp);
+    }
+    pthread_mutex_unlock(&poller_lock);
+    poller_listing_free(listingp);
+    return;
+  }
+  poller_listing_t *oldp = watchp->snapshot;
+  watchp->snapshot = listingp;
+  pthread_mutex_unlock(&poller_lock);
+
+  if (oldp == NULL) {
+    /* the first poll.  nothing to compare. */
+    return;
+  }
+
+  /* both listings are sorted by name.  merge them to find changes. */
+  int changed = 0;
+  size_t i = 0, j = 0;
+  while (i < oldp->nchildren || j < listingp->nchildren) {
+    int cmp;
+    if (i == oldp->nchildren) {
+      cmp = 1;
+    } else if (j == listingp->nchildren) {
+      cmp = -1;
+    } else {
+      cmp = strcmp(oldp->children[i].name, listingp->children[j].name);
+    }
+    if (cmp < 0) {
+      /* removed. */
+      DEBUGV("%s/%s was removed remotely.\n", path, oldp->children[i].name);
+      poller_notify_func(path, oldp->children[i].name);
+      changed = 1;
+      i++;
+    } else if (cmp > 0) {
+      /* added. */
+      DEBUGV("%s/%s was added remotely.\n", path, listingp->children[j].name);
+      poller_notify_func(path, listingp->children[j].name);
+      changed = 1;
+      j++;
+    } else {
+      if (oldp->children[i].signature != listingp->children[j].signature) {
+	DEBUGV("%s/%s was modified remotely.\n", path,
+	       listingp->children[j].name);
+	poller_notify_func(path, listingp->children[j].name);
+	changed = 1;
+      }
+      i++;
+      j++;
+    }
+  }
+  if (changed) {
+    /* the directory itself has changed too. */
+    poller_notify_func(path, NULL);
+  }
+
+  poller_listing_free(oldp);
+}
+
+static poller_listing_t *
+poller_listing_new(void)
+{
+  poller_listing_t *listingp = calloc(1, sizeof(poller_listing_t));
+  if (listingp == NULL) {
+    warn("failed to allocate memory for a listing.");
+    return (NULL);
+  }
+  return (listingp);
+}
+
+static void
+poller_listing_free(poller_listing_t *listingp)
+{
+  assert(listingp != NULL);
+
+  size_t i;
+  for (i = 0; i < listingp->nchildren; i++) {
+    free(listingp->children[i].name);
+  }
+  free(listingp->children);
+  free(listingp);
+}
+
+static int
+poller_child_compare(const void *ap, const void *bp)
+{
+  return (strcmp(((const poller_child_t *)ap)->name,
+		 ((const poller_child_t *)bp)->name));
+}
@@ -0,0 +1,212 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 500
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "prefetch.h"
+
+#define PREFETCH_MAX_THREADS 64
+#define PREFETCH_QUEUE_MAX 4096
+
+/*
+ * the prefetcher runs background jobs (fetching listings, caching
+ * contents, ...) with a fixed number of worker threads.  the queue is
+ * bounded.  when it is full, prefetch_enqueue() fails and the caller
+ * decides whether to do the job by itself or to drop it.
+ */
+typedef struct prefetch_job {
+  struct prefetch_job *next;
+  int type;
+  char *path;
+  int arg;
+} prefetch_job_t;
+
+static prefetch_job_t *prefetch_head = NULL;
+static prefetch_job_t *prefetch_tail = NULL;
+static size_t prefetch_njobs = 0;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t prefetch_threads[PREFETCH_MAX_THREADS];
+static int prefetch_nthreads = 0;
+static int prefetch_running = 0;
+static prefetch_func_t prefetch_func = NULL;
+
+static void *prefetch_main(void *);
+
+int
+prefetch_start(prefetch_func_t func)
+{
+  assert(func != NULL);
+
+  if (config.prefetch_threads <= 0) {
+    /* prefetching is disabled. */
+    return (0);
+  }
+
+  pthread_mutex_lock(&prefetch_lock);
+  prefetch_func = func;
+  prefetch_running = 1;
+  int nthreads = config.prefetch_threads;
+  if (nthreads > PREFETCH_MAX_THREADS) {
+    nthreads = PREFETCH_MAX_THREADS;
+  }
+  for (prefetch_nthreads = 0; prefetch_nthreads < nthreads;
+       prefetch_nthreads++) {
+    if (pthread_create(&prefetch_threads[prefetch_nthreads], NULL,
+		       prefetch_main, NULL) != 0) {
+      warnx("failed to create a prefetch thread.");
+      break;
+    }
+  }
+  if (prefetch_nthreads == 0) {
+    prefetch_running = 0;
+    pthread_mutex_unlock(&prefetch_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+
+  return (0);
+}
+
+int
+prefetch_stop(void)
+{
+  pthread_mutex_lock(&prefetch_lock);
+  if (!prefetch_running) {
+    pthread_mutex_unlock(&prefetch_lock);
+    return (0);
+  }
+  prefetch_running = 0;
+  pthread_cond_broadcast(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+
+  int i;
+  for (i = 0; i < prefetch_nthreads; i++) {
+    pthread_join(prefetch_threads[i], NULL);
+  }
+  prefetch_nthreads = 0;
+
+  /* drop the jobs not yet done. */
+  pthread_mutex_lock(&prefetch_lock);
+  while (prefetch_head) {
+    prefetch_job_t *jobp = prefetch_head;
+    prefetch_head = jobp->next;
+    free(jobp->path);
+    free(jobp);
+  }
+  prefetch_tail = NULL;
+  prefetch_njobs = 0;
+  pthread_mutex_unlock(&prefetch_lock);
+
+  return (0);
+}
+
+/*
+ * queue a job of the type for the path.  the arg parameter is passed
+ * to the job function as is.  returns -1 if prefetching is disabled
+ * or the queue is full.
+ */
+int
+prefetch_enqueue(int type, const char *path, int arg)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&prefetch_lock);
+  if (!prefetch_running || prefetch_njobs >= PREFETCH_QUEUE_MAX) {
+    pthread_mutex_unlock(&prefetch_lock);
+    return (-1);
+  }
+
+  prefetch_job_t *jobp = malloc(sizeof(prefetch_job_t));
+  if (jobp == NULL) {
+    warn("failed to allocate memory for a prefetch job.");
+    pthread_mutex_unlock(&prefetch_lock);
+    return (-1);
+  }
+  jobp->next = NULL;
+  jobp->type = type;
+  jobp->arg = arg;
+  jobp->path = strdup(path);
+  if (jobp->path == NULL) {
+    warn("failed to duplicate a string (%s).", path);
+    free(jobp);
+    pthread_mutex_unlock(&prefetch_lock);
+    return (-1);
+  }
+  if (prefetch_tail) {
+    prefetch_tail->next = jobp;
+  } else {
+    prefetch_head = jobp;
+  }
+  prefetch_tail = jobp;
+  prefetch_njobs++;
+  pthread_cond_signal(&prefetch_cond);
+  pthread_mutex_unlock(&prefetch_lock);
+
+  return (0);
+}
+
+static void *
+prefetch_main(void *arg)
+{
+  pthread_mutex_lock(&prefetch_lock);
+  while (prefetch_running) {
+    if (prefetch_head == NULL) {
+      pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+      continue;
+    }
+
+    prefetch_job_t *jobp = prefetch_head;
+    prefetch_head = jobp->next;
+    if (prefetch_head == NULL) {
+      prefetch_tail = NULL;
+    }
+    prefetch_njobs--;
+    pthread_mutex_unlock(&prefetch_lock);
+
+    DEBUGV("prefetch: job %d for %s.\n", jobp->type, jobp->path);
+    if (prefetch_func(jobp->type, jobp->path, jobp->arg) == -1) {
+      warnx("prefetch job %d for %s failed.", jobp->type, jobp->path);
+    }
+    free(jobp->path);
+    free(jobp);
+
+    pthread_mutex_lock(&prefetch_lock);
+  }
+  pthread_mutex_unlock(&prefetch_lock);
+
+  return (NULL);
+}
@@ -0,0 +1,400 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "reaper.h"
+
+/*
+ * the reaper removes invalidated cache subtrees in the background.
+ * reaper_trash() just renames a subtree into the trash directory,
+ * which is O(1) however large the subtree is, and the reaper thread
+ * deletes it later.  the original path of the subtree is recorded in
+ * the REAPER_ORIGIN_ATTR xattr of the trashed node, and the forget
+ * function is called with the original path of each deleted node.
+ * anything left in the trash when the process stops is deleted when
+ * the reaper starts next time.
+ */
+#define REAPER_ORIGIN_ATTR "user.net.iijlab.tahoefs.origin"
+
+/*
+ * the reaper yields the disk to the foreground every REAPER_BATCH
+ * removals by sleeping REAPER_PAUSE_NSEC.
+ */
+#define REAPER_BATCH 256
+#define REAPER_PAUSE_NSEC 10000000	/* 10ms */
+
+static char reaper_trash_dir[MAXPATHLEN];
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reaper_thread;
+static int reaper_running = 0;
+static int reaper_pending = 0;
+static unsigned int reaper_serial = 0;
+static size_t reaper_nremoved = 0;
+static reaper_forget_func_t reaper_forget_func = NULL;
+
+static void *reaper_main(void *);
+static void reaper_empty_trash(void);
+static int reaper_remove_at(int, const char *, char *, int);
+static void reaper_forget(const char *);
+static void reaper_pause(void);
+
+/*
+ * create the trash directory specified as the trash_dir parameter and
+ * start the reaper thread.  the trash is usable even if the thread
+ * cannot be started.
+ */
+int
+reaper_start(const char *trash_dir, reaper_forget_func_t forget_func)
+{
+  assert(trash_dir != NULL);
+
+  if (strlen(trash_dir) >= sizeof(reaper_trash_dir)) {
+    warnx("too long trash directory name %s.", trash_dir);
+    return (-1);
+  }
+  /* reaper_remove() forgets the nodes even without the trash. */
+  pthread_mutex_lock(&reaper_lock);
+  reaper_forget_func = forget_func;
+  pthread_mutex_unlock(&reaper_lock);
+  if (mkdir(trash_dir, S_IRWXU) == -1 && errno != EEXIST) {
+    warn("failed to create the trash directory %s.", trash_dir);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&reaper_lock);
+  strcpy(reaper_trash_dir, trash_dir);
+  /* clean up what the previous run has left. */
+  reaper_pending = 1;
+  reaper_running = 1;
+  if (pthread_create(&reaper_thread, NULL, reaper_main, NULL) != 0) {
+    warnx("failed to create the reaper thread.");
+    reaper_running = 0;
+    pthread_mutex_unlock(&reaper_lock);
+    return (-1);
+  }
+  pthread_mutex_unlock(&reaper_lock);
+
+  return (0);
+}
+
+/*
+ * stop the reaper thread.  the trash being deleted is left as it is.
+ */
+int
+reaper_stop(void)
+{
+  pthread_mutex_lock(&reaper_lock);
+  if (reaper_running) {
+    reaper_running = 0;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+    pthread_join(reaper_thread, NULL);
+    pthread_mutex_lock(&reaper_lock);
+  }
+  reaper_trash_dir[0] = '\0';
+  pthread_mutex_unlock(&reaper_lock);
+
+  return (0);
+}
+
+/*
+ * move the file or directory specified as the node_path parameter
+ * into the trash.  the origin parameter is the path passed to the
+ * forget function when the node is deleted, or NULL.  the trash must
+ * be on the same file system as the node.  if the trash is not
+ * available, -1 is returned with errno set to EAGAIN, and the caller
+ * should remove the node by reaper_remove().
+ */
+int
+reaper_trash(const char *node_path, const char *origin)
+{
+  assert(node_path != NULL);
+
+  char trash_path[MAXPATHLEN];
+  pthread_mutex_lock(&reaper_lock);
+  if (reaper_trash_dir[0] == '\0') {
+    pthread_mutex_unlock(&reaper_lock);
+    errno = EAGAIN;
+    return (-1);
+  }
+  /* the time and the pid keep the names unique across restarts. */
+  snprintf(trash_path, sizeof(trash_path), "%s/%lx.%lx.%x",
+	   reaper_trash_dir, (unsigned long)time(NULL),
+	   (unsigned long)getpid(), reaper_serial++);
+  pthread_mutex_unlock(&reaper_lock);
+
+  if (rename(node_path, trash_path) == -1) {
+    if (errno != ENOENT) {
+      warn("failed to move %s to the trash.", node_path);
+    }
+    return (-1);
+  }
+  if (origin
+      && setxattr(trash_path, REAPER_ORIGIN_ATTR, origin, strlen(origin), 0
+#if defined(__APPLE__)
+		  , 0
+#endif
+		  ) == -1) {
+    /* it is just deleted without being forgotten. */
+    warn("failed to record the origin of %s.", trash_path);
+  }
+
+  pthread_mutex_lock(&reaper_lock);
+  reaper_pending = 1;
+  pthread_cond_signal(&reaper_cond);
+  pthread_mutex_unlock(&reaper_lock);
+
+  return (0);
+}
+
+/*
+ * remove the file or directory specified as the node_path parameter
+ * and its descendants right now, calling the forget function as the
+ * reaper thread does.  the origin parameter is as of reaper_trash().
+ * a missing node is not an error.
+ */
+int
+reaper_remove(const char *node_path, const char *origin)
+{
+  assert(node_path != NULL);
+
+  char parent[MAXPATHLEN];
+  char path[MAXPATHLEN];
+  if (snprintf(parent, sizeof(parent), "%s", node_path) >= sizeof(parent)) {
+    errno = ENAMETOOLONG;
+    return (-1);
+  }
+  char *slash = strrchr(parent, '/');
+  if (slash == NULL || slash[1] == '\0') {
+    errno = EINVAL;
+    return (-1);
+  }
+  *slash = '\0';
+  snprintf(path, sizeof(path), "%s", origin ? origin : "");
+
+  int parent_fd = open(parent[0] ? parent : "/", O_RDONLY|O_DIRECTORY);
+  if (parent_fd == -1) {
+    return (errno == ENOENT ? 0 : -1);
+  }
+  int ret = reaper_remove_at(parent_fd, slash + 1, path, 0);
+  close(parent_fd);
+  if (ret == -1) {
+    errno = EIO;
+  }
+
+  return (ret);
+}
+
+static void *
+reaper_main(void *arg)
+{
+  pthread_mutex_lock(&reaper_lock);
+  while (reaper_running) {
+    if (!reaper_pending) {
+      pthread_cond_wait(&reaper_cond, &reaper_lock);
+      continue;
+    }
+    reaper_pending = 0;
+    pthread_mutex_unlock(&reaper_lock);
+
+    reaper_empty_trash();
+
+    pthread_mutex_lock(&reaper_lock);
+  }
+  pthread_mutex_unlock(&reaper_lock);
+
+  return (NULL);
+}
+
+static void
+reaper_empty_trash(void)
+{
+  int trash_fd = open(reaper_trash_dir, O_RDONLY|O_DIRECTORY);
+  if (trash_fd == -1) {
+    warn("failed to open the trash directory %s.", reaper_trash_dir);
+    return;
+  }
+  DIR *dirp = fdopendir(trash_fd);
+  if (dirp == NULL) {
+    warn("failed to read the trash directory %s.", reaper_trash_dir);
+    close(trash_fd);
+    return;
+  }
+
+  struct dirent *dentp;
+  while (reaper_running && (dentp = readdir(dirp)) != NULL) {
+    if (strcmp(dentp->d_name, ".") == 0
+	|| strcmp(dentp->d_name, "..") == 0) {
+      continue;
+    }
+
+    char trash_path[MAXPATHLEN];
+    char origin[MAXPATHLEN];
+    ssize_t origin_len;
+    snprintf(trash_path, sizeof(trash_path), "%s/%s", reaper_trash_dir,
+	     dentp->d_name);
+    origin_len = getxattr(trash_path, REAPER_ORIGIN_ATTR, origin,
+			  sizeof(origin) - 1
+#if defined(__APPLE__)
+			  , 0, 0
+#endif
+			  );
+    if (origin_len == -1) {
+      /* forget nothing. */
+      origin_len = 0;
+    }
+    origin[origin_len] = '\0';
+
+    DEBUGV("reaper: removing %s (%s).\n", trash_path, origin);
+    if (reaper_remove_at(dirfd(dirp), dentp->d_name, origin, 1) == -1) {
+      warnx("failed to remove %s.", trash_path);
+    }
+  }
+  closedir(dirp);
+}
+
+/*
+ * remove the node specified as the name parameter in the directory
+ * specified as the parent_fd parameter, and its descendants.  the
+ * path parameter is the original path of the node, or an empty
+ * string.  its buffer must have MAXPATHLEN bytes, and it is used to
+ * build the paths of the descendants.  in the background, the removal
+ * yields to the foreground and stops with the reaper.
+ */
+static int
+reaper_remove_at(int parent_fd, const char *name, char *path, int background)
+{
+  assert(name != NULL);
+  assert(path != NULL);
+
+  if (background) {
+    if (!reaper_running) {
+      /* the rest is done in the next run. */
+      return (0);
+    }
+    reaper_pause();
+  }
+
+  if (unlinkat(parent_fd, name, 0) == 0) {
+    reaper_forget(path);
+    return (0);
+  }
+  if (errno == ENOENT) {
+    return (0);
+  }
+  if (errno != EISDIR && errno != EPERM) {
+    warn("failed to unlink %s.", name);
+    return (-1);
+  }
+
+  /* is a directory. */
+  int fd = openat(parent_fd, name, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+  if (fd == -1) {
+    warn("failed to open a directory %s.", name);
+    return (-1);
+  }
+  DIR *dirp = fdopendir(fd);
+  if (dirp == NULL) {
+    warn("failed to read a directory %s.", name);
+    close(fd);
+    return (-1);
+  }
+  size_t path_len = strlen(path);
+  struct dirent *dentp;
+  int ret = 0;
+  while ((dentp = readdir(dirp)) != NULL) {
+    if (strcmp(dentp->d_name, ".") == 0
+	|| strcmp(dentp->d_name, "..") == 0) {
+      continue;
+    }
+    if (path_len) {
+      snprintf(path + path_len, MAXPATHLEN - path_len, "%s%s",
+	       path[path_len - 1] == '/' ? "" : "/", dentp->d_name);
+    }
+    if (reaper_remove_at(dirfd(dirp), dentp->d_name, path, background)
+	== -1) {
+      ret = -1;
+    }
+    path[path_len] = '\0';
+  }
+  closedir(dirp);
+  if (ret == -1 || (background && !reaper_running)) {
+    return (ret);
+  }
+
+  if (unlinkat(parent_fd, name, AT_REMOVEDIR) == -1 && errno != ENOENT) {
+    warn("failed to remove a directory %s.", name);
+    return (-1);
+  }
+  reaper_forget(path);
+
+  return (0);
+}
+
+/*
+ * the node may have been cached again at the same path after it was
+ * trashed.  forgetting it costs only a revalidation.
+ */
+static void
+reaper_forget(const char *path)
+{
+  assert(path != NULL);
+
+  if (path[0] && reaper_forget_func) {
+    reaper_forget_func(path);
+  }
+}
+
+static void
+reaper_pause(void)
+{
+  if (++reaper_nremoved % REAPER_BATCH == 0) {
+    struct timespec pause;
+    pause.tv_sec = 0;
+    pause.tv_nsec = REAPER_PAUSE_NSEC;
+    nanosleep(&pause, NULL);
+  }
+}
@@ -0,0 +1,411 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "scanner.h"
+
+#define SCANNER_MAX_THREADS 64
+#define SCANNER_REPORT_INTERVAL 5	/* in seconds. */
+
+/*
+ * the scanner walks the trees of the cache directory in background
+ * with a pool of worker threads, and calls the visit function for
+ * every directory and regular file in them.  each worker has its own
+ * deque of directories to read.  it pushes the subdirectories it
+ * finds and pops the latest one itself, so that it goes depth first
+ * in a subtree, and an idle worker steals the oldest one, a large
+ * subtree near the root, from another.  the report function is called
+ * periodically with the numbers of the directories and the files
+ * visited so far, and once more when the walk is over.
+ */
+typedef struct scanner_deque {
+  pthread_mutex_t lock;
+  char **paths;
+  size_t head;		/* the oldest, taken by the thieves. */
+  size_t tail;		/* the next to the latest, taken by the owner. */
+  size_t size;
+} scanner_deque_t;
+
+static scanner_deque_t scanner_deques[SCANNER_MAX_THREADS];
+static pthread_t scanner_threads[SCANNER_MAX_THREADS];
+static int scanner_nthreads = 0;
+static pthread_t scanner_thread;
+static pthread_mutex_t scanner_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t scanner_cond = PTHREAD_COND_INITIALIZER;
+static int scanner_running = 0;
+static size_t scanner_queued = 0;	/* directories in the deques. */
+static size_t scanner_pending = 0;	/* queued or being read. */
+static size_t scanner_ndirs = 0;
+static size_t scanner_nfiles = 0;
+static scanner_visit_func_t scanner_visit_func = NULL;
+static scanner_report_func_t scanner_report_func = NULL;
+
+static void *scanner_main(void *);
+static void *scanner_worker_main(void *);
+static int scanner_push(int, const char *);
+static char *scanner_pop(int);
+static char *scanner_steal(int);
+static void scanner_read_dir(int, const char *);
+
+/*
+ * start walking the trees under the roots.  it returns immediately.
+ */
+int
+scanner_start(const char **roots, size_t nroots,
+	      scanner_visit_func_t visit_func,
+	      scanner_report_func_t report_func)
+{
+  assert(roots != NULL);
+  assert(visit_func != NULL);
+
+  if (config.scan_threads <= 0) {
+    /* the cache is checked lazily on access. */
+    if (report_func) {
+      report_func(0, 0, 1);
+    }
+    return (0);
+  }
+
+  scanner_nthreads = config.scan_threads;
+  if (scanner_nthreads > SCANNER_MAX_THREADS) {
+    scanner_nthreads = SCANNER_MAX_THREADS;
+  }
+  int i;
+  for (i = 0; i < scanner_nthreads; i++) {
+    memset(&scanner_deques[i], 0, sizeof(scanner_deque_t));
+    pthread_mutex_init(&scanner_deques[i].lock, NULL);
+  }
+  scanner_visit_func = visit_func;
+  scanner_report_func = report_func;
+  scanner_ndirs = scanner_nfiles = 0;
+  scanner_queued = scanner_pending = 0;
+  scanner_running = 1;
+
+  size_t j;
+  for (j = 0; j < nroots; j++) {
+    if (scanner_push(j % scanner_nthreads, roots[j]) == -1) {
+      warnx("failed to queue %s to scan.", roots[j]);
+    }
+  }
+
+  if (pthread_create(&scanner_thread, NULL, scanner_main, NULL) != 0) {
+    warnx("failed to create the scanner thread.");
+    scanner_running = 0;
+    for (i = 0; i < scanner_nthreads; i++) {
+      char *path;
+      while ((path = scanner_pop(i)) != NULL) {
+	free(path);
+      }
+    }
+    return (-1);
+  }
+
+  return (0);
+}
+
+/*
+ * stop the walk if it is still running.
+ */
+int
+scanner_stop(void)
+{
+  pthread_mutex_lock(&scanner_lock);
+  if (!scanner_running) {
+    pthread_mutex_unlock(&scanner_lock);
+    return (0);
+  }
+  scanner_running = 0;
+  pthread_cond_broadcast(&scanner_cond);
+  pthread_mutex_unlock(&scanner_lock);
+
+  pthread_join(scanner_thread, NULL);
+
+  return (0);
+}
+
+/*
+ * the main loop of the controlling thread.  it runs the workers,
+ * reports the progress while they run, and cleans up.
+ */
+static void *
+scanner_main(void *arg)
+{
+  int nthreads;
+  for (nthreads = 0; nthreads < scanner_nthreads; nthreads++) {
+    if (pthread_create(&scanner_threads[nthreads], NULL, scanner_worker_main,
+		       (void *)(long)nthreads) != 0) {
+      warnx("failed to create a scanner worker thread.");
+      break;
+    }
+  }
+  if (nthreads == 0) {
+    /* do it by ourselves. */
+    scanner_worker_main((void *)0L);
+  }
+
+  pthread_mutex_lock(&scanner_lock);
+  time_t report = time(NULL) + SCANNER_REPORT_INTERVAL;
+  while (scanner_running && scanner_pending > 0) {
+    struct timespec wakeup;
+    wakeup.tv_sec = report;
+    wakeup.tv_nsec = 0;
+    pthread_cond_timedwait(&scanner_cond, &scanner_lock, &wakeup);
+    if (scanner_running && scanner_pending > 0 && time(NULL) >= report) {
+      size_t ndirs = scanner_ndirs, nfiles = scanner_nfiles;
+      pthread_mutex_unlock(&scanner_lock);
+      if (scanner_report_func) {
+	scanner_report_func(ndirs, nfiles, 0);
+      }
+      pthread_mutex_lock(&scanner_lock);
+      report = time(NULL) + SCANNER_REPORT_INTERVAL;
+    }
+  }
+  int completed = scanner_running;
+  pthread_mutex_unlock(&scanner_lock);
+
+  int i;
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(scanner_threads[i], NULL);
+  }
+  for (i = 0; i < scanner_nthreads; i++) {
+    char *path;
+    while ((path = scanner_pop(i)) != NULL) {
+      free(path);
+    }
+    free(scanner_deques[i].paths);
+    scanner_deques[i].paths = NULL;
+    pthread_mutex_destroy(&scanner_deques[i].lock);
+  }
+
+  if (completed && scanner_report_func) {
+    scanner_report_func(scanner_ndirs, scanner_nfiles, 1);
+  }
+
+  return (NULL);
+}
+
+static void *
+scanner_worker_main(void *arg)
+{
+  int self = (int)(long)arg;
+
+  for (;;) {
+    char *path = scanner_pop(self);
+    if (path == NULL) {
+      path = scanner_steal(self);
+    }
+    if (path == NULL) {
+      /* wait until someone pushes more, or everything is done. */
+      pthread_mutex_lock(&scanner_lock);
+      while (scanner_running && scanner_pending > 0 && scanner_queued == 0) {
+	pthread_cond_wait(&scanner_cond, &scanner_lock);
+      }
+      int done = (!scanner_running || scanner_pending == 0);
+      pthread_mutex_unlock(&scanner_lock);
+      if (done) {
+	break;
+      }
+      continue;
+    }
+
+    scanner_read_dir(self, path);
+    free(path);
+
+    pthread_mutex_lock(&scanner_lock);
+    scanner_ndirs++;
+    if (--scanner_pending == 0) {
+      pthread_cond_broadcast(&scanner_cond);
+    }
+    pthread_mutex_unlock(&scanner_lock);
+  }
+
+  return (NULL);
+}
+
+/*
+ * visit the entries of the directory, and queue its subdirectories to
+ * the deque of the worker specified as the self parameter.
+ */
+static void
+scanner_read_dir(int self, const char *path)
+{
+  assert(path != NULL);
+
+  DIR *dirp = opendir(path);
+  if (dirp == NULL) {
+    if (errno != ENOENT) {
+      warn("failed to open %s to scan.", path);
+    }
+    return;
+  }
+
+  size_t nfiles = 0;
+  struct dirent *entp;
+  while (scanner_running && (entp = readdir(dirp)) != NULL) {
+    if (strcmp(entp->d_name, ".") == 0 || strcmp(entp->d_name, "..") == 0) {
+      continue;
+    }
+    struct stat stbuf;
+    if (fstatat(dirfd(dirp), entp->d_name, &stbuf, AT_SYMLINK_NOFOLLOW)
+	== -1) {
+      /* removed meanwhile. */
+      continue;
+    }
+    char child_path[MAXPATHLEN];
+    if (snprintf(child_path, sizeof(child_path), "%s/%s", path,
+		 entp->d_name) >= (int)sizeof(child_path)) {
+      continue;
+    }
+    if (S_ISDIR(stbuf.st_mode)) {
+      if (scanner_visit_func(child_path, &stbuf) != SCANNER_SKIP
+	  && scanner_push(self, child_path) == -1) {
+	warnx("failed to queue %s to scan.", child_path);
+      }
+    } else if (S_ISREG(stbuf.st_mode)) {
+      scanner_visit_func(child_path, &stbuf);
+      nfiles++;
+    }
+  }
+  closedir(dirp);
+
+  pthread_mutex_lock(&scanner_lock);
+  scanner_nfiles += nfiles;
+  pthread_mutex_unlock(&scanner_lock);
+}
+
+static int
+scanner_push(int self, const char *path)
+{
+  assert(path != NULL);
+
+  char *copy = strdup(path);
+  if (copy == NULL) {
+    warn("failed to duplicate a string (%s).", path);
+    return (-1);
+  }
+
+  scanner_deque_t *dequep = &scanner_deques[self];
+  pthread_mutex_lock(&dequep->lock);
+  if (dequep->tail == dequep->size) {
+    if (dequep->head > 0) {
+      /* slide the entries to the front. */
+      memmove(dequep->paths, dequep->paths + dequep->head,
+	      sizeof(char *) * (dequep->tail - dequep->head));
+      dequep->tail -= dequep->head;
+      dequep->head = 0;
+    } else {
+      size_t new_size = dequep->size ? dequep->size * 2 : 64;
+      char **new_paths = realloc(dequep->paths, sizeof(char *) * new_size);
+      if (new_paths == NULL) {
+	warn("failed to allocate memory for the scan queue.");
+	pthread_mutex_unlock(&dequep->lock);
+	free(copy);
+	return (-1);
+      }
+      dequep->paths = new_paths;
+      dequep->size = new_size;
+    }
+  }
+  dequep->paths[dequep->tail++] = copy;
+  pthread_mutex_unlock(&dequep->lock);
+
+  pthread_mutex_lock(&scanner_lock);
+  scanner_queued++;
+  scanner_pending++;
+  pthread_cond_signal(&scanner_cond);
+  pthread_mutex_unlock(&scanner_lock);
+
+  return (0);
+}
+
+/*
+ * take the latest directory from the deque of the worker itself.
+ */
+static char *
+scanner_pop(int self)
+{
+  scanner_deque_t *dequep = &scanner_deques[self];
+  char *path = NULL;
+  pthread_mutex_lock(&dequep->lock);
+  if (dequep->head < dequep->tail) {
+    path = dequep->paths[--dequep->tail];
+    if (dequep->head == dequep->tail) {
+      dequep->head = dequep->tail = 0;
+    }
+  }
+  pthread_mutex_unlock(&dequep->lock);
+
+  if (path) {
+    pthread_mutex_lock(&scanner_lock);
+    scanner_queued--;
+    pthread_mutex_unlock(&scanner_lock);
+  }
+  return (path);
+}
+
+/*
+ * take the oldest directory from the deque of another worker.
+ */
+static char *
+scanner_steal(int self)
+{
+  int i;
+  for (i = 1; i < scanner_nthreads; i++) {
+    scanner_deque_t *dequep = &scanner_deques[(self + i) % scanner_nthreads];
+    char *path = NULL;
+    pthread_mutex_lock(&dequep->lock);
+    if (dequep->head < dequep->tail) {
+      path = dequep->paths[dequep->head++];
+      if (dequep->head == dequep->tail) {
+	dequep->head = dequep->tail = 0;
+      }
+    }
+    pthread_mutex_unlock(&dequep->lock);
+
+    if (path) {
+      pthread_mutex_lock(&scanner_lock);
+      scanner_queued--;
+      pthread_mutex_unlock(&scanner_lock);
+      return (path);
+    }
+  }
+  return (NULL);
+}
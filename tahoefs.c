@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
@@ -40,7 +41,15 @@
 #include "tahoefs.h"
 #include "http_stub.h"
 #include "json_stub.h"
+#include "poller.h"
 #include "filecache.h"
+#include "metacache.h"
+#include "captable.h"
+#include "prefetch.h"
+#include "evictor.h"
+#include "policy.h"
+#include "peer.h"
+#include "uploader.h"
 
 #define TAHOE_DEFAULT_DIR ".tahoe"
 #define TAHOE_DEFAULT_ALIASES_PATH "private/aliases"
@@ -50,6 +59,67 @@
 #define TAHOE_DEFAULT_WEBAPI_PORT "3456"
 
 #define TAHOE_DEFAULT_FILECACHE_DIR ".tahoefs"
+#define TAHOE_DEFAULT_META_TTL 5
+#define TAHOE_DEFAULT_REFRESH_AHEAD 2
+#define TAHOE_DEFAULT_STALE_IF_ERROR 3600
+#define TAHOE_DEFAULT_SCAN_THREADS 4
+#define TAHOE_DEFAULT_REFRESH_RATE 10
+#define TAHOE_DEFAULT_PREFETCH_THREADS 4
+#define TAHOE_DEFAULT_READDIR_AHEAD 1
+#define TAHOE_DEFAULT_CACHE_HIGH_WATER 95
+#define TAHOE_DEFAULT_CACHE_LOW_WATER 80
+#define TAHOE_DEFAULT_PIN_INTERVAL 600
+
+/* setting this xattr on a directory warms up the subtree. */
+#define TAHOE_XATTR_WARMUP "user.net.iijlab.tahoefs.warmup"
+/* setting this xattr to "pin", "normal" or "nocache" sets the policy. */
+#define TAHOE_XATTR_POLICY "user.net.iijlab.tahoefs.policy"
+/* setting this xattr caches the contents of a file, or warms up a tree. */
+#define TAHOE_XATTR_PREFETCH "user.net.iijlab.tahoefs.prefetch"
+/* setting this xattr removes the cached contents of a file. */
+#define TAHOE_XATTR_EVICT "user.net.iijlab.tahoefs.evict"
+/* setting this xattr to "1" pins the tree, and "0" unpins it. */
+#define TAHOE_XATTR_PIN "user.net.iijlab.tahoefs.pin"
+/* the read-only cap of the node. */
+#define TAHOE_XATTR_CAP "user.net.iijlab.tahoefs.cap"
+/* "cached_bytes size" of a file. */
+#define TAHOE_XATTR_RESIDENCY "user.net.iijlab.tahoefs.residency"
+/* "fresh", "stale" or "unverified". */
+#define TAHOE_XATTR_FRESHNESS "user.net.iijlab.tahoefs.freshness"
+
+#ifndef ENOATTR
+#define ENOATTR ENODATA
+#endif
+
+/* the kernel may cache everything of an immutable snapshot for a year. */
+#define TAHOE_SNAPSHOT_FUSE_OPTS					\
+  "-oro,kernel_cache,entry_timeout=31536000,attr_timeout=31536000,"	\
+  "negative_timeout=31536000"
+
+/*
+ * a parsed listing of a directory, allocated by opendir() and filled
+ * at the first readdir().  the following readdir() calls page through it by
+ * the offset, so a huge directory is fetched and parsed only once.
+ * it keeps only what stat{} needs, with the names packed in one
+ * buffer.
+ */
+typedef struct tahoe_dirent {
+  size_t name_offset;
+  u_int64_t size;
+  double mtime;
+  u_int8_t type;
+  u_int8_t mutable;
+} tahoe_dirent_t;
+
+typedef struct tahoe_dirsnap {
+  tahoe_dirent_t *entries;
+  size_t nentries;
+  size_t entries_size;
+  char *names;
+  size_t names_len;
+  size_t names_size;
+  int filled;
+} tahoe_dirsnap_t;
 
 tahoefs_global_config_t config;
 
@@ -62,14 +132,32 @@ static int tahoe_read(const char *, char *, size_t, off_t,
 static int tahoe_write(const char *, const char *, size_t, off_t,
 		      struct fuse_file_info *);
 static int tahoe_flush(const char *, struct fuse_file_info *);
+static int tahoe_release(const char *, struct fuse_file_info *);
+static int tahoe_fsync(const char *, int, struct fuse_file_info *);
+static int tahoe_opendir(const char *, struct fuse_file_info *);
 static int tahoe_readdir(const char *, void *, fuse_fill_dir_t, off_t,
 			 struct fuse_file_info *);
 static int tahoe_readdir_callback(tahoefs_readdir_baton_t *);
+static int tahoe_releasedir(const char *, struct fuse_file_info *);
+static void tahoe_dirsnap_free(tahoe_dirsnap_t *);
 static int tahoe_mkdir(const char *, mode_t);
 static int tahoe_rmdir(const char *);
 static int tahoe_statfs(const char *, struct statvfs *);
+#if defined(__APPLE__)
+static int tahoe_setxattr(const char *, const char *, const char *, size_t,
+			  int, uint32_t);
+static int tahoe_getxattr(const char *, const char *, char *, size_t,
+			  uint32_t);
+#else
+static int tahoe_setxattr(const char *, const char *, const char *, size_t,
+			  int);
+static int tahoe_getxattr(const char *, const char *, char *, size_t);
+#endif
+static int tahoe_listxattr(const char *, char *, size_t);
+static int tahoe_xattr_reply(const char *, char *, size_t);
 static void *tahoe_init(struct fuse_conn_info *);
 static void tahoe_destroy(void *);
+static void tahoe_invalidate(const char *, const char *);
 
 static const char *tahoe_default_root_cap(void);
 static void tahoefs_usage(const char *);
@@ -88,10 +176,17 @@ static struct fuse_operations tahoe_oper = {
   .read		= tahoe_read,
   .write	= tahoe_write,
   .flush	= tahoe_flush,
+  .release	= tahoe_release,
+  .fsync	= tahoe_fsync,
+  .opendir	= tahoe_opendir,
   .readdir	= tahoe_readdir,
+  .releasedir	= tahoe_releasedir,
   .mkdir	= tahoe_mkdir,
   .rmdir	= tahoe_rmdir,
   .statfs	= tahoe_statfs,
+  .setxattr	= tahoe_setxattr,
+  .getxattr	= tahoe_getxattr,
+  .listxattr	= tahoe_listxattr,
 };
 
 static int
@@ -108,8 +203,10 @@ tahoe_getattr(const char *path, struct stat *statp)
 
   if (tahoefs_tstat_to_stat(&tstat, statp) == -1) {
     warnx("failed to convert tahoefs_stat_t{} to stat{}.");
+    captable_tstat_release(&tstat);
     return (-ENOENT);
   }
+  captable_tstat_release(&tstat);
 
   /* mutable files don't have size information. */
   if (tstat.mutable && tstat.type == TAHOEFS_STAT_TYPE_FILENODE) {
@@ -130,7 +227,7 @@ static int
 tahoe_open(const char *path, struct fuse_file_info *fi)
 {
   int errcode = 0;
-  errcode = filecache_open(path, fi->flags);
+  errcode = filecache_open(path, fi->flags, &fi->fh);
   if (errcode) {
     warnx("failed to open a file %s", path);
     return (-errcode);
@@ -143,7 +240,7 @@ static int
 tahoe_create(const char *path, mode_t mode, struct fuse_file_info *fi)
 {
   int errcode = 0;
-  errcode = filecache_create(path, mode);
+  errcode = filecache_create(path, mode, &fi->fh);
   if (errcode) {
     warnx("failed to create a file %s.", path);
     return (-errcode);
@@ -185,7 +282,7 @@ tahoe_write(const char *path, const char *buf, size_t size, off_t offset,
   int nwritten = filecache_write(path, buf, size, offset, fi->flags);
   if (nwritten == -1) {
     warnx("write %ld bytes at %ld to %s failed", size, offset, path);
-    return (-1);
+    return (-EIO);
   }
 
   return (nwritten);
@@ -204,55 +301,164 @@ tahoe_flush(const char *path, struct fuse_file_info *fi)
   return (0);
 }
 
+static int
+tahoe_release(const char *path, struct fuse_file_info *fi)
+{
+  return (-filecache_release(path, fi->flags, fi->fh));
+}
+
+static int
+tahoe_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+  int errcode = 0;
+  errcode = filecache_fsync(path);
+  if (errcode) {
+    warnx("failed to sync the contents of %s", path);
+    return (-errcode);
+  }
+
+  return (0);
+}
+
+static int
+tahoe_opendir(const char *path, struct fuse_file_info *fi)
+{
+  /*
+   * the handle can only be set here.  readdir() gets a copy of the
+   * file info, so the snapshot is filled in place there.
+   */
+  tahoe_dirsnap_t *snapp = calloc(1, sizeof(tahoe_dirsnap_t));
+  if (snapp == NULL) {
+    warn("failed to allocate memory for a directory snapshot.");
+    return (-ENOMEM);
+  }
+  fi->fh = (uintptr_t)snapp;
+
+  return (0);
+}
+
 static int
 tahoe_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 	      off_t offset, struct fuse_file_info *fi)
 {
-  char *infop = NULL;
-  size_t info_size;
-  if (http_stub_get_info(path, &infop, &info_size) == -1) {
-    warnx("failed to get dirnode information of %s.", path);
-    return (-ENOENT);
+  tahoe_dirsnap_t local_snap;
+  tahoe_dirsnap_t *snapp = NULL;
+  if (fi && fi->fh) {
+    snapp = (tahoe_dirsnap_t *)(uintptr_t)fi->fh;
+  } else {
+    memset(&local_snap, 0, sizeof(tahoe_dirsnap_t));
+    snapp = &local_snap;
+  }
+  if (!snapp->filled || offset == 0) {
+    /* the first call, or rewinddir().  take a new snapshot. */
+    snapp->filled = 0;
+    snapp->nentries = 0;
+    snapp->names_len = 0;
+    int errcode = 0;
+    errcode = filecache_readdir(path, snapp, NULL, tahoe_readdir_callback);
+    if (errcode) {
+      warnx("failed to read the directory %s.", path);
+      if (snapp == &local_snap) {
+	free(local_snap.entries);
+	free(local_snap.names);
+      }
+      return (-errcode);
+    }
+    snapp->filled = 1;
   }
 
-  if (json_stub_iterate_children(buf, filler, infop,
-				 tahoe_readdir_callback) == -1) {
-    warnx("failed to iterate child nodes of %s.", path);
-    free(infop);
-    return (-EIO);
+  /* fill from the offset until the kernel buffer becomes full. */
+  size_t i;
+  for (i = offset; i < snapp->nentries; i++) {
+    tahoe_dirent_t *entryp = &snapp->entries[i];
+    tahoefs_stat_t tstat;
+    memset(&tstat, 0, sizeof(tahoefs_stat_t));
+    tstat.type = entryp->type;
+    tstat.mutable = entryp->mutable;
+    tstat.size = entryp->size;
+    tstat.link_modification_time = entryp->mtime;
+    struct stat stat;
+    memset(&stat, 0, sizeof(struct stat));
+    if (tahoefs_tstat_to_stat(&tstat, &stat) == -1) {
+      continue;
+    }
+    if (filler(buf, snapp->names + entryp->name_offset, &stat, i + 1) == 1) {
+      break;
+    }
+  }
+
+  if (snapp == &local_snap) {
+    free(local_snap.entries);
+    free(local_snap.names);
   }
 
-  /* free the memory which keeps the HTTP response body. */
-  free(infop);
+  return (0);
+}
+
+static int
+tahoe_releasedir(const char *path, struct fuse_file_info *fi)
+{
+  if (fi && fi->fh) {
+    tahoe_dirsnap_free((tahoe_dirsnap_t *)(uintptr_t)fi->fh);
+    fi->fh = 0;
+  }
 
   return (0);
 }
 
+static void
+tahoe_dirsnap_free(tahoe_dirsnap_t *snapp)
+{
+  assert(snapp != NULL);
+
+  free(snapp->entries);
+  free(snapp->names);
+  free(snapp);
+}
+
 static int
 tahoe_readdir_callback(tahoefs_readdir_baton_t *batonp)
 {
   assert(batonp != NULL);
-
-  /* convert the JSON data to tahoefs metadata. */
-  tahoefs_stat_t tstat;
-  memset(&tstat, 0, sizeof(tahoefs_stat_t));
-  if (json_stub_jsonstring_to_tstat(batonp->infop, &tstat) == -1) {
-    warnx("failed to convert JSON stat data to tahoefs stat.");
-    return (-1);
+  assert(batonp->tstatp != NULL);
+
+  tahoe_dirsnap_t *snapp = (tahoe_dirsnap_t *)batonp->nodename_listp;
+  const tahoefs_stat_t *tstatp = batonp->tstatp;
+
+  /* append the entry to the snapshot. */
+  if (snapp->nentries == snapp->entries_size) {
+    size_t new_size = snapp->entries_size ? snapp->entries_size * 2 : 64;
+    tahoe_dirent_t *new_entries = realloc(snapp->entries,
+					  new_size * sizeof(tahoe_dirent_t));
+    if (new_entries == NULL) {
+      warn("failed to enlarge a directory snapshot.");
+      return (-1);
+    }
+    snapp->entries = new_entries;
+    snapp->entries_size = new_size;
   }
-
-  struct stat stat;
-  memset(&stat, 0, sizeof(struct stat));
-  if (tahoefs_tstat_to_stat(&tstat, &stat) == -1) {
-    warnx("failed to convert tahoefs_stat_t{} to stat{}.");
-    return (-1);
+  size_t name_len = strlen(batonp->nodename) + 1;
+  if (snapp->names_len + name_len > snapp->names_size) {
+    size_t new_size = snapp->names_size ? snapp->names_size * 2 : 1024;
+    while (snapp->names_len + name_len > new_size) {
+      new_size *= 2;
+    }
+    char *new_names = realloc(snapp->names, new_size);
+    if (new_names == NULL) {
+      warn("failed to enlarge a directory snapshot.");
+      return (-1);
+    }
+    snapp->names = new_names;
+    snapp->names_size = new_size;
   }
-
-  fuse_fill_dir_t filler = (fuse_fill_dir_t)batonp->fillerp;
-  if (filler(batonp->nodename_listp, batonp->nodename, &stat, 0) == 1) {
-    warnx("failed to fill directory list buffer.");
-    return (-1);
-  };
+  tahoe_dirent_t *entryp = &snapp->entries[snapp->nentries++];
+  entryp->name_offset = snapp->names_len;
+  entryp->size = tstatp->size;
+  entryp->mtime = tstatp->link_modification_time;
+  entryp->type = tstatp->type;
+  entryp->mutable = tstatp->mutable;
+  memcpy(snapp->names + snapp->names_len, batonp->nodename, name_len);
+  snapp->names_len += name_len;
 
   return (0);
 }
@@ -299,12 +505,184 @@ tahoe_statfs(const char *path, struct statvfs *statvfsp)
   return (0);
 }
 
+/*
+ * xattrs are used to control tahoefs on a mounted tree.
+ */
+static int
+#if defined(__APPLE__)
+tahoe_setxattr(const char *path, const char *name, const char *value,
+	       size_t size, int flags, uint32_t position)
+#else
+tahoe_setxattr(const char *path, const char *name, const char *value,
+	       size_t size, int flags)
+#endif
+{
+  if (strcmp(name, TAHOE_XATTR_WARMUP) == 0) {
+    /* the value is ignored. */
+    return (-filecache_request_warmup(path));
+  }
+  if (strcmp(name, TAHOE_XATTR_POLICY) == 0) {
+    char policy_name[16];
+    if (size >= sizeof(policy_name)) {
+      return (-EINVAL);
+    }
+    memcpy(policy_name, value, size);
+    policy_name[size] = '\0';
+    int policy = policy_from_name(policy_name);
+    if (policy == -1) {
+      return (-EINVAL);
+    }
+    return (policy_set(path, policy) == -1 ? -ENOMEM : 0);
+  }
+  if (strcmp(name, TAHOE_XATTR_PIN) == 0) {
+    int pin = (size > 0 && value[0] == '1');
+    return (policy_set(path, pin ? POLICY_PIN : POLICY_NORMAL) == -1
+	    ? -ENOMEM : 0);
+  }
+  if (strcmp(name, TAHOE_XATTR_PREFETCH) == 0) {
+    return (-filecache_request_prefetch(path));
+  }
+  if (strcmp(name, TAHOE_XATTR_EVICT) == 0) {
+    return (-filecache_request_evict(path));
+  }
+
+  return (-ENOTSUP);
+}
+
+/*
+ * the status of the local cache is exposed as read-only xattrs.  they
+ * are answered from the local state without asking the gateway.
+ */
+static int
+#if defined(__APPLE__)
+tahoe_getxattr(const char *path, const char *name, char *value, size_t size,
+	       uint32_t position)
+#else
+tahoe_getxattr(const char *path, const char *name, char *value, size_t size)
+#endif
+{
+  if (strcmp(name, TAHOE_XATTR_POLICY) == 0) {
+    return (tahoe_xattr_reply(policy_to_name(policy_lookup(path)), value,
+			      size));
+  }
+  if (strcmp(name, TAHOE_XATTR_CAP) != 0
+      && strcmp(name, TAHOE_XATTR_RESIDENCY) != 0
+      && strcmp(name, TAHOE_XATTR_FRESHNESS) != 0) {
+    return (-ENOATTR);
+  }
+
+  filecache_residency_t residency;
+  int errcode = filecache_get_residency(path, &residency);
+  if (errcode) {
+    return (errcode == ENOENT ? -ENOATTR : -errcode);
+  }
+
+  char reply[64];
+  const char *replyp = NULL;
+  if (strcmp(name, TAHOE_XATTR_CAP) == 0) {
+    replyp = residency.tstat.ro_uri;
+  } else if (strcmp(name, TAHOE_XATTR_RESIDENCY) == 0) {
+    if (residency.tstat.type == TAHOEFS_STAT_TYPE_FILENODE) {
+      snprintf(reply, sizeof(reply), "%llu %llu",
+	       (unsigned long long)residency.cached_size,
+	       (unsigned long long)residency.tstat.size);
+      replyp = reply;
+    }
+  } else {
+    switch (residency.freshness) {
+    case FILECACHE_FRESHNESS_FRESH:
+      replyp = "fresh";
+      break;
+    case FILECACHE_FRESHNESS_STALE:
+      replyp = "stale";
+      break;
+    case FILECACHE_FRESHNESS_UNVERIFIED:
+      replyp = "unverified";
+      break;
+    }
+  }
+  int ret = replyp ? tahoe_xattr_reply(replyp, value, size) : -ENOATTR;
+  captable_tstat_release(&residency.tstat);
+
+  return (ret);
+}
+
+static int
+tahoe_listxattr(const char *path, char *list, size_t size)
+{
+  static const char names[] =
+    TAHOE_XATTR_CAP "\0"
+    TAHOE_XATTR_RESIDENCY "\0"
+    TAHOE_XATTR_FRESHNESS "\0"
+    TAHOE_XATTR_POLICY "\0";
+
+  if (size == 0) {
+    return (sizeof(names) - 1);
+  }
+  if (size < sizeof(names) - 1) {
+    return (-ERANGE);
+  }
+  memcpy(list, names, sizeof(names) - 1);
+
+  return (sizeof(names) - 1);
+}
+
+/*
+ * copy a string xattr value to the buffer of the size.  a zero size
+ * asks for the length.
+ */
+static int
+tahoe_xattr_reply(const char *reply, char *value, size_t size)
+{
+  size_t len = strlen(reply);
+  if (size == 0) {
+    return (len);
+  }
+  if (size < len) {
+    return (-ERANGE);
+  }
+  memcpy(value, reply, len);
+
+  return (len);
+}
+
 static void *
 tahoe_init(struct fuse_conn_info *conn)
 {
   if (http_stub_initialize() == -1) {
     errx(EXIT_FAILURE, "failed to initialize the http_stub module.");
   }
+  if (metacache_initialize() == -1) {
+    errx(EXIT_FAILURE, "failed to initialize the metacache module.");
+  }
+  if (filecache_initialize() == -1) {
+    errx(EXIT_FAILURE, "failed to initialize the filecache module.");
+  }
+  if (peer_start(filecache_open_object) == -1) {
+    warnx("failed to start the peer cache server.");
+  }
+  if (evictor_start(filecache_evict,
+		    config.shared_cache_dir ? filecache_usage : NULL) == -1) {
+    warnx("failed to start the cache evictor.");
+  }
+  if (filecache_start_scan() == -1) {
+    warnx("failed to start the cache scan.");
+  }
+  if (metacache_start_refresher(filecache_refresh) == -1) {
+    warnx("failed to start the metadata refresher.");
+  }
+  if (poller_start(filecache_poll, tahoe_invalidate) == -1) {
+    warnx("failed to start the change poller.");
+  }
+  if (prefetch_start(filecache_prefetch) == -1) {
+    warnx("failed to start the prefetch workers.");
+  }
+  if (policy_start(filecache_request_warmup, evictor_unpin_all) == -1) {
+    warnx("failed to start the policy thread.");
+  }
+  if (config.warmup_path) {
+    filecache_request_warmup(config.warmup_path);
+  }
 
   return (NULL);
 }
@@ -312,11 +690,60 @@ tahoe_init(struct fuse_conn_info *conn)
 static void
 tahoe_destroy(void *dummy)
 {
+  /* the queued uploads need the other modules. */
+  if (uploader_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the uploader module.");
+  }
+  if (policy_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the policy module.");
+  }
+  if (prefetch_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the prefetch module.");
+  }
+  if (poller_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the poller module.");
+  }
+  if (evictor_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the evictor module.");
+  }
+  if (peer_stop() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the peer module.");
+  }
+  if (filecache_terminate() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the filecache module.");
+  }
+  if (metacache_terminate() == -1) {
+    errx(EXIT_FAILURE, "failed to teminate the metacache module.");
+  }
   if (http_stub_terminate() == -1) {
     errx(EXIT_FAILURE, "failed to teminate the http_stub module.");
   }
 }
 
+/*
+ * called by the poller when the child specified as the name parameter
+ * of the directory dir_path was changed remotely.  the name parameter
+ * is NULL when the directory itself has changed.  the high-level API
+ * of FUSE 2.6 cannot address kernel inodes, so the kernel cache is
+ * not dropped here.  the metadata cache is already updated, and the
+ * change is visible when the kernel revalidates the path after
+ * entry_timeout/attr_timeout, which must stay short unless the root
+ * is a snapshot.
+ */
+static void
+tahoe_invalidate(const char *dir_path, const char *name)
+{
+  char path[MAXPATHLEN];
+  if (name == NULL) {
+    snprintf(path, sizeof(path), "%s", dir_path);
+  } else {
+    snprintf(path, sizeof(path), "%s/%s",
+	     strcmp(dir_path, "/") == 0 ? "" : dir_path, name);
+  }
+
+  DEBUGV("%s was changed remotely.\n", path);
+}
+
 static int
 tahoefs_tstat_to_stat(const tahoefs_stat_t *tstatp, struct stat *statp)
 {
@@ -376,10 +803,10 @@ tahoefs_tstat_print(const tahoefs_stat_t *tstatp)
     default:
       printf("  type: unknown\n");
     }
-    printf("  ro_uri: %s\n", tstatp->ro_uri);
-    printf("  verify_uri: %s\n", tstatp->verify_uri);
-    printf("  rw_uri: %s\n", tstatp->rw_uri);
-    printf("  size: %ld\n", tstatp->size);
+    printf("  ro_uri: %s\n", TAHOEFS_CAP(tstatp->ro_uri));
+    printf("  verify_uri: %s\n", TAHOEFS_CAP(tstatp->verify_uri));
+    printf("  rw_uri: %s\n", TAHOEFS_CAP(tstatp->rw_uri));
+    printf("  size: %llu\n", (unsigned long long)tstatp->size);
     printf("  mutable: %d\n", tstatp->mutable);
     printf("  link_cr_time: %f\n", tstatp->link_creation_time);
     printf("  link_mo_time: %f\n", tstatp->link_modification_time);
@@ -475,6 +902,29 @@ static const struct fuse_opt tahoefs_opts[] = {
   TAHOEFS_OPT("--port=%s",	webapi_port),
   TAHOEFS_OPT("-c %s",		filecache_dir),
   TAHOEFS_OPT("--cache-dir=%s",	filecache_dir),
+  TAHOEFS_OPT("--shared-cache=%s",	shared_cache_dir),
+  TAHOEFS_OPT("--peer-addr=%s",	peer_addr),
+  TAHOEFS_OPT("--peers=%s",	peers),
+  TAHOEFS_OPT("--meta-ttl=%d",	meta_ttl),
+  TAHOEFS_OPT("--stale-while-revalidate=%d",	stale_while_revalidate),
+  TAHOEFS_OPT("--stale-if-error=%d",	stale_if_error),
+  TAHOEFS_OPT("--refresh-ahead=%d",	refresh_ahead),
+  TAHOEFS_OPT("--refresh-rate=%d",	refresh_rate),
+  TAHOEFS_OPT("--snapshot",	snapshot),
+  TAHOEFS_OPT("--poll-interval=%d",	poll_interval),
+  TAHOEFS_OPT("--prefetch-threads=%d",	prefetch_threads),
+  TAHOEFS_OPT("--upload-threads=%d",	upload_threads),
+  TAHOEFS_OPT("--readdir-ahead=%d",	readdir_ahead),
+  TAHOEFS_OPT("--warmup=%s",	warmup_path),
+  TAHOEFS_OPT("--warmup-pattern=%s",	warmup_pattern),
+  TAHOEFS_OPT("--warmup-max-size=%d",	warmup_max_size),
+  TAHOEFS_OPT("--cache-max-size=%d",	cache_max_size),
+  TAHOEFS_OPT("--cache-max-files=%d",	cache_max_files),
+  TAHOEFS_OPT("--cache-high-water=%d",	cache_high_water),
+  TAHOEFS_OPT("--cache-low-water=%d",	cache_low_water),
+  TAHOEFS_OPT("--policy-file=%s",	policy_file),
+  TAHOEFS_OPT("--pin-interval=%d",	pin_interval),
+  TAHOEFS_OPT("--scan-threads=%d",	scan_threads),
   FUSE_OPT_KEY("-d",            OPTKEY_DEBUG),
   FUSE_OPT_KEY("-h",		OPTKEY_HELP),
   FUSE_OPT_KEY("--help",	OPTKEY_HELP),
@@ -498,6 +948,64 @@ tahoefs_usage(const char *progname)
 "    --port=port           same as '-p port'\n"
 "    -c cachedir           local cache directory (default: .tahoefs)\n"
 "    --cache-dir=cachedir  same as '-c cachedir'\n"
+"    --shared-cache=dir    store the file contents in dir, shared with the\n"
+"                          other tahoefs processes using the same dir.\n"
+"                          the limits apply to dir as a whole\n"
+"    --peer-addr=host:port serve the cached immutable files to the peers\n"
+"                          on this port.  the peers know this instance\n"
+"                          by this address\n"
+"    --peers=host:port,... ask these peers for immutable files before\n"
+"                          the gateway\n"
+"    --meta-ttl=secs       metadata cache lifetime (default: 5)\n"
+"    --refresh-ahead=secs  refresh hot metadata this long before expiry\n"
+"                          (default: 2, 0 disables)\n"
+"    --refresh-rate=num    max background refreshes per second (default: 10)\n"
+"    --stale-while-revalidate=secs\n"
+"                          serve metadata expired up to this long ago at\n"
+"                          once, and revalidate it in background\n"
+"                          (default: 0, disabled)\n"
+"    --stale-if-error=secs serve metadata expired up to this long ago while\n"
+"                          the gateway is unavailable (default: 3600)\n"
+"    --snapshot            the root is an immutable snapshot.  cache\n"
+"                          everything forever (implied by a DIR2-CHK root)\n"
+"    --poll-interval=secs  poll used directories for remote changes\n"
+"                          (default: 0, disabled).  the kernel sees them\n"
+"                          after entry_timeout/attr_timeout\n"
+"    --prefetch-threads=num\n"
+"                          background fetch workers (default: 4, 0 disables)\n"
+"    --upload-threads=num  upload written files in background with this\n"
+"                          many workers after close.  fsync waits for the\n"
+"                          upload (default: 0, close waits for it)\n"
+"    --readdir-ahead=levels\n"
+"                          on a tree walk, list subdirectories this deep in\n"
+"                          background (default: 1, 0 disables)\n"
+"    --warmup=path         fetch the metadata of the subtree at mount time.\n"
+"                          setting the " TAHOE_XATTR_WARMUP "\n"
+"                          xattr on a directory does the same at any time\n"
+"    --warmup-pattern=glob also cache the contents of files matching glob\n"
+"    --warmup-max-size=bytes\n"
+"                          also cache the contents of files up to this size\n"
+"    --cache-max-size=mb   evict least recently used files when the cache\n"
+"                          grows over this size (default: 0, unlimited)\n"
+"    --cache-max-files=num same for the number of cached files\n"
+"                          (default: 0, unlimited)\n"
+"    --cache-high-water=percent\n"
+"                          start eviction at this percent of the limits\n"
+"                          (default: 95)\n"
+"    --cache-low-water=percent\n"
+"                          stop eviction at this percent of the limits\n"
+"                          (default: 80)\n"
+"    --policy-file=file    cache policies by path prefix, one\n"
+"                          'pin|normal|nocache /prefix' per line.  pinned\n"
+"                          files are kept warm and never evicted, and\n"
+"                          nocache files are dropped after the last close.\n"
+"                          setting the " TAHOE_XATTR_POLICY "\n"
+"                          xattr to a policy name changes it at runtime\n"
+"    --pin-interval=secs   warm up the pinned prefixes again this often\n"
+"                          (default: 600, 0 disables)\n"
+"    --scan-threads=num    check the existing cache in background with\n"
+"                          this many threads at mount time (default: 4,\n"
+"                          0 disables and checks it lazily on access)\n"
 "\n"
 "FUSE options:\n"
 "    -d                    enable debug output (implies -f)\n"
@@ -513,6 +1021,16 @@ main(int argc, char *argv[])
   config.webapi_server = TAHOE_DEFAULT_WEBAPI_SERVER;
   config.webapi_port = TAHOE_DEFAULT_WEBAPI_PORT;
   config.filecache_dir = TAHOE_DEFAULT_FILECACHE_DIR;
+  config.meta_ttl = TAHOE_DEFAULT_META_TTL;
+  config.refresh_ahead = TAHOE_DEFAULT_REFRESH_AHEAD;
+  config.stale_if_error = TAHOE_DEFAULT_STALE_IF_ERROR;
+  config.refresh_rate = TAHOE_DEFAULT_REFRESH_RATE;
+  config.prefetch_threads = TAHOE_DEFAULT_PREFETCH_THREADS;
+  config.readdir_ahead = TAHOE_DEFAULT_READDIR_AHEAD;
+  config.cache_high_water = TAHOE_DEFAULT_CACHE_HIGH_WATER;
+  config.cache_low_water = TAHOE_DEFAULT_CACHE_LOW_WATER;
+  config.pin_interval = TAHOE_DEFAULT_PIN_INTERVAL;
+  config.scan_threads = TAHOE_DEFAULT_SCAN_THREADS;
 
   struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
   if (fuse_opt_parse(&args, &config, tahoefs_opts,
@@ -525,6 +1043,16 @@ main(int argc, char *argv[])
       err(EXIT_FAILURE, "failed to get your ROOT_CAP information.");
     }
   }
+  if (TAHOEFS_IS_IMMUTABLE_DIRCAP(config.root_cap)) {
+    config.snapshot = 1;
+  }
+  if (config.cache_low_water > config.cache_high_water) {
+    errx(EXIT_FAILURE, "the low water mark exceeds the high water mark.");
+  }
+  if (config.snapshot) {
+    /* nothing under the root can change.  let the kernel cache it. */
+    fuse_opt_add_arg(&args, TAHOE_SNAPSHOT_FUSE_OPTS);
+  }
 
   return fuse_main(args.argc, args.argv, &tahoe_oper, NULL);
 }
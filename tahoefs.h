@@ -25,13 +25,35 @@
 #ifndef _TAHOEFS_H_
 #define _TAHOEFS_H_
 
-#define TAHOEFS_CAPABILITY_SIZE 128
 typedef struct tahoefs_global_config {
   const char *tahoe_dir;
   const char *root_cap;
   const char *webapi_server;
   const char *webapi_port;
   const char *filecache_dir;
+  const char *shared_cache_dir;
+  const char *peer_addr;	/* host:port of this instance. */
+  const char *peers;		/* comma separated host:port. */
+  int snapshot;
+  int poll_interval;
+  int prefetch_threads;
+  int upload_threads;	/* 0 uploads on close. */
+  int readdir_ahead;
+  const char *warmup_path;
+  const char *warmup_pattern;
+  int warmup_max_size;
+  int cache_max_size;	/* in megabytes. */
+  int cache_max_files;
+  int cache_high_water;	/* in percent of the budget. */
+  int cache_low_water;
+  const char *policy_file;
+  int pin_interval;	/* in seconds. */
+  int scan_threads;
+  int meta_ttl;
+  int stale_while_revalidate;	/* in seconds after meta_ttl. */
+  int stale_if_error;
+  int refresh_ahead;
+  int refresh_rate;
   int debug;
 } tahoefs_global_config_t;
 extern tahoefs_global_config_t config;
@@ -40,20 +62,35 @@ extern tahoefs_global_config_t config;
 #define TAHOEFS_STAT_TYPE_DIRNODE	1
 #define TAHOEFS_STAT_TYPE_FILENODE	2
 
+/*
+ * the caps are references to the strings interned by the captable
+ * module (NULL if empty).  a tahoefs_stat_t{} filled by json_stub or
+ * copied by captable_tstat_copy() must be released by
+ * captable_tstat_release().
+ */
 typedef struct tahoefs_stat {
-  int type;
-  char rw_uri[TAHOEFS_CAPABILITY_SIZE];
-  char ro_uri[TAHOEFS_CAPABILITY_SIZE];
-  char verify_uri[TAHOEFS_CAPABILITY_SIZE];
-  size_t size;
-  int mutable;
+  u_int64_t size;
   double link_creation_time;
   double link_modification_time;
+  const char *rw_uri;
+  const char *ro_uri;
+  const char *verify_uri;
+  u_int8_t type;
+  u_int8_t mutable;
 } tahoefs_stat_t;
 
+/* a cap of a tahoefs_stat_t{} as a C string. */
+#define TAHOEFS_CAP(cap) ((cap) ? (cap) : "")
+
+/* a cap of an immutable directory.  its whole subtree never changes. */
+#define TAHOEFS_IS_IMMUTABLE_DIRCAP(cap)			\
+  (strncmp((cap), "URI:DIR2-CHK:", 13) == 0			\
+   || strncmp((cap), "URI:DIR2-LIT:", 13) == 0)
+
 typedef struct tahoefs_readdir_baton {
   const char *nodename;
-  const char *infop;
+  const char *infop;		/* the JSON of the node, if available. */
+  const tahoefs_stat_t *tstatp;
   void *nodename_listp;
   void *fillerp;
 } tahoefs_readdir_baton_t;
@@ -0,0 +1,664 @@
+/*
+ * Copyright 2010, 2011 IIJ Innovation Institute Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY IIJ INNOVATION INSTITUTE INC. ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL IIJ INNOVATION INSTITUTE INC. OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifdef __linux__
+#define _XOPEN_SOURCE 700
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/param.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+
+#include "tahoefs.h"
+#include "uploader.h"
+
+/*
+ * the uploader uploads the flushed files in the background with a
+ * fixed number of worker threads (write-back).  uploader_enqueue()
+ * moves the flushed file into the spool directory, named by a serial
+ * number, with the tahoe path recorded in the UPLOADER_PATH_ATTR
+ * xattr.  the spool is the persistent queue: the files left when the
+ * process stops are queued again in the serial order when the
+ * uploader starts next time.
+ *
+ * the uploads of a path are done in the queued order.  a path has at
+ * most one upload running and one waiting.  a newer flush replaces
+ * the waiting one, since only the latest contents matter.  a failed
+ * upload is retried later with a growing delay.
+ */
+#define UPLOADER_PATH_ATTR "user.net.iijlab.tahoefs.upload_path"
+#define UPLOADER_MAX_THREADS 64
+#define UPLOADER_QUEUE_MAX 4096		/* flushes wait beyond this. */
+#define UPLOADER_NBUCKETS 1024
+#define UPLOADER_RETRY_MIN 5		/* in seconds. */
+#define UPLOADER_RETRY_MAX 300
+
+typedef struct uploader_entry {
+  struct uploader_entry *next;		/* in the queued order. */
+  struct uploader_entry *hash_next;
+  unsigned long long serial;
+  char *path;
+  int running;
+  int failed;		/* the last attempt has failed. */
+  int retry_delay;
+  time_t retry_time;
+  int drained;		/* tried once since the uploader stopped. */
+} uploader_entry_t;
+
+static char uploader_spool_dir[MAXPATHLEN];
+static uploader_entry_t *uploader_head = NULL;
+static uploader_entry_t *uploader_tail = NULL;
+static uploader_entry_t *uploader_buckets[UPLOADER_NBUCKETS];
+static size_t uploader_nentries = 0;
+static unsigned long long uploader_serial = 0;
+static pthread_mutex_t uploader_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t uploader_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t uploader_done_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t uploader_threads[UPLOADER_MAX_THREADS];
+static int uploader_nthreads = 0;
+static int uploader_running = 0;
+static uploader_func_t uploader_func = NULL;
+
+static void *uploader_main(void *);
+static uploader_entry_t *uploader_next(time_t, time_t *);
+static void uploader_load(void);
+static int uploader_load_compare(const void *, const void *);
+static uploader_entry_t *uploader_new(unsigned long long, const char *);
+static void uploader_append(uploader_entry_t *);
+static uploader_entry_t *uploader_find(const char *, int);
+static void uploader_remove(uploader_entry_t *);
+static void uploader_spool_path(unsigned long long, char *);
+static unsigned int uploader_hash(const char *);
+
+/*
+ * create the spool directory specified as the spool_dir parameter,
+ * queue the uploads left by the previous run, and start the workers.
+ * the func function is called with the tahoe path and the spool file
+ * to upload, and returns -1 on failure.  the spool file is removed
+ * after a successful upload unless the function has moved it.  if
+ * write-back is disabled, the workers are started only to finish the
+ * uploads left.
+ */
+int
+uploader_start(const char *spool_dir, uploader_func_t func)
+{
+  assert(spool_dir != NULL);
+  assert(func != NULL);
+
+  if (strlen(spool_dir) >= sizeof(uploader_spool_dir)) {
+    warnx("too long spool directory name %s.", spool_dir);
+    return (-1);
+  }
+  if (mkdir(spool_dir, S_IRWXU) == -1 && errno != EEXIST) {
+    warn("failed to create the spool directory %s.", spool_dir);
+    return (-1);
+  }
+
+  pthread_mutex_lock(&uploader_lock);
+  strcpy(uploader_spool_dir, spool_dir);
+  uploader_func = func;
+  uploader_load();
+  int nthreads = config.upload_threads;
+  if (nthreads <= 0) {
+    if (uploader_nentries == 0) {
+      /* write-back is disabled. */
+      pthread_mutex_unlock(&uploader_lock);
+      return (0);
+    }
+    nthreads = 1;
+  }
+  if (nthreads > UPLOADER_MAX_THREADS) {
+    nthreads = UPLOADER_MAX_THREADS;
+  }
+  uploader_running = 1;
+  for (uploader_nthreads = 0; uploader_nthreads < nthreads;
+       uploader_nthreads++) {
+    if (pthread_create(&uploader_threads[uploader_nthreads], NULL,
+		       uploader_main, NULL) != 0) {
+      warnx("failed to create an upload thread.");
+      break;
+    }
+  }
+  if (uploader_nthreads == 0) {
+    uploader_running = 0;
+    pthread_mutex_unlock(&uploader_lock);
+    return (-1);
+  }
+  if (uploader_nentries) {
+    warnx("%lu uploads left by the previous run are queued.",
+	  (unsigned long)uploader_nentries);
+  }
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (0);
+}
+
+/*
+ * stop the workers.  each queued upload is tried once more without
+ * waiting for its retry time, and the ones which still fail are left
+ * in the spool for the next run.
+ */
+int
+uploader_stop(void)
+{
+  pthread_mutex_lock(&uploader_lock);
+  if (uploader_running) {
+    uploader_running = 0;
+    pthread_cond_broadcast(&uploader_cond);
+    pthread_cond_broadcast(&uploader_done_cond);
+    pthread_mutex_unlock(&uploader_lock);
+    int i;
+    for (i = 0; i < uploader_nthreads; i++) {
+      pthread_join(uploader_threads[i], NULL);
+    }
+    uploader_nthreads = 0;
+    pthread_mutex_lock(&uploader_lock);
+  }
+
+  if (uploader_nentries) {
+    warnx("%lu uploads are left for the next run.",
+	  (unsigned long)uploader_nentries);
+  }
+  while (uploader_head) {
+    uploader_remove(uploader_head);
+  }
+  uploader_spool_dir[0] = '\0';
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (0);
+}
+
+/*
+ * queue the upload of the file specified as the file_path parameter
+ * to the tahoe path.  the file is moved into the spool, and must be
+ * on the same file system.  a waiting upload of the path is replaced.
+ * returns -1 if write-back is disabled or the file cannot be spooled,
+ * and the file is left as it is.
+ */
+int
+uploader_enqueue(const char *path, const char *file_path)
+{
+  assert(path != NULL);
+  assert(file_path != NULL);
+
+  pthread_mutex_lock(&uploader_lock);
+  if (config.upload_threads <= 0) {
+    pthread_mutex_unlock(&uploader_lock);
+    return (-1);
+  }
+  while (uploader_running && uploader_nentries >= UPLOADER_QUEUE_MAX) {
+    pthread_cond_wait(&uploader_done_cond, &uploader_lock);
+  }
+  if (!uploader_running) {
+    pthread_mutex_unlock(&uploader_lock);
+    return (-1);
+  }
+
+  /*
+   * the file is spooled holding the lock, so that the uploads of a
+   * path are queued in the serial order.
+   */
+  unsigned long long serial = uploader_serial++;
+  uploader_entry_t *entryp = uploader_new(serial, path);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&uploader_lock);
+    return (-1);
+  }
+  char spool_path[MAXPATHLEN];
+  uploader_spool_path(serial, spool_path);
+  if (setxattr(file_path, UPLOADER_PATH_ATTR, path, strlen(path), 0
+#if defined(__APPLE__)
+	       , 0
+#endif
+	       ) == -1) {
+    warn("failed to record the path of %s.", file_path);
+    pthread_mutex_unlock(&uploader_lock);
+    free(entryp->path);
+    free(entryp);
+    return (-1);
+  }
+  if (rename(file_path, spool_path) == -1) {
+    warn("failed to move %s to the spool.", file_path);
+    pthread_mutex_unlock(&uploader_lock);
+    free(entryp->path);
+    free(entryp);
+    return (-1);
+  }
+
+  uploader_entry_t *waitingp = uploader_find(path, 0);
+  if (waitingp && !waitingp->running) {
+    DEBUGV("uploader: %llx replaces %llx for %s.\n", serial,
+	   waitingp->serial, path);
+    char old_path[MAXPATHLEN];
+    uploader_spool_path(waitingp->serial, old_path);
+    unlink(old_path);
+    uploader_remove(waitingp);
+  }
+  uploader_append(entryp);
+  pthread_cond_signal(&uploader_cond);
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (0);
+}
+
+/*
+ * get the spool file of the latest contents queued for the tahoe
+ * path, which are newer than those at the remote storage.  the
+ * spool_path parameter must have MAXPATHLEN bytes.  returns -1 if
+ * nothing is queued.  the file disappears when the upload finishes,
+ * and the caller must look up again if it cannot be opened.
+ */
+int
+uploader_lookup(const char *path, char *spool_path)
+{
+  assert(path != NULL);
+  assert(spool_path != NULL);
+
+  pthread_mutex_lock(&uploader_lock);
+  uploader_entry_t *entryp = uploader_find(path, 0);
+  if (entryp == NULL) {
+    pthread_mutex_unlock(&uploader_lock);
+    return (-1);
+  }
+  uploader_spool_path(entryp->serial, spool_path);
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (0);
+}
+
+/*
+ * wait until the contents queued for the tahoe path are uploaded.  a
+ * failed upload is retried immediately.  returns -1 if it fails
+ * again, or the uploader is stopped.
+ */
+int
+uploader_wait(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&uploader_lock);
+  uploader_entry_t *entryp = uploader_find(path, 0);
+  if (entryp && !entryp->running) {
+    entryp->failed = 0;
+    entryp->retry_time = 0;
+    pthread_cond_signal(&uploader_cond);
+  }
+  int ret = 0;
+  while ((entryp = uploader_find(path, 0)) != NULL) {
+    if (entryp->failed || !uploader_running) {
+      ret = -1;
+      break;
+    }
+    pthread_cond_wait(&uploader_done_cond, &uploader_lock);
+  }
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (ret);
+}
+
+/*
+ * drop the uploads queued for the tahoe path, which has been removed
+ * or truncated, and wait for the running one so that it doesn't
+ * overwrite what comes next.
+ */
+int
+uploader_cancel(const char *path)
+{
+  assert(path != NULL);
+
+  pthread_mutex_lock(&uploader_lock);
+  uploader_entry_t *entryp;
+  while ((entryp = uploader_find(path, 0)) != NULL) {
+    if (!entryp->running) {
+      char spool_path[MAXPATHLEN];
+      uploader_spool_path(entryp->serial, spool_path);
+      unlink(spool_path);
+      uploader_remove(entryp);
+      pthread_cond_broadcast(&uploader_done_cond);
+      continue;
+    }
+    pthread_cond_wait(&uploader_done_cond, &uploader_lock);
+  }
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (0);
+}
+
+static void *
+uploader_main(void *arg)
+{
+  pthread_mutex_lock(&uploader_lock);
+  for (;;) {
+    time_t now = time(NULL);
+    time_t wakeup = 0;
+    uploader_entry_t *entryp = uploader_next(now, &wakeup);
+    if (entryp == NULL) {
+      if (!uploader_running) {
+	break;
+      }
+      if (wakeup) {
+	struct timespec abstime;
+	abstime.tv_sec = wakeup;
+	abstime.tv_nsec = 0;
+	pthread_cond_timedwait(&uploader_cond, &uploader_lock, &abstime);
+      } else {
+	pthread_cond_wait(&uploader_cond, &uploader_lock);
+      }
+      continue;
+    }
+
+    entryp->running = 1;
+    entryp->failed = 0;
+    if (!uploader_running) {
+      entryp->drained = 1;
+    }
+    char spool_path[MAXPATHLEN];
+    uploader_spool_path(entryp->serial, spool_path);
+    pthread_mutex_unlock(&uploader_lock);
+
+    DEBUGV("uploader: uploading %s for %s.\n", spool_path, entryp->path);
+    int ret = uploader_func(entryp->path, spool_path);
+
+    pthread_mutex_lock(&uploader_lock);
+    entryp->running = 0;
+    if (ret == 0) {
+      unlink(spool_path);
+      uploader_remove(entryp);
+    } else {
+      entryp->failed = 1;
+      entryp->retry_delay = entryp->retry_delay
+	? MIN(entryp->retry_delay * 2, UPLOADER_RETRY_MAX)
+	: UPLOADER_RETRY_MIN;
+      entryp->retry_time = time(NULL) + entryp->retry_delay;
+      warnx("failed to upload %s.  retrying in %d seconds.",
+	    entryp->path, entryp->retry_delay);
+    }
+    /* the next upload of the path may be waiting for this one. */
+    pthread_cond_broadcast(&uploader_cond);
+    pthread_cond_broadcast(&uploader_done_cond);
+  }
+  pthread_mutex_unlock(&uploader_lock);
+
+  return (NULL);
+}
+
+/*
+ * find the first upload which can start now: not running, no upload
+ * of the same path running, and its retry time has come.  while
+ * stopping, each upload is picked once regardless of its retry time.
+ * the wakeupp parameter is set to the earliest retry time in the
+ * future if any.  the caller must hold uploader_lock.
+ */
+static uploader_entry_t *
+uploader_next(time_t now, time_t *wakeupp)
+{
+  assert(wakeupp != NULL);
+
+  uploader_entry_t *entryp;
+  for (entryp = uploader_head; entryp; entryp = entryp->next) {
+    if (entryp->running || uploader_find(entryp->path, 1)) {
+      continue;
+    }
+    if (!uploader_running) {
+      if (!entryp->drained) {
+	return (entryp);
+      }
+      continue;
+    }
+    if (entryp->retry_time <= now) {
+      return (entryp);
+    }
+    if (*wakeupp == 0 || entryp->retry_time < *wakeupp) {
+      *wakeupp = entryp->retry_time;
+    }
+  }
+
+  return (NULL);
+}
+
+/*
+ * queue the spool files in the serial order.  partially spooled files
+ * without the path are removed.  the caller must hold uploader_lock.
+ */
+static void
+uploader_load(void)
+{
+  DIR *dirp = opendir(uploader_spool_dir);
+  if (dirp == NULL) {
+    warn("failed to read the spool directory %s.", uploader_spool_dir);
+    return;
+  }
+  unsigned long long *serials = NULL;
+  size_t nserials = 0;
+  size_t serials_size = 0;
+  struct dirent *dentp;
+  while ((dentp = readdir(dirp)) != NULL) {
+    char *endp;
+    unsigned long long serial = strtoull(dentp->d_name, &endp, 16);
+    if (dentp->d_name[0] == '.' || *endp != '\0') {
+      continue;
+    }
+    if (nserials == serials_size) {
+      size_t new_size = serials_size ? serials_size * 2 : 64;
+      unsigned long long *new_serials
+	= realloc(serials, new_size * sizeof(unsigned long long));
+      if (new_serials == NULL) {
+	warn("failed to allocate memory for the spool.");
+	break;
+      }
+      serials = new_serials;
+      serials_size = new_size;
+    }
+    serials[nserials++] = serial;
+  }
+  closedir(dirp);
+  if (nserials) {
+    qsort(serials, nserials, sizeof(unsigned long long),
+	  uploader_load_compare);
+  }
+
+  size_t i;
+  for (i = 0; i < nserials; i++) {
+    char spool_path[MAXPATHLEN];
+    char path[MAXPATHLEN];
+    uploader_spool_path(serials[i], spool_path);
+    ssize_t path_len = getxattr(spool_path, UPLOADER_PATH_ATTR, path,
+				sizeof(path) - 1
+#if defined(__APPLE__)
+				, 0, 0
+#endif
+				);
+    if (path_len <= 0) {
+      warnx("removing %s without the path.", spool_path);
+      unlink(spool_path);
+      continue;
+    }
+    path[path_len] = '\0';
+    uploader_entry_t *olderp = uploader_find(path, 0);
+    if (olderp) {
+      char older_path[MAXPATHLEN];
+      uploader_spool_path(olderp->serial, older_path);
+      unlink(older_path);
+      uploader_remove(olderp);
+    }
+    DEBUGV("uploader: queuing %s for %s.\n", spool_path, path);
+    uploader_entry_t *entryp = uploader_new(serials[i], path);
+    if (entryp) {
+      uploader_append(entryp);
+    }
+    uploader_serial = serials[i] + 1;
+  }
+  free(serials);
+}
+
+static int
+uploader_load_compare(const void *ap, const void *bp)
+{
+  unsigned long long a = *(const unsigned long long *)ap;
+  unsigned long long b = *(const unsigned long long *)bp;
+
+  return (a < b ? -1 : a > b);
+}
+
+/*
+ * allocate an upload of the serial for the tahoe path.  it is freed by
+ * uploader_remove() once appended.
+ */
+static uploader_entry_t *
+uploader_new(unsigned long long serial, const char *path)
+{
+  assert(path != NULL);
+
+  uploader_entry_t *entryp = calloc(1, sizeof(uploader_entry_t));
+  if (entryp == NULL) {
+    warn("failed to allocate memory for an upload.");
+    return (NULL);
+  }
+  entryp->path = strdup(path);
+  if (entryp->path == NULL) {
+    warn("failed to duplicate a string (%s).", path);
+    free(entryp);
+    return (NULL);
+  }
+  entryp->serial = serial;
+
+  return (entryp);
+}
+
+/*
+ * add the upload at the tail of the queue.  the caller must hold
+ * uploader_lock.
+ */
+static void
+uploader_append(uploader_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  uploader_entry_t **bucketp
+    = &uploader_buckets[uploader_hash(entryp->path) % UPLOADER_NBUCKETS];
+  entryp->hash_next = *bucketp;
+  *bucketp = entryp;
+  if (uploader_tail) {
+    uploader_tail->next = entryp;
+  } else {
+    uploader_head = entryp;
+  }
+  uploader_tail = entryp;
+  uploader_nentries++;
+}
+
+/*
+ * find the upload of the tahoe path: the running one if the running
+ * parameter is true, or else the latest one.  the caller must hold
+ * uploader_lock.
+ */
+static uploader_entry_t *
+uploader_find(const char *path, int running)
+{
+  assert(path != NULL);
+
+  uploader_entry_t *foundp = NULL;
+  uploader_entry_t *entryp;
+  for (entryp = uploader_buckets[uploader_hash(path) % UPLOADER_NBUCKETS];
+       entryp; entryp = entryp->hash_next) {
+    if (strcmp(entryp->path, path) != 0) {
+      continue;
+    }
+    if (running) {
+      if (entryp->running) {
+	return (entryp);
+      }
+    } else if (foundp == NULL || entryp->serial > foundp->serial) {
+      foundp = entryp;
+    }
+  }
+
+  return (foundp);
+}
+
+/*
+ * unlink the upload from the queue and free it.  the spool file is
+ * left.  the caller must hold uploader_lock.
+ */
+static void
+uploader_remove(uploader_entry_t *entryp)
+{
+  assert(entryp != NULL);
+
+  uploader_entry_t **entrypp = &uploader_head;
+  uploader_entry_t *prevp = NULL;
+  while (*entrypp != entryp) {
+    prevp = *entrypp;
+    entrypp = &(*entrypp)->next;
+  }
+  *entrypp = entryp->next;
+  if (uploader_tail == entryp) {
+    uploader_tail = prevp;
+  }
+
+  entrypp = &uploader_buckets[uploader_hash(entryp->path) % UPLOADER_NBUCKETS];
+  while (*entrypp != entryp) {
+    entrypp = &(*entrypp)->hash_next;
+  }
+  *entrypp = entryp->hash_next;
+  uploader_nentries--;
+
+  free(entryp->path);
+  free(entryp);
+}
+
+static void
+uploader_spool_path(unsigned long long serial, char *spool_path)
+{
+  assert(spool_path != NULL);
+
+  snprintf(spool_path, MAXPATHLEN, "%s/%016llx", uploader_spool_dir, serial);
+}
+
+static unsigned int
+uploader_hash(const char *path)
+{
+  assert(path != NULL);
+
+  /* FNV-1a */
+  unsigned int hash = 2166136261U;
+  while (*path) {
+    hash ^= (unsigned char)*path++;
+    hash *= 16777619U;
+  }
+  return (hash);
+}